@@ -0,0 +1,243 @@
+/*
+ * libcurly arena - bump allocation for trees built by the parser
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * An arena hands out zeroed memory from large chunks, and never frees
+ * anything until the whole arena goes away. Chunks start out small, so
+ * that small trees don't waste memory, and double in size up to a limit.
+ *
+ * The parser allocates nodes and attributes from the arena while it
+ * builds a tree. Once the tree is complete, the arena is
+ * sealed, and any later changes to the tree are allocated on the heap,
+ * so that memory released by them can be reused.
+ *
+ * Nodes and attributes in the arena do not hold references to their
+ * atoms and origins themselves. The arena holds one reference to each
+ * of them instead, and drops them all when it goes away. Until the tree
+ * is changed after sealing the arena, nothing in it owns any memory
+ * outside the arena either, and freeing the tree does not have to
+ * visit its nodes at all; curly_arena_touch() records that this no
+ * longer holds.
+ */
+#define CURLY_ARENA_CHUNK_MIN	(16 * 1024)
+#define CURLY_ARENA_CHUNK_MAX	(1024 * 1024)
+#define CURLY_ARENA_ALIGN	16
+
+struct curly_arena_chunk {
+	struct curly_arena_chunk *next;
+};
+
+/* A set of pointers, each of which the arena holds one reference to */
+struct curly_arena_refs {
+	unsigned int	size;		/* number of slots, a power of 2 */
+	unsigned int	count;
+	void **		slots;
+};
+
+struct curly_arena {
+	struct curly_arena_chunk *chunks;
+	char *		pos;
+	char *		end;
+	size_t		chunk_size;
+	bool		sealed;
+	bool		touched;
+
+	struct curly_arena_refs atoms;
+	struct curly_arena_refs paths;
+};
+
+#define CURLY_ARENA_CHUNK_HDR	((sizeof(struct curly_arena_chunk) + CURLY_ARENA_ALIGN - 1) & ~(CURLY_ARENA_ALIGN - 1))
+
+curly_arena_t *
+curly_arena_new(void)
+{
+	curly_arena_t *arena;
+
+	arena = calloc(1, sizeof(*arena));
+	arena->chunk_size = CURLY_ARENA_CHUNK_MIN;
+	return arena;
+}
+
+void
+curly_arena_free(curly_arena_t *arena)
+{
+	struct curly_arena_chunk *chunk;
+	unsigned int i;
+
+	for (i = 0; i < arena->atoms.size; ++i)
+		curly_atom_unref(arena->atoms.slots[i]);
+	free(arena->atoms.slots);
+
+	for (i = 0; i < arena->paths.size; ++i) {
+		curly_origin_t origin = { .path = arena->paths.slots[i] };
+
+		curly_origin_destroy(&origin);
+	}
+	free(arena->paths.slots);
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+void *
+curly_arena_alloc(curly_arena_t *arena, size_t size)
+{
+	struct curly_arena_chunk *chunk;
+	size_t chunk_size;
+	void *p;
+
+	size = (size + CURLY_ARENA_ALIGN - 1) & ~(CURLY_ARENA_ALIGN - 1);
+	if (size > (size_t) (arena->end - arena->pos)) {
+		chunk_size = arena->chunk_size;
+		if (chunk_size < CURLY_ARENA_CHUNK_MAX)
+			arena->chunk_size *= 2;
+		if (chunk_size < CURLY_ARENA_CHUNK_HDR + size)
+			chunk_size = CURLY_ARENA_CHUNK_HDR + size;
+
+		/* For chunks this large, glibc's calloc() usually
+		 * maps fresh pages, which are zeroed already */
+		chunk = calloc(1, chunk_size);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+
+		arena->pos = (char *) chunk + CURLY_ARENA_CHUNK_HDR;
+		arena->end = (char *) chunk + chunk_size;
+	}
+
+	p = arena->pos;
+	arena->pos += size;
+	return p;
+}
+
+/*
+ * Stop handing out memory for new allocations; the caller should use
+ * the heap from now on.
+ */
+void
+curly_arena_seal(curly_arena_t *arena)
+{
+	arena->sealed = true;
+}
+
+bool
+curly_arena_sealed(const curly_arena_t *arena)
+{
+	return arena->sealed;
+}
+
+/*
+ * Record that nodes or attributes in the arena may now own memory or
+ * references of their own, or be shared by other nodes
+ */
+void
+curly_arena_touch(curly_arena_t *arena)
+{
+	arena->touched = true;
+}
+
+bool
+curly_arena_touched(const curly_arena_t *arena)
+{
+	return arena->touched;
+}
+
+static inline unsigned int
+__curly_arena_ref_hash(const void *p)
+{
+	return ((uintptr_t) p * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static void
+__curly_arena_refs_insert(struct curly_arena_refs *refs, void *p)
+{
+	unsigned int mask = refs->size - 1, i;
+
+	for (i = __curly_arena_ref_hash(p) & mask; refs->slots[i]; i = (i + 1) & mask)
+		;
+	refs->slots[i] = p;
+	refs->count++;
+}
+
+/*
+ * Add p to the set, and return false if it was there already
+ */
+static bool
+__curly_arena_refs_add(struct curly_arena_refs *refs, void *p)
+{
+	unsigned int mask = refs->size - 1, old_size = refs->size, i;
+	void **old_slots = refs->slots;
+
+	if (old_size != 0) {
+		for (i = __curly_arena_ref_hash(p) & mask; refs->slots[i]; i = (i + 1) & mask) {
+			if (refs->slots[i] == p)
+				return false;
+		}
+	}
+
+	if (2 * (refs->count + 1) > old_size) {
+		refs->size = old_size? 2 * old_size : 64;
+		refs->slots = calloc(refs->size, sizeof(refs->slots[0]));
+		refs->count = 0;
+		for (i = 0; i < old_size; ++i) {
+			if (old_slots[i])
+				__curly_arena_refs_insert(refs, old_slots[i]);
+		}
+		free(old_slots);
+	}
+
+	__curly_arena_refs_insert(refs, p);
+	return true;
+}
+
+/*
+ * Hand a reference to an atom over to the arena, for use by a node or
+ * attribute in it
+ */
+char *
+curly_arena_hold_atom(curly_arena_t *arena, char *value)
+{
+	/* We hold one already, so this one can't be the last */
+	if (value != NULL && !__curly_arena_refs_add(&arena->atoms, value))
+		curly_atom_unref(value);
+	return value;
+}
+
+/*
+ * Hold a reference to an origin path, for use by a node in the arena
+ */
+curly_shared_string_t *
+curly_arena_hold_path(curly_arena_t *arena, curly_shared_string_t *path)
+{
+	curly_origin_t origin = { NULL };
+
+	if (path != NULL && __curly_arena_refs_add(&arena->paths, path))
+		curly_origin_set(&origin, path, 0);
+	return path;
+}
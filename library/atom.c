@@ -0,0 +1,218 @@
+/*
+ * libcurly atom table - shared storage for type names, attribute names
+ * and values
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * Every string stored in a tree is interned here, and the tree refers
+ * to the value[] member of the atom. Equal strings thus share storage,
+ * and two strings taken from trees are equal iff the pointers are.
+ *
+ * Atoms are reference counted, and removed from the table when the last
+ * reference goes away. Trees may be built, copied and freed in several
+ * threads at once. Taking and dropping references is done with atomic
+ * operations; only dropping the last one takes the table lock, so that
+ * nobody can find the atom while we remove it. Looking up a string takes
+ * the lock shared, and adding a new atom takes it exclusively.
+ */
+#define CURLY_ATOM_TABLE_MIN	256
+
+static struct curly_atom_table {
+	pthread_rwlock_t lock;
+	unsigned int	size;		/* number of buckets, a power of 2 */
+	unsigned int	count;
+	curly_atom_t **	buckets;
+} __curly_atoms = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static inline void
+__curly_atom_link(curly_atom_t **head, curly_atom_t *atom)
+{
+	if ((atom->next = *head) != NULL)
+		atom->next->pprev = &atom->next;
+	atom->pprev = head;
+	*head = atom;
+}
+
+static void
+__curly_atom_table_resize(struct curly_atom_table *table, unsigned int size)
+{
+	curly_atom_t **buckets, *atom;
+	unsigned int i;
+
+	buckets = calloc(size, sizeof(buckets[0]));
+	for (i = 0; i < table->size; ++i) {
+		while ((atom = table->buckets[i]) != NULL) {
+			table->buckets[i] = atom->next;
+			__curly_atom_link(&buckets[atom->hash & (size - 1)], atom);
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+}
+
+static curly_atom_t *
+__curly_atom_lookup(struct curly_atom_table *table, const char *s, size_t len, uint64_t hash)
+{
+	curly_atom_t *atom;
+
+	if (table->size == 0)
+		return NULL;
+
+	for (atom = table->buckets[hash & (table->size - 1)]; atom; atom = atom->next) {
+		if (atom->hash == hash && atom->len == len && !memcmp(atom->value, s, len))
+			return atom;
+	}
+	return NULL;
+}
+
+static curly_atom_t *
+__curly_atom_get(const char *s, size_t len)
+{
+	struct curly_atom_table *table = &__curly_atoms;
+	uint64_t hash = curly_hash_bytes(CURLY_HASH_INIT, s, len);
+	curly_atom_t *atom;
+
+	/* Whoever drops the last reference to an atom needs the lock
+	 * exclusively, so the atom can't go away under us */
+	pthread_rwlock_rdlock(&table->lock);
+	if ((atom = __curly_atom_lookup(table, s, len, hash)) != NULL)
+		__atomic_add_fetch(&atom->refcount, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&table->lock);
+
+	if (atom != NULL)
+		return atom;
+
+	/* Someone may have added it since we looked */
+	pthread_rwlock_wrlock(&table->lock);
+	if ((atom = __curly_atom_lookup(table, s, len, hash)) != NULL) {
+		__atomic_add_fetch(&atom->refcount, 1, __ATOMIC_RELAXED);
+	} else {
+		atom = malloc(sizeof(*atom) + len + 1);
+		atom->hash = hash;
+		atom->len = len;
+		atom->refcount = 1;
+		memcpy(atom->value, s, len);
+		atom->value[len] = '\0';
+
+		if (table->count >= table->size)
+			__curly_atom_table_resize(table, table->size? 2 * table->size : CURLY_ATOM_TABLE_MIN);
+
+		__curly_atom_link(&table->buckets[hash & (table->size - 1)], atom);
+		table->count++;
+	}
+	pthread_rwlock_unlock(&table->lock);
+
+	return atom;
+}
+
+static void
+__curly_atom_put(curly_atom_t *atom)
+{
+	struct curly_atom_table *table = &__curly_atoms;
+	unsigned int refcount;
+
+	/* Unless this may be the last reference, just drop it */
+	refcount = __atomic_load_n(&atom->refcount, __ATOMIC_RELAXED);
+	while (refcount > 1) {
+		if (__atomic_compare_exchange_n(&atom->refcount, &refcount, refcount - 1,
+						true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	/* Others may still find the atom and take a reference until we
+	 * hold the lock */
+	pthread_rwlock_wrlock(&table->lock);
+	if (__atomic_sub_fetch(&atom->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		if ((*atom->pprev = atom->next) != NULL)
+			atom->next->pprev = atom->pprev;
+		table->count--;
+		free(atom);
+
+		if (table->count == 0) {
+			free(table->buckets);
+			table->buckets = NULL;
+			table->size = 0;
+		}
+	}
+	pthread_rwlock_unlock(&table->lock);
+}
+
+/*
+ * Internal interface, used by the tree code
+ */
+char *
+curly_atom_intern(const curly_slice_t *s)
+{
+	if (s->ptr == NULL)
+		return NULL;
+	return __curly_atom_get(s->ptr, s->len)->value;
+}
+
+/*
+ * The caller holds a reference already, so the atom can't go away
+ */
+char *
+curly_atom_ref(char *value)
+{
+	if (value != NULL)
+		__atomic_add_fetch(&curly_atom_of(value)->refcount, 1, __ATOMIC_RELAXED);
+	return value;
+}
+
+void
+curly_atom_unref(char *value)
+{
+	if (value != NULL)
+		__curly_atom_put(curly_atom_of(value));
+}
+
+/*
+ * Public interface
+ */
+curly_atom_t *
+curly_atom(const char *string)
+{
+	if (string == NULL)
+		return NULL;
+	return __curly_atom_get(string, strlen(string));
+}
+
+void
+curly_atom_release(curly_atom_t *atom)
+{
+	if (atom != NULL)
+		__curly_atom_put(atom);
+}
+
+const char *
+curly_atom_string(const curly_atom_t *atom)
+{
+	return atom? atom->value : NULL;
+}
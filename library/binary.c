@@ -0,0 +1,760 @@
+/*
+ * libcurly binary format - a compact serialization of a config tree
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * The file consists of a header followed by these sections:
+ *
+ *  - the files the tree was read from, with a hash of their contents
+ *  - the nodes, in pre-order; node 0 is the root
+ *  - the attributes
+ *  - the attribute values, as string references
+ *  - the string table; every string is stored once, NUL terminated
+ *
+ * Nodes and attributes refer to each other by index, and to strings
+ * by their offset in the string table. CURLY_BIN_NONE stands for a NULL
+ * pointer. Since this is meant as a local cache rather than an exchange
+ * format, all numbers are in host byte order; the version field doubles
+ * as a byte order check.
+ */
+#define CURLY_BIN_MAGIC		"CURLYBIN"
+#define CURLY_BIN_VERSION	0x00000001
+#define CURLY_BIN_NONE		0xffffffffU
+
+struct curly_bin_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nsources;
+	uint32_t	nnodes;
+	uint32_t	nattrs;
+	uint32_t	nvalues;
+	uint32_t	strings_size;
+};
+
+struct curly_bin_source {
+	uint64_t	hash;
+	uint32_t	path;
+	uint32_t	flags;
+};
+
+#define CURLY_BIN_SOURCE_GLOB	0x0001
+
+struct curly_bin_node {
+	uint32_t	type;
+	uint32_t	name;
+	uint32_t	origin_path;
+	uint32_t	origin_line;
+	uint32_t	first_child;
+	uint32_t	next;
+	uint32_t	first_attr;
+};
+
+struct curly_bin_attr {
+	uint32_t	name;
+	uint32_t	next;
+	uint32_t	first_value;
+	uint32_t	nvalues;
+};
+
+/*
+ * Serializing a tree
+ */
+typedef struct curly_bin_writer {
+	struct curly_bin_node *nodes;
+	unsigned int	nnodes, nodes_size;
+
+	struct curly_bin_attr *attrs;
+	unsigned int	nattrs, attrs_size;
+
+	uint32_t *	values;
+	unsigned int	nvalues, values_size;
+
+	char *		strings;
+	size_t		strings_len, strings_size;
+
+	/* open hash of string offsets (plus one, so that 0 means empty) */
+	uint32_t *	string_hash;
+	unsigned int	string_hash_size, nstrings;
+} curly_bin_writer_t;
+
+#define __curly_bin_grow(array, count, size) do { \
+	if ((count) >= (size)) { \
+		(size) = 2 * (size) + 16; \
+		(array) = realloc((array), (size) * sizeof((array)[0])); \
+	} \
+} while (0)
+
+static void
+__curly_bin_string_rehash(curly_bin_writer_t *w)
+{
+	unsigned int i, size = 2 * w->string_hash_size + 64;
+	uint32_t *table = calloc(size, sizeof(table[0]));
+
+	for (i = 0; i < w->string_hash_size; ++i) {
+		uint32_t ref = w->string_hash[i];
+		const char *s;
+		unsigned int h;
+
+		if (ref == 0)
+			continue;
+
+		s = w->strings + ref - 1;
+		h = curly_hash_bytes(CURLY_HASH_INIT, s, strlen(s)) % size;
+		while (table[h])
+			h = (h + 1) % size;
+		table[h] = ref;
+	}
+
+	free(w->string_hash);
+	w->string_hash = table;
+	w->string_hash_size = size;
+}
+
+static uint32_t
+__curly_bin_string(curly_bin_writer_t *w, const char *s)
+{
+	size_t len;
+	uint32_t offset;
+	unsigned int h;
+
+	if (s == NULL)
+		return CURLY_BIN_NONE;
+
+	if (2 * (w->nstrings + 1) > w->string_hash_size)
+		__curly_bin_string_rehash(w);
+
+	len = strlen(s);
+	h = curly_hash_bytes(CURLY_HASH_INIT, s, len) % w->string_hash_size;
+	while (w->string_hash[h]) {
+		offset = w->string_hash[h] - 1;
+		if (!strcmp(w->strings + offset, s))
+			return offset;
+		h = (h + 1) % w->string_hash_size;
+	}
+
+	if (w->strings_len + len + 1 > w->strings_size) {
+		w->strings_size = 2 * (w->strings_len + len + 1) + 1024;
+		w->strings = realloc(w->strings, w->strings_size);
+	}
+
+	offset = w->strings_len;
+	memcpy(w->strings + offset, s, len + 1);
+	w->strings_len += len + 1;
+
+	w->string_hash[h] = offset + 1;
+	w->nstrings++;
+	return offset;
+}
+
+static uint32_t
+__curly_bin_put_attrs(curly_bin_writer_t *w, const curly_attr_t *attr)
+{
+	uint32_t first = CURLY_BIN_NONE, prev = CURLY_BIN_NONE;
+
+	for (; attr; attr = attr->next) {
+		uint32_t index = w->nattrs++;
+		unsigned int i;
+
+		__curly_bin_grow(w->attrs, index, w->attrs_size);
+		w->attrs[index].name = __curly_bin_string(w, attr->name);
+		w->attrs[index].next = CURLY_BIN_NONE;
+		w->attrs[index].first_value = w->nvalues;
+		w->attrs[index].nvalues = attr->nvalues;
+
+		for (i = 0; i < attr->nvalues; ++i) {
+			uint32_t ref = __curly_bin_string(w, attr->values[i]);
+
+			__curly_bin_grow(w->values, w->nvalues, w->values_size);
+			w->values[w->nvalues++] = ref;
+		}
+
+		if (prev == CURLY_BIN_NONE)
+			first = index;
+		else
+			w->attrs[prev].next = index;
+		prev = index;
+	}
+
+	return first;
+}
+
+static uint32_t
+__curly_bin_put_node(curly_bin_writer_t *w, const curly_node_t *node)
+{
+	uint32_t index = w->nnodes++, prev = CURLY_BIN_NONE;
+	const curly_node_t *child;
+	struct curly_bin_node *rec;
+
+	__curly_bin_grow(w->nodes, index, w->nodes_size);
+	rec = &w->nodes[index];
+	rec->type = __curly_bin_string(w, node->type);
+	rec->name = __curly_bin_string(w, node->name);
+	rec->origin_path = __curly_bin_string(w, node->origin.path? node->origin.path->value : NULL);
+	rec->origin_line = node->origin.line;
+	rec->first_child = CURLY_BIN_NONE;
+	rec->next = CURLY_BIN_NONE;
+	rec->first_attr = __curly_bin_put_attrs(w, curly_node_contents(node)->attrs);
+
+	/* Note: the recursion may reallocate w->nodes, so do not hold on to rec */
+	for (child = curly_node_contents(node)->children; child; child = child->next) {
+		uint32_t child_index = __curly_bin_put_node(w, child);
+
+		if (prev == CURLY_BIN_NONE)
+			w->nodes[index].first_child = child_index;
+		else
+			w->nodes[prev].next = child_index;
+		prev = child_index;
+	}
+
+	return index;
+}
+
+static void
+__curly_bin_writer_destroy(curly_bin_writer_t *w)
+{
+	free(w->nodes);
+	free(w->attrs);
+	free(w->values);
+	free(w->strings);
+	free(w->string_hash);
+}
+
+static bool
+__curly_bin_fwrite(FILE *fp, const void *data, size_t size)
+{
+	return size == 0 || fwrite(data, size, 1, fp) == 1;
+}
+
+static bool
+__curly_bin_write_fp(const curly_node_t *cfg, FILE *fp)
+{
+	struct curly_bin_source *sources = NULL;
+	struct curly_bin_header hdr;
+	curly_bin_writer_t w;
+	curly_source_t *list;
+	unsigned int i, count;
+	bool ok;
+
+	memset(&w, 0, sizeof(w));
+	__curly_bin_put_node(&w, cfg);
+
+	list = curly_source_list(cfg, &count);
+	if (count) {
+		sources = calloc(count, sizeof(sources[0]));
+		for (i = 0; i < count; ++i) {
+			sources[i].hash = list[i].hash;
+			sources[i].path = __curly_bin_string(&w, list[i].path);
+			if (list[i].glob)
+				sources[i].flags |= CURLY_BIN_SOURCE_GLOB;
+		}
+	}
+	free(list);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CURLY_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = CURLY_BIN_VERSION;
+	hdr.nsources = count;
+	hdr.nnodes = w.nnodes;
+	hdr.nattrs = w.nattrs;
+	hdr.nvalues = w.nvalues;
+	hdr.strings_size = w.strings_len;
+
+	ok = __curly_bin_fwrite(fp, &hdr, sizeof(hdr))
+	  && __curly_bin_fwrite(fp, sources, count * sizeof(sources[0]))
+	  && __curly_bin_fwrite(fp, w.nodes, w.nnodes * sizeof(w.nodes[0]))
+	  && __curly_bin_fwrite(fp, w.attrs, w.nattrs * sizeof(w.attrs[0]))
+	  && __curly_bin_fwrite(fp, w.values, w.nvalues * sizeof(w.values[0]))
+	  && __curly_bin_fwrite(fp, w.strings, w.strings_len)
+	  && fflush(fp) == 0;
+
+	free(sources);
+	__curly_bin_writer_destroy(&w);
+	return ok;
+}
+
+/*
+ * Write to a temporary file first and rename it, so that concurrent
+ * readers never see a partially written file.
+ */
+static int
+__curly_bin_write(const curly_node_t *cfg, const char *path, bool quiet)
+{
+	char tmp_path[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int) sizeof(tmp_path))
+		return -1;
+
+	if ((fd = mkstemp(tmp_path)) < 0) {
+		if (!quiet)
+			fprintf(stderr, "Unable to create %s: %m\n", tmp_path);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL || !__curly_bin_write_fp(cfg, fp)) {
+		if (!quiet)
+			fprintf(stderr, "%s: write error: %m\n", tmp_path);
+		goto failed;
+	}
+	fclose(fp);
+	fp = NULL;
+
+	if (rename(tmp_path, path) < 0) {
+		if (!quiet)
+			fprintf(stderr, "Unable to rename %s to %s: %m\n", tmp_path, path);
+		goto failed;
+	}
+	return 0;
+
+failed:
+	if (fp)
+		fclose(fp);
+	else
+		close(fd);
+	unlink(tmp_path);
+	return -1;
+}
+
+/*
+ * Loading a tree
+ */
+typedef struct curly_bin_reader {
+	const struct curly_bin_header *hdr;
+	const struct curly_bin_source *sources;
+	const struct curly_bin_node *nodes;
+	const struct curly_bin_attr *attrs;
+	const uint32_t *values;
+	const char *	strings;
+
+	/* All origins pointing to the same file share a string */
+	struct {
+		uint32_t	offset;
+		curly_origin_t	origin;
+	} *		origins;
+	unsigned int	norigins;
+} curly_bin_reader_t;
+
+static bool
+__curly_bin_reader_init(curly_bin_reader_t *r, const void *data, size_t size)
+{
+	const struct curly_bin_header *hdr = data;
+	const char *pos = data;
+	size_t need;
+
+	memset(r, 0, sizeof(*r));
+	if (size < sizeof(*hdr)
+	 || memcmp(hdr->magic, CURLY_BIN_MAGIC, sizeof(hdr->magic))
+	 || hdr->version != CURLY_BIN_VERSION
+	 || hdr->nnodes == 0)
+		return false;
+
+	need = sizeof(*hdr)
+	     + (size_t) hdr->nsources * sizeof(r->sources[0])
+	     + (size_t) hdr->nnodes * sizeof(r->nodes[0])
+	     + (size_t) hdr->nattrs * sizeof(r->attrs[0])
+	     + (size_t) hdr->nvalues * sizeof(r->values[0])
+	     + hdr->strings_size;
+	if (need != size)
+		return false;
+
+	/* Make sure every string offset refers to a NUL terminated string */
+	if (hdr->strings_size && pos[size - 1] != '\0')
+		return false;
+
+	r->hdr = hdr;
+	pos += sizeof(*hdr);
+	r->sources = (const void *) pos;
+	pos += hdr->nsources * sizeof(r->sources[0]);
+	r->nodes = (const void *) pos;
+	pos += hdr->nnodes * sizeof(r->nodes[0]);
+	r->attrs = (const void *) pos;
+	pos += hdr->nattrs * sizeof(r->attrs[0]);
+	r->values = (const void *) pos;
+	pos += hdr->nvalues * sizeof(r->values[0]);
+	r->strings = pos;
+	return true;
+}
+
+static void
+__curly_bin_reader_destroy(curly_bin_reader_t *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->norigins; ++i)
+		curly_origin_destroy(&r->origins[i].origin);
+	free(r->origins);
+}
+
+static bool
+__curly_bin_get_string(const curly_bin_reader_t *r, uint32_t ref, const char **ret)
+{
+	if (ref == CURLY_BIN_NONE) {
+		*ret = NULL;
+		return true;
+	}
+	if (ref >= r->hdr->strings_size)
+		return false;
+	*ret = r->strings + ref;
+	return true;
+}
+
+static bool
+__curly_bin_set_origin(curly_bin_reader_t *r, curly_node_t *node, uint32_t ref, unsigned int line)
+{
+	const char *path;
+	unsigned int i;
+
+	if (!__curly_bin_get_string(r, ref, &path))
+		return false;
+	if (path == NULL)
+		return true;
+
+	for (i = 0; i < r->norigins; ++i) {
+		if (r->origins[i].offset == ref)
+			break;
+	}
+
+	if (i == r->norigins) {
+		r->origins = realloc(r->origins, (i + 1) * sizeof(r->origins[0]));
+		r->origins[i].offset = ref;
+		curly_origin_init(&r->origins[i].origin, path);
+		r->norigins++;
+	}
+
+	curly_origin_set(&node->origin, r->origins[i].origin.path, line);
+	return true;
+}
+
+static bool
+__curly_bin_get_attrs(curly_bin_reader_t *r, curly_node_t *node, uint32_t index)
+{
+	const char **values = NULL;
+	bool ok = true;
+
+	while (ok && index != CURLY_BIN_NONE) {
+		const struct curly_bin_attr *rec;
+		const char *name;
+		unsigned int i;
+
+		/* Attributes are written in order, which rules out loops */
+		if (index >= r->hdr->nattrs)
+			break;
+		rec = &r->attrs[index];
+
+		if (rec->next != CURLY_BIN_NONE && rec->next <= index)
+			break;
+		if (!__curly_bin_get_string(r, rec->name, &name) || name == NULL
+		 || rec->first_value > r->hdr->nvalues
+		 || rec->nvalues > r->hdr->nvalues - rec->first_value)
+			break;
+
+		if (rec->nvalues == 0) {
+			curly_slice_t name_slice = curly_slice_from_string(name);
+			curly_slice_t none = { NULL, 0 };
+
+			curly_node_add_attr_list_slice(node, &name_slice, &none);
+		} else {
+			values = realloc(values, (rec->nvalues + 1) * sizeof(values[0]));
+			for (i = 0; ok && i < rec->nvalues; ++i) {
+				ok = __curly_bin_get_string(r, r->values[rec->first_value + i], &values[i])
+				  && values[i] != NULL;
+			}
+			values[i] = NULL;
+
+			if (ok)
+				curly_node_set_attr_list(node, name, values);
+		}
+
+		index = rec->next;
+	}
+
+	free(values);
+	return ok && index == CURLY_BIN_NONE;
+}
+
+static bool
+__curly_bin_get_node(curly_bin_reader_t *r, curly_node_t *node, uint32_t index)
+{
+	const struct curly_bin_node *rec = &r->nodes[index];
+	curly_node_t **tail = &node->children;
+	curly_slice_t type_slice, name_slice;
+	const char *type, *name;
+	uint32_t child_index;
+
+	if (!__curly_bin_get_string(r, rec->type, &type)
+	 || !__curly_bin_get_string(r, rec->name, &name)
+	 || !__curly_bin_set_origin(r, node, rec->origin_path, rec->origin_line)
+	 || !__curly_bin_get_attrs(r, node, rec->first_attr))
+		return false;
+
+	type_slice = curly_slice_from_string(type);
+	name_slice = curly_slice_from_string(name);
+	curly_atom_unref(node->type);
+	node->type = curly_atom_intern(&type_slice);
+	curly_atom_unref(node->name);
+	node->name = curly_atom_intern(&name_slice);
+
+	/* Nodes are written in pre-order, so children and siblings
+	 * always come after their predecessor. */
+	for (child_index = rec->first_child; child_index != CURLY_BIN_NONE; ) {
+		curly_node_t *child;
+
+		if (child_index <= index || child_index >= r->hdr->nnodes)
+			return false;
+
+		child = curly_node_new();
+		child->parent = node;
+		*tail = child;
+		tail = &child->next;
+
+		if (!__curly_bin_get_node(r, child, child_index))
+			return false;
+
+		index = child_index;
+		child_index = r->nodes[child_index].next;
+	}
+
+	curly_node_index_children(node);
+	return true;
+}
+
+static curly_node_t *
+__curly_bin_decode(curly_bin_reader_t *r)
+{
+	curly_node_t *cfg;
+
+	cfg = curly_node_new();
+	if (!__curly_bin_get_node(r, cfg, 0)) {
+		curly_node_free(cfg);
+		cfg = NULL;
+	}
+
+	return cfg;
+}
+
+static void *
+__curly_bin_map(const char *path, size_t *size_ret, bool quiet)
+{
+	struct stat stb;
+	void *addr;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (!quiet)
+			fprintf(stderr, "%s: %m\n", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode) || stb.st_size == 0) {
+		if (!quiet)
+			fprintf(stderr, "%s: not a regular file\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		if (!quiet)
+			fprintf(stderr, "%s: cannot map file: %m\n", path);
+		return NULL;
+	}
+
+	*size_ret = stb.st_size;
+	return addr;
+}
+
+static bool
+__curly_bin_file_hash(const char *path, uint64_t *hash_ret)
+{
+	struct stat stb;
+	void *addr;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return false;
+
+	if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	*hash_ret = CURLY_HASH_INIT;
+	if (stb.st_size == 0) {
+		close(fd);
+		return true;
+	}
+
+	addr = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+
+	*hash_ret = curly_hash_bytes(CURLY_HASH_INIT, addr, stb.st_size);
+	munmap(addr, stb.st_size);
+	return true;
+}
+
+/*
+ * The cache is only valid if none of the files the tree was read from
+ * changed, and all wildcard includes still match the same files. The
+ * first source is the top-level file, which we check under the name
+ * the caller gave us.
+ */
+static bool
+__curly_bin_sources_unchanged(const curly_bin_reader_t *r, const char *path)
+{
+	unsigned int i;
+
+	if (r->hdr->nsources == 0)
+		return false;
+
+	for (i = 0; i < r->hdr->nsources; ++i) {
+		const struct curly_bin_source *src = &r->sources[i];
+		const char *name;
+		uint64_t hash;
+
+		if (i == 0)
+			name = path;
+		else if (!__curly_bin_get_string(r, src->path, &name) || name == NULL)
+			return false;
+
+		if (src->flags & CURLY_BIN_SOURCE_GLOB) {
+			if (!curly_glob_hash(name, &hash))
+				return false;
+		} else if (!__curly_bin_file_hash(name, &hash))
+			return false;
+
+		if (hash != src->hash)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * A tree from the cache remembers the files it was read from, just like
+ * one we parsed, so that it can be reloaded.
+ */
+static bool
+__curly_bin_restore_sources(const curly_bin_reader_t *r, const char *path, curly_node_t *cfg)
+{
+	curly_source_t *list;
+	unsigned int i;
+	bool ok = true;
+
+	list = calloc(r->hdr->nsources, sizeof(list[0]));
+	for (i = 0; ok && i < r->hdr->nsources; ++i) {
+		const struct curly_bin_source *src = &r->sources[i];
+
+		if (i == 0)
+			list[i].path = path;
+		else
+			ok = __curly_bin_get_string(r, src->path, &list[i].path) && list[i].path != NULL;
+		list[i].hash = src->hash;
+		list[i].glob = !!(src->flags & CURLY_BIN_SOURCE_GLOB);
+	}
+
+	ok = ok && curly_source_list_restore(cfg, list, r->hdr->nsources);
+	free(list);
+	return ok;
+}
+
+/*
+ * Public functions
+ */
+int
+curly_node_write_binary(const curly_node_t *cfg, const char *path)
+{
+	return __curly_bin_write(cfg, path, false);
+}
+
+curly_node_t *
+curly_node_read_binary(const char *path)
+{
+	curly_bin_reader_t r;
+	curly_node_t *cfg = NULL;
+	size_t size;
+	void *data;
+
+	if (!(data = __curly_bin_map(path, &size, false)))
+		return NULL;
+
+	if (!__curly_bin_reader_init(&r, data, size)) {
+		fprintf(stderr, "%s: not a valid binary config file\n", path);
+	} else {
+		if (!(cfg = __curly_bin_decode(&r)))
+			fprintf(stderr, "%s: corrupted binary config file\n", path);
+		__curly_bin_reader_destroy(&r);
+	}
+
+	munmap(data, size);
+	return cfg;
+}
+
+/*
+ * Cache lookups fail silently; the caller will simply parse the
+ * text file instead.
+ */
+curly_node_t *
+curly_binary_cache_load(const char *path, const char *cache_path)
+{
+	curly_bin_reader_t r;
+	curly_node_t *cfg = NULL;
+	size_t size;
+	void *data;
+
+	if (!(data = __curly_bin_map(cache_path, &size, true)))
+		return NULL;
+
+	if (__curly_bin_reader_init(&r, data, size)) {
+		if (__curly_bin_sources_unchanged(&r, path)
+		 && (cfg = __curly_bin_decode(&r)) != NULL
+		 && !__curly_bin_restore_sources(&r, path, cfg)) {
+			curly_node_free(cfg);
+			cfg = NULL;
+		}
+		__curly_bin_reader_destroy(&r);
+	}
+
+	munmap(data, size);
+	return cfg;
+}
+
+void
+curly_binary_cache_store(const curly_node_t *cfg, const char *cache_path)
+{
+	(void) __curly_bin_write(cfg, cache_path, true);
+}
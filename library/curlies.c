@@ -21,25 +21,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "curlies.h"
 #include "internal.h"
 
-static curly_node_t *	__curly_node_new(const char *type, const char *name);
+static curly_node_t *	__curly_node_new(curly_arena_t *, const curly_slice_t *type, const curly_slice_t *name);
+static curly_node_t *	__curly_node_dup(const curly_node_t *src);
 static void		__curly_node_free(curly_node_t *cfg);
-static void		__curly_attr_list_free(curly_attr_t **);
-static void		__curly_attr_list_assign(curly_attr_t **, const char *, const char *);
-static void		__curly_attr_list_append(curly_attr_t **, const char *, const char *);
-static void		__curly_attr_list_assign_list(curly_attr_t **, const char *, const char * const *);
-static void		__curly_attr_list_copy(curly_attr_t **dst, const curly_attr_t *src);
-static void		__curly_attr_list_drop(curly_attr_t **, const char *);
+static void		__curly_child_index_free(curly_node_t *cfg);
+static void		__curly_node_modify(curly_node_t *cfg);
+static void		__curly_node_cow_detach_users(curly_node_t *cfg);
+static void		__curly_node_cow_unlink(curly_node_t *cfg);
+static void		__curly_attr_list_free(curly_node_t *);
+static void		__curly_attr_list_assign(curly_node_t *, const curly_slice_t *, const curly_slice_t *);
+static void		__curly_attr_list_append(curly_node_t *, const curly_slice_t *, const curly_slice_t *);
+static void		__curly_attr_list_append_slices(curly_node_t *, const curly_slice_t *, const curly_slice_t *, unsigned int);
+static void		__curly_attr_list_assign_list(curly_node_t *, const curly_slice_t *, const char * const *);
+static void		__curly_attr_list_copy(curly_node_t *dst, const curly_attr_t *src);
+static void		__curly_attr_list_drop(curly_node_t *, const curly_slice_t *);
 static const char **	__curly_attr_list_get_names(curly_attr_t * const*);
-static const char *	__curly_attr_list_get_string(curly_attr_t **, const char *);
-static const char * const *__curly_attr_list_get_list_value(curly_attr_t **, const char *);
-static curly_attr_t *	__curly_attr_new(const char *name);
+static const char *	__curly_attr_list_get_string(curly_node_t *, const char *);
+static const char * const *__curly_attr_list_get_list_value(curly_node_t *, const char *);
+static curly_attr_t *	__curly_attr_list_get_attr(curly_node_t *, const curly_slice_t *, unsigned int);
+static curly_attr_t *	__curly_attr_list_get_attr_atom(curly_node_t *, const curly_atom_t *);
+static curly_attr_t *	__curly_attr_new(curly_arena_t *, const curly_slice_t *name, unsigned int count);
+static void		__curly_attr_append(curly_arena_t *, curly_attr_t *attr, const curly_slice_t *value);
 static curly_attr_t *	__curly_attr_clone(const curly_attr_t *src_attr);
 static void		__curly_attr_free(curly_attr_t *attr);
 static void		__curly_attr_clear(curly_attr_t *attr);
+static void		__curly_attr_index_build(curly_node_t *cfg);
+static curly_attr_t *	__curly_attr_index_tail(const curly_node_t *cfg);
 
 static inline int
 xstrcmp(const char *a, const char *b)
@@ -49,37 +62,163 @@ xstrcmp(const char *a, const char *b)
 	return strcmp(a, b);
 }
 
+/* Same as above, but compare a string to a slice */
+static inline int
+xslicecmp(const char *a, const curly_slice_t *b)
+{
+	if (a == NULL || b->ptr == NULL)
+		return a == b->ptr;
+	return !curly_slice_equal(b, a);
+}
+
 /*
  * Constructor
  */
 curly_node_t *
 curly_node_new(void)
 {
-	return __curly_node_new("root", NULL);
+	curly_slice_t type = curly_slice_from_string("root");
+	curly_slice_t name = { NULL, 0 };
+	curly_node_t *cfg;
+
+	cfg = __curly_node_new(NULL, &type, &name);
+	cfg->generation = curly_tree_generation_new();
+	return cfg;
+}
+
+/*
+ * Initial generation of a new tree
+ */
+uint64_t
+curly_tree_generation_new(void)
+{
+	static uint64_t trees;
+
+	return __atomic_add_fetch(&trees, 1, __ATOMIC_RELAXED) << 32;
+}
+
+/*
+ * Record a change to the tree that cfg belongs to
+ */
+static inline void
+__curly_node_changed(curly_node_t *cfg)
+{
+	for (; cfg->parent; cfg = cfg->parent)
+		cfg->contents_hash_valid = false;
+	cfg->contents_hash_valid = false;
+	cfg->generation++;
+
+	/* Changes after parsing are allocated from the heap */
+	if (cfg->arena && curly_arena_sealed(cfg->arena))
+		curly_arena_touch(cfg->arena);
+}
+
+/*
+ * Create an empty root node whose descendants are allocated from an
+ * arena, until the arena is sealed
+ */
+curly_node_t *
+curly_node_new_arena(void)
+{
+	curly_node_t *cfg;
+
+	cfg = curly_node_new();
+	cfg->arena = curly_arena_new();
+	return cfg;
+}
+
+/*
+ * Return the arena that new children and attributes of this node
+ * should be allocated from, if any
+ */
+static inline curly_arena_t *
+__curly_node_arena(const curly_node_t *cfg)
+{
+	if (cfg->arena && !curly_arena_sealed(cfg->arena))
+		return cfg->arena;
+	return NULL;
 }
 
 static curly_node_t *
-__curly_node_new(const char *type, const char *name)
+__curly_node_new(curly_arena_t *arena, const curly_slice_t *type, const curly_slice_t *name)
 {
 	curly_node_t *cfg;
 
-	cfg = (curly_node_t *) calloc(1, sizeof(*cfg));
-	cfg->type = type? strdup(type) : NULL;
-	cfg->name = name? strdup(name) : NULL;
+	if (arena) {
+		cfg = curly_arena_alloc(arena, sizeof(*cfg));
+		cfg->arena = arena;
+		cfg->in_arena = true;
+		cfg->type = curly_arena_hold_atom(arena, curly_atom_intern(type));
+		cfg->name = curly_arena_hold_atom(arena, curly_atom_intern(name));
+	} else {
+		cfg = (curly_node_t *) calloc(1, sizeof(*cfg));
+		cfg->type = curly_atom_intern(type);
+		cfg->name = curly_atom_intern(name);
+	}
 	/* cfg->origin is initialized with 0s, which is safe */
 	return cfg;
 }
 
+/*
+ * Create an empty node with the same type and name as src
+ */
+static curly_node_t *
+__curly_node_dup(const curly_node_t *src)
+{
+	curly_node_t *cfg;
+
+	cfg = (curly_node_t *) calloc(1, sizeof(*cfg));
+	cfg->type = curly_atom_ref(src->type);
+	cfg->name = curly_atom_ref(src->name);
+	return cfg;
+}
+
 /*
  * Destructor
  */
 void
 curly_node_free(curly_node_t *cfg)
 {
-	curly_origin_destroy(&cfg->origin);
+	/* A snapshot is freed as a whole, along with its root */
+	if (cfg->frozen) {
+		if (cfg->parent == NULL)
+			curly_frozen_put(cfg);
+		return;
+	}
+
+	if (cfg->cow_users)
+		__curly_node_cow_detach_users(cfg);
+	if (cfg->cow_src)
+		__curly_node_cow_unlink(cfg);
+
+	if (!cfg->in_arena)
+		curly_origin_destroy(&cfg->origin);
+	if (cfg->sources)
+		curly_include_cache_free(cfg->sources);
+	if (cfg->journal)
+		curly_journal_detach(cfg->journal);
 	__curly_node_free(cfg);
 }
 
+/*
+ * Snapshots made by curly_node_freeze() cannot be modified
+ */
+static bool
+__curly_node_is_frozen(const curly_node_t *cfg, const char *what)
+{
+	if (cfg->frozen == NULL)
+		return false;
+
+	fprintf(stderr, "Cannot %s: %s node is frozen\n", what, cfg->type);
+	return true;
+}
+
+bool
+curly_node_is_frozen(const curly_node_t *cfg)
+{
+	return cfg->frozen != NULL;
+}
+
 static void
 __curly_node_clear(curly_node_t *cfg)
 {
@@ -88,27 +227,40 @@ __curly_node_clear(curly_node_t *cfg)
 	/* This function clears out all children and attributes,
 	 * but leaves the type/name information intact
 	 */
+	__curly_child_index_free(cfg);
 	while ((child = cfg->children) != NULL) {
 		cfg->children = child->next;
 		curly_node_free(child);
 	}
 
-	__curly_attr_list_free(&cfg->attrs);
+	__curly_attr_list_free(cfg);
 }
 
 static void
 __curly_node_free(curly_node_t *cfg)
 {
+	/* Unless the tree was changed since it was parsed, everything
+	 * below the root is in the arena, and goes away along with it */
+	if (cfg->arena && !cfg->in_arena && !curly_arena_touched(cfg->arena)) {
+		cfg->children = NULL;
+		cfg->child_index = NULL;
+		cfg->attrs = NULL;
+		cfg->attr_index = NULL;
+	}
+
 	__curly_node_clear(cfg);
 
-	if (cfg->type)
-		free(cfg->type);
+	/* Nodes in an arena go away along with it; the root owns it */
+	if (cfg->in_arena)
+		return;
+
+	curly_atom_unref(cfg->type);
 	cfg->type = NULL;
 
-	if (cfg->name)
-		free(cfg->name);
+	curly_atom_unref(cfg->name);
 	cfg->name = NULL;
-
+	if (cfg->arena)
+		curly_arena_free(cfg->arena);
 	free(cfg);
 }
 
@@ -124,322 +276,1788 @@ curly_node_type(const curly_node_t *cfg)
 	return cfg->type;
 }
 
+/*
+ * Record where a node was defined. The arena holds the origins of
+ * the nodes in it.
+ */
+void
+curly_node_set_origin(curly_node_t *cfg, curly_shared_string_t *path, unsigned int line)
+{
+	if (cfg->in_arena) {
+		cfg->origin.path = curly_arena_hold_path(cfg->arena, path);
+		cfg->origin.line = line;
+	} else {
+		curly_origin_set(&cfg->origin, path, line);
+	}
+}
+
+/*
+ * Iterators do not register with the node; they notice the change
+ * when they see a different modcount.
+ */
+static inline void
+__curly_node_invalidate_iterators(curly_node_t *cfg, const curly_node_t *child)
+{
+	cfg->modcount++;
+}
+
+/*
+ * Once a node has more than a handful of children, we index them by
+ * (type, name) in a hash table, and remember the tail of the list.
+ * The hash chains are kept in list order, so the first match in a
+ * chain is also the first match in the list.
+ *
+ * The index only ever answers exact lookups. A child with a NULL type
+ * or name matches any type or name, and a lookup with a NULL type or
+ * name matches any child; these cases fall back to a linear search.
+ *
+ * The index is maintained by add_child and drop_child; code that
+ * rebuilds the list of children wholesale calls
+ * curly_node_index_children() afterwards.
+ */
+#define CURLY_CHILD_INDEX_THRESHOLD	16
+
+struct curly_child_index {
+	unsigned int	size;		/* number of buckets, a power of 2 */
+	unsigned int	count;
+	unsigned int	nwild;		/* children with a NULL type or name */
+	curly_node_t *	tail;
+	curly_node_t **	buckets;
+
+	/* Built while parsing into an arena */
+	bool		in_arena;
+	bool		buckets_in_arena;
+};
+
+/*
+ * The hash of a child combines the hashes of its type and name, so that
+ * for nodes in the tree we can use the hashes cached in their atoms.
+ */
+static inline uint64_t
+__curly_child_hash_combine(uint64_t type_hash, uint64_t name_hash)
+{
+	return type_hash ^ (name_hash * 0x9e3779b97f4a7c15ULL);
+}
+
+static inline uint64_t
+__curly_child_hash(const curly_slice_t *type, const curly_slice_t *name)
+{
+	return __curly_child_hash_combine(
+			curly_hash_bytes(CURLY_HASH_INIT, type->ptr, type->len),
+			curly_hash_bytes(CURLY_HASH_INIT, name->ptr, name->len));
+}
+
+static inline uint64_t
+__curly_child_hash_node(const curly_node_t *child)
+{
+	return __curly_child_hash_combine(
+			child->type? curly_atom_hash(child->type) : CURLY_HASH_INIT,
+			child->name? curly_atom_hash(child->name) : CURLY_HASH_INIT);
+}
+
+static void
+__curly_child_index_insert(struct curly_child_index *idx, curly_node_t *child)
+{
+	curly_node_t **pos;
+
+	pos = &idx->buckets[__curly_child_hash_node(child) & (idx->size - 1)];
+	while (*pos)
+		pos = &(*pos)->hash_next;
+	*pos = child;
+	child->hash_next = NULL;
+
+	if (child->type == NULL || child->name == NULL)
+		idx->nwild++;
+	idx->count++;
+}
+
 static void
-__curly_node_attach_iterator(curly_node_t *cfg, curly_iter_t *iter)
+__curly_child_index_remove(struct curly_child_index *idx, curly_node_t *child)
 {
-	iter->chain = cfg->iterators;
-	cfg->iterators = iter;
+	curly_node_t **pos;
+
+	pos = &idx->buckets[__curly_child_hash_node(child) & (idx->size - 1)];
+	while (*pos && *pos != child)
+		pos = &(*pos)->hash_next;
+	if (*pos == NULL)
+		return;
+
+	*pos = child->hash_next;
+	child->hash_next = NULL;
+
+	if (child->type == NULL || child->name == NULL)
+		idx->nwild--;
+	idx->count--;
 }
 
 static void
-__curly_node_detach_iterator(curly_node_t *cfg, const curly_iter_t *iter)
+__curly_child_index_fill(curly_node_t *cfg, struct curly_child_index *idx, unsigned int size)
 {
-	curly_iter_t **pos, *rover;
+	curly_arena_t *arena = __curly_node_arena(cfg);
+	curly_node_t *child;
 
-	for (pos = &cfg->iterators; (rover = *pos) != NULL; pos = &rover->chain) {
-		if (rover == iter) {
-			*pos = rover->chain;
-			rover->chain = NULL;
-			return;
+	if (!idx->buckets_in_arena)
+		free(idx->buckets);
+	if (arena)
+		idx->buckets = curly_arena_alloc(arena, size * sizeof(idx->buckets[0]));
+	else
+		idx->buckets = calloc(size, sizeof(idx->buckets[0]));
+	idx->buckets_in_arena = (arena != NULL);
+	idx->size = size;
+	idx->count = idx->nwild = 0;
+	idx->tail = NULL;
+
+	for (child = cfg->children; child; child = child->next) {
+		__curly_child_index_insert(idx, child);
+		idx->tail = child;
+	}
+}
+
+static void
+__curly_child_index_free(curly_node_t *cfg)
+{
+	struct curly_child_index *idx = cfg->child_index;
+
+	if (idx) {
+		if (!idx->buckets_in_arena)
+			free(idx->buckets);
+		if (!idx->in_arena)
+			free(idx);
+		cfg->child_index = NULL;
+	}
+}
+
+/*
+ * (Re-)build the index if the node has enough children to warrant one
+ */
+void
+curly_node_index_children(curly_node_t *cfg)
+{
+	unsigned int count = 0, size = 64;
+	curly_arena_t *arena;
+	curly_node_t *child;
+
+	/* Snapshots have sorted arrays instead */
+	if (cfg->frozen)
+		return;
+
+	__curly_child_index_free(cfg);
+
+	for (child = cfg->children; child; child = child->next)
+		count++;
+	if (count < CURLY_CHILD_INDEX_THRESHOLD)
+		return;
+
+	while (size < count)
+		size <<= 1;
+
+	if ((arena = __curly_node_arena(cfg)) != NULL) {
+		cfg->child_index = curly_arena_alloc(arena, sizeof(struct curly_child_index));
+		cfg->child_index->in_arena = true;
+	} else {
+		cfg->child_index = calloc(1, sizeof(struct curly_child_index));
+	}
+	__curly_child_index_fill(cfg, cfg->child_index, size);
+}
+
+/*
+ * Append a child to the list, and add it to the index
+ */
+static void
+__curly_node_append_child(curly_node_t *cfg, curly_node_t *child)
+{
+	struct curly_child_index *idx = cfg->child_index;
+	curly_node_t **pos;
+	unsigned int count = 0;
+
+	child->parent = cfg;
+	child->next = NULL;
+
+	if (idx != NULL) {
+		idx->tail->next = child;
+		idx->tail = child;
+
+		__curly_child_index_insert(idx, child);
+		if (idx->count > idx->size)
+			__curly_child_index_fill(cfg, idx, 2 * idx->size);
+		return;
+	}
+
+	for (pos = &cfg->children; *pos; pos = &(*pos)->next)
+		count++;
+	*pos = child;
+
+	if (count + 1 >= CURLY_CHILD_INDEX_THRESHOLD)
+		curly_node_index_children(cfg);
+}
+
+/*
+ * Accessor functions for child nodes
+ */
+curly_node_t *
+curly_node_get_child_slice(const curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name)
+{
+	const struct curly_child_index *idx;
+	curly_node_t *child;
+
+	/* We return one of our children, so we need stand-ins */
+	curly_node_cow_children(cfg);
+	idx = cfg->child_index;
+
+	if (cfg->frozen && cfg->frozen->nwild == 0 && type->ptr && name->ptr)
+		return curly_frozen_get_child(cfg, type, name);
+
+	if (idx && idx->nwild == 0 && type->ptr && name->ptr) {
+		child = idx->buckets[__curly_child_hash(type, name) & (idx->size - 1)];
+		for (; child; child = child->hash_next) {
+			if (curly_slice_equal(type, child->type) && curly_slice_equal(name, child->name))
+				return child;
+		}
+		return NULL;
+	}
+
+	for (child = cfg->children; child; child = child->next) {
+		if (type->ptr && xslicecmp(child->type, type))
+			continue;
+		if (name->ptr && xslicecmp(child->name, name))
+			continue;
+		return child;
+	}
+	return NULL;
+}
+
+/*
+ * Same as above, but with atoms. Since all strings in the tree are
+ * atoms as well, we can compare pointers.
+ */
+curly_node_t *
+curly_node_get_child_atom(const curly_node_t *cfg, const curly_atom_t *type, const curly_atom_t *name)
+{
+	const struct curly_child_index *idx;
+	curly_node_t *child;
+
+	curly_node_cow_children(cfg);
+	idx = cfg->child_index;
+
+	if (cfg->frozen && cfg->frozen->nwild == 0 && type && name) {
+		curly_slice_t type_slice = { type->value, type->len };
+		curly_slice_t name_slice = { name->value, name->len };
+
+		return curly_frozen_get_child(cfg, &type_slice, &name_slice);
+	}
+
+	if (idx && idx->nwild == 0 && type && name) {
+		child = idx->buckets[__curly_child_hash_combine(type->hash, name->hash) & (idx->size - 1)];
+		for (; child; child = child->hash_next) {
+			if (child->type == type->value && child->name == name->value)
+				return child;
+		}
+		return NULL;
+	}
+
+	for (child = cfg->children; child; child = child->next) {
+		if (type && child->type && child->type != type->value)
+			continue;
+		if (name && child->name && child->name != name->value)
+			continue;
+		return child;
+	}
+	return NULL;
+}
+
+curly_node_t *
+curly_node_get_child(const curly_node_t *cfg, const char *type, const char *name)
+{
+	curly_slice_t type_slice = curly_slice_from_string(type);
+	curly_slice_t name_slice = curly_slice_from_string(name);
+
+	return curly_node_get_child_slice(cfg, &type_slice, &name_slice);
+}
+
+curly_node_t *
+curly_node_add_child_slice(curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name)
+{
+	curly_node_t *child;
+
+	if (__curly_node_is_frozen(cfg, "add child"))
+		return NULL;
+
+	__curly_node_modify(cfg);
+	if (curly_node_get_child_slice(cfg, type, name) != NULL) {
+		fprintf(stderr, "duplicate %.*s group named \"%.*s\"\n",
+				(int) type->len, type->ptr,
+				(int) name->len, name->ptr);
+		return NULL;
+	}
+
+	child = __curly_node_new(__curly_node_arena(cfg), type, name);
+	__curly_node_append_child(cfg, child);
+	return child;
+}
+
+curly_node_t *
+curly_node_add_child(curly_node_t *cfg, const char *type, const char *name)
+{
+	curly_slice_t type_slice = curly_slice_from_string(type);
+	curly_slice_t name_slice = curly_slice_from_string(name);
+	curly_journal_t *journal;
+	curly_node_t *child;
+
+	child = curly_node_add_child_slice(cfg, &type_slice, &name_slice);
+	if (child && (journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_add_child(journal, cfg, type, name);
+	return child;
+}
+
+unsigned int
+curly_node_drop_child(curly_node_t *cfg, const curly_node_t *child)
+{
+	struct curly_child_index *idx;
+	curly_node_t *cur, *prev = NULL, **pos;
+	curly_journal_t *journal;
+	unsigned int count = 0;
+
+	if (__curly_node_is_frozen(cfg, "drop child"))
+		return 0;
+
+	__curly_node_modify(cfg);
+	idx = cfg->child_index;
+
+	if (child->parent == cfg && (journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_drop_child(journal, child);
+
+	__curly_node_invalidate_iterators(cfg, child);
+
+	for (pos = &cfg->children; (cur = *pos) != NULL; ) {
+		if (cur == child) {
+			*pos = cur->next;
+			cur->next = NULL;
+
+			if (idx) {
+				__curly_child_index_remove(idx, cur);
+				if (idx->tail == cur)
+					idx->tail = prev;
+			}
+
+			curly_node_free(cur);
+			count += 1;
+		} else {
+			prev = cur;
+			pos = &cur->next;
 		}
 	}
+
+	if (idx && idx->count == 0)
+		__curly_child_index_free(cfg);
+
+	return count;
+}
+
+/*
+ * Return the names of all children of the given type, in an array the
+ * caller must free. curly_iter_init() does the same without allocating.
+ */
+const char **
+curly_node_get_children(const curly_node_t *cfg, const char *type)
+{
+	const curly_node_t *node;
+	unsigned int n, count;
+	const char **result;
+
+	cfg = curly_node_contents(cfg);
+	for (count = 0, node = cfg->children; node; node = node->next) {
+		if (type == NULL || !xstrcmp(node->type, type))
+			count++;
+	}
+
+	result = calloc(count + 1, sizeof(result[0]));
+	for (n = 0, node = cfg->children; n < count; node = node->next) {
+		if (type == NULL || !xstrcmp(node->type, type))
+			result[n++] = node->name;
+	}
+	result[n++] = NULL;
+
+	return result;
+}
+
+
+const char **
+curly_node_get_attr_names(const curly_node_t *cfg)
+{
+	return __curly_attr_list_get_names(&curly_node_contents(cfg)->attrs);
+}
+
+/*
+ * Copy all attributes and children from one config node to another
+ */
+static void
+__curly_node_copy(curly_node_t *dst, const curly_node_t *src)
+{
+	const curly_node_t *src_child;
+	curly_node_t **pos;
+
+	src = curly_node_contents(src);
+
+	__curly_node_modify(dst);
+	__curly_node_clear(dst);
+	__curly_attr_list_copy(dst, src->attrs);
+
+	pos = &dst->children;
+	for (src_child = src->children; src_child; src_child = src_child->next) {
+		curly_node_t *clone;
+
+		/* Recursively create a deep copy of the child node */
+		clone = __curly_node_dup(src_child);
+		clone->parent = dst;
+		__curly_node_copy(clone, src_child);
+
+		/* Append to list */
+		*pos = clone;
+		pos = &clone->next;
+	}
+
+	curly_node_index_children(dst);
+}
+
+void
+curly_node_copy(curly_node_t *dst, const curly_node_t *src)
+{
+	curly_journal_t *journal;
+
+	if (__curly_node_is_frozen(dst, "copy"))
+		return;
+
+	__curly_node_copy(dst, src);
+	if ((journal = curly_node_journal(dst)) != NULL)
+		curly_journal_copy(journal, dst);
+}
+
+/*
+ * Copy on write.
+ * Instead of copying the contents of src, make dst refer to them. Only
+ * when either node is modified does dst get a copy of src's attributes,
+ * and stand-ins for its children, which in turn refer to the children
+ * of src, and so on.
+ *
+ * Any node whose contents are shared keeps a list of the nodes sharing
+ * them; before it is modified or freed, it gives each of them a copy.
+ */
+static void
+__curly_node_cow_link(curly_node_t *cfg, curly_node_t *src)
+{
+	cfg->cow_src = src;
+	if ((cfg->cow_next = src->cow_users) != NULL)
+		cfg->cow_next->cow_pprev = &cfg->cow_next;
+	cfg->cow_pprev = &src->cow_users;
+	src->cow_users = cfg;
+
+	/* src now has to detach its users before it goes away */
+	if (src->arena)
+		curly_arena_touch(src->arena);
+}
+
+static void
+__curly_node_cow_unlink(curly_node_t *cfg)
+{
+	if ((*cfg->cow_pprev = cfg->cow_next) != NULL)
+		cfg->cow_next->cow_pprev = cfg->cow_pprev;
+	cfg->cow_next = NULL;
+	cfg->cow_pprev = NULL;
+	cfg->cow_src = NULL;
+}
+
+static void
+__curly_node_cow_stand_ins(curly_node_t *cfg, const curly_node_t *src)
+{
+	const curly_node_t *src_child;
+	curly_node_t *stub, **pos;
+
+	pos = &cfg->children;
+	for (src_child = src->children; src_child; src_child = src_child->next) {
+		stub = __curly_node_dup(src_child);
+		stub->parent = cfg;
+		curly_origin_set(&stub->origin, src_child->origin.path, src_child->origin.line);
+		__curly_node_cow_link(stub, (curly_node_t *) curly_node_contents(src_child));
+
+		*pos = stub;
+		pos = &stub->next;
+	}
+
+	curly_node_index_children(cfg);
+}
+
+/*
+ * Give a node that shares the contents of another one its own copy
+ */
+void
+curly_node_unshare(curly_node_t *cfg)
+{
+	const curly_node_t *src;
+
+	if (cfg->cow_src == NULL)
+		return;
+
+	__curly_node_changed(cfg);
+
+	src = curly_node_contents(cfg);
+	__curly_node_cow_unlink(cfg);
+
+	__curly_attr_list_copy(cfg, src->attrs);
+	if (!cfg->cow_children)
+		__curly_node_cow_stand_ins(cfg, src);
+	cfg->cow_children = false;
+}
+
+/*
+ * Give a copy on write stand-ins for the children it shares, so that
+ * lookups can return them. This does not change what the tree looks
+ * like, and is safe with other readers of the tree; just not with
+ * anyone modifying the copy, or the node it shares.
+ */
+static pthread_mutex_t	__curly_cow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+curly_node_cow_children(const curly_node_t *cfg)
+{
+	curly_node_t *node = (curly_node_t *) cfg;
+
+	if (node->cow_src == NULL || __atomic_load_n(&node->cow_children, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&__curly_cow_lock);
+	if (!node->cow_children) {
+		__curly_node_cow_stand_ins(node, curly_node_contents(node));
+		__atomic_store_n(&node->cow_children, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&__curly_cow_lock);
+}
+
+static void
+__curly_node_cow_detach_users(curly_node_t *cfg)
+{
+	while (cfg->cow_users)
+		curly_node_unshare(cfg->cow_users);
+}
+
+static void
+__curly_node_cow_detach_path(curly_node_t *cfg)
+{
+	if (cfg->parent)
+		__curly_node_cow_detach_path(cfg->parent);
+	if (cfg->cow_users)
+		__curly_node_cow_detach_users(cfg);
+}
+
+/*
+ * Nodes sharing the contents of an ancestor of cfg see cfg through it.
+ * Before cfg is modified, give them copies all the way down, so that
+ * the ones standing in for cfg share its contents directly, and are
+ * detached from it in turn.
+ *
+ * Conversely, if cfg is a stand-in, its ancestors only have stand-ins
+ * for children, and still share their contents. They need their own
+ * before cfg differs from what they share.
+ */
+static void
+__curly_node_cow_own_path(curly_node_t *cfg)
+{
+	if (cfg->parent)
+		__curly_node_cow_own_path(cfg->parent);
+	if (cfg->cow_src)
+		curly_node_unshare(cfg);
+}
+
+static void
+__curly_node_cow_isolate(curly_node_t *cfg)
+{
+	const curly_node_t *node;
+
+	for (node = cfg->parent; node; node = node->parent) {
+		if (node->cow_users) {
+			__curly_node_cow_detach_path(cfg->parent);
+			break;
+		}
+	}
+
+	if (cfg->parent)
+		__curly_node_cow_own_path(cfg->parent);
+}
+
+/*
+ * Must be called before changing the attributes or children of a node
+ */
+static void
+__curly_node_modify(curly_node_t *cfg)
+{
+	__curly_node_changed(cfg);
+	__curly_node_cow_isolate(cfg);
+	if (cfg->cow_users)
+		__curly_node_cow_detach_users(cfg);
+	if (cfg->cow_src)
+		curly_node_unshare(cfg);
+}
+
+void
+curly_node_copy_cow(curly_node_t *dst, const curly_node_t *src)
+{
+	curly_journal_t *journal;
+	const curly_node_t *node;
+
+	if (__curly_node_is_frozen(dst, "copy"))
+		return;
+
+	src = curly_node_contents(src);
+
+	/* Sharing the contents of an ancestor would create a loop */
+	for (node = dst; node; node = node->parent) {
+		if (node == src) {
+			curly_node_copy(dst, src);
+			return;
+		}
+	}
+
+	__curly_node_invalidate_iterators(dst, NULL);
+	__curly_node_changed(dst);
+	__curly_node_cow_isolate(dst);
+	if (dst->cow_users)
+		__curly_node_cow_detach_users(dst);
+	if (dst->cow_src)
+		__curly_node_cow_unlink(dst);
+	__curly_node_clear(dst);
+	dst->cow_children = false;
+
+	__curly_node_cow_link(dst, (curly_node_t *) src);
+
+	if ((journal = curly_node_journal(dst)) != NULL)
+		curly_journal_copy(journal, dst);
+}
+
+/*
+ * Drop all children and attributes of a node
+ */
+void
+curly_node_clear(curly_node_t *cfg)
+{
+	if (__curly_node_is_frozen(cfg, "clear"))
+		return;
+
+	__curly_node_invalidate_iterators(cfg, NULL);
+	__curly_node_modify(cfg);
+	__curly_node_clear(cfg);
+}
+
+/*
+ * Update the contents of dst to match those of src, reusing all nodes
+ * that exist in both trees. The changed callback is invoked for every node
+ * whose attributes or list of children changed, and for every node that
+ * was added. Returns the number of nodes reported.
+ */
+static bool
+__curly_attr_equal(const curly_attr_t *a, const curly_attr_t *b)
+{
+	unsigned int n;
+
+	/* All strings are atoms, so we can compare pointers */
+	if (a->name != b->name || a->nvalues != b->nvalues)
+		return false;
+	for (n = 0; n < a->nvalues; ++n) {
+		if (a->values[n] != b->values[n])
+			return false;
+	}
+	return true;
+}
+
+bool
+curly_attr_list_equal(const curly_attr_t *a, const curly_attr_t *b)
+{
+	for (; a && b; a = a->next, b = b->next) {
+		if (!__curly_attr_equal(a, b))
+			return false;
+	}
+	return a == NULL && b == NULL;
+}
+
+static unsigned int
+__curly_node_update(curly_node_t *dst, const curly_node_t *src,
+			void (*changed)(curly_node_t *, void *), void *user_data,
+			bool added)
+{
+	const curly_node_t *src_child;
+	curly_node_t **old, *child, **pos;
+	unsigned int i, nold = 0, cursor = 0, count = 0;
+	bool modified = added;
+
+	__curly_node_modify(dst);
+	curly_node_set_origin(dst, src->origin.path, src->origin.line);
+	src = curly_node_contents(src);
+
+	if (!curly_attr_list_equal(dst->attrs, src->attrs)) {
+		__curly_attr_list_copy(dst, src->attrs);
+		modified = true;
+	}
+
+	/* Detach the current list of children, and rebuild it in the
+	 * order given by src. In the common case, the order does not
+	 * change, and we find each child right where we expect it. */
+	for (child = dst->children; child; child = child->next)
+		nold++;
+	old = calloc(nold + 1, sizeof(old[0]));
+	for (i = 0, child = dst->children; child; child = child->next)
+		old[i++] = child;
+
+	dst->children = NULL;
+	pos = &dst->children;
+	__curly_child_index_free(dst);
+
+	for (src_child = src->children; src_child; src_child = src_child->next) {
+		bool new_child = false;
+
+		while (cursor < nold && old[cursor] == NULL)
+			cursor++;
+
+		child = NULL;
+		if (cursor < nold
+		 && old[cursor]->type == src_child->type
+		 && old[cursor]->name == src_child->name) {
+			child = old[cursor];
+			old[cursor++] = NULL;
+		} else {
+			modified = true;
+			for (i = 0; i < nold; ++i) {
+				if (old[i]
+				 && old[i]->type == src_child->type
+				 && old[i]->name == src_child->name) {
+					child = old[i];
+					old[i] = NULL;
+					break;
+				}
+			}
+		}
+
+		if (child == NULL) {
+			child = __curly_node_dup(src_child);
+			child->parent = dst;
+			new_child = true;
+		}
+
+		count += __curly_node_update(child, src_child, changed, user_data, new_child);
+
+		child->next = NULL;
+		*pos = child;
+		pos = &child->next;
+	}
+
+	for (i = 0; i < nold; ++i) {
+		if (old[i] != NULL) {
+			old[i]->next = NULL;
+			curly_node_free(old[i]);
+			modified = true;
+		}
+	}
+	free(old);
+
+	curly_node_index_children(dst);
+
+	if (modified) {
+		__curly_node_invalidate_iterators(dst, NULL);
+		if (changed)
+			changed(dst, user_data);
+		count++;
+	}
+
+	return count;
+}
+
+unsigned int
+curly_node_update(curly_node_t *dst, const curly_node_t *src,
+			void (*changed)(curly_node_t *, void *), void *user_data)
+{
+	if (__curly_node_is_frozen(dst, "update"))
+		return 0;
+
+	return __curly_node_update(dst, src, changed, user_data, false);
+}
+
+/*
+ * Partial updates. Here, src holds the new version of only some of the
+ * children and attributes of dst, namely those described by old. They
+ * go where the old ones were: right after old->after_child and
+ * old->after_attr. Everything else in dst stays as it is. This is used
+ * to reload the subtrees that come from one include file, see parser.c.
+ */
+static curly_node_t *
+__curly_node_find_key(const curly_node_t *cfg, const curly_node_key_t *key)
+{
+	const struct curly_child_index *idx = cfg->child_index;
+	curly_node_t *child;
+
+	/* Unlike the lookup functions above, a NULL name only matches
+	 * a NULL name */
+	if (idx && idx->nwild == 0 && key->name) {
+		child = idx->buckets[__curly_child_hash_combine(curly_atom_hash(key->type), curly_atom_hash(key->name)) & (idx->size - 1)];
+		for (; child; child = child->hash_next) {
+			if (child->type == key->type && child->name == key->name)
+				return child;
+		}
+		return NULL;
+	}
+
+	for (child = cfg->children; child; child = child->next) {
+		if (child->type == key->type && child->name == key->name)
+			return child;
+	}
+	return NULL;
+}
+
+curly_node_t *
+curly_node_get_child_key(curly_node_t *cfg, const curly_node_key_t *key)
+{
+	curly_node_cow_children(cfg);
+	return __curly_node_find_key(cfg, key);
+}
+
+curly_node_t *
+curly_node_last_child(const curly_node_t *cfg)
+{
+	curly_node_t *child;
+
+	if (cfg->child_index)
+		return cfg->child_index->tail;
+	for (child = cfg->children; child && child->next; child = child->next)
+		;
+	return child;
+}
+
+curly_attr_t *
+curly_node_last_attr(const curly_node_t *cfg)
+{
+	curly_attr_t *attr;
+
+	if ((attr = __curly_attr_index_tail(cfg)) != NULL)
+		return attr;
+	for (attr = cfg->attrs; attr && attr->next; attr = attr->next)
+		;
+	return attr;
+}
+
+static curly_attr_t *
+__curly_node_find_attr_key(curly_node_t *cfg, const curly_node_key_t *key)
+{
+	return __curly_attr_list_get_attr_atom(cfg, curly_atom_of(key->name));
+}
+
+static int
+__curly_pointer_compare(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) *(void * const *) a;
+	uintptr_t y = (uintptr_t) *(void * const *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void * const *
+__curly_pointer_find(void * const *array, unsigned int count, const void *ptr)
+{
+	if (count == 0)
+		return NULL;
+	return bsearch(&ptr, array, count, sizeof(array[0]), __curly_pointer_compare);
+}
+
+/* Sort an array of pointers, and drop duplicates */
+static unsigned int
+__curly_pointer_sort(void **array, unsigned int count)
+{
+	unsigned int i, j;
+
+	qsort(array, count, sizeof(array[0]), __curly_pointer_compare);
+	for (i = j = 0; i < count; ++i) {
+		if (j == 0 || array[j - 1] != array[i])
+			array[j++] = array[i];
+	}
+	return j;
+}
+
+/*
+ * Collect the children and attributes of dst that part refers to,
+ * sorted by address
+ */
+static void
+__curly_node_part_collect(curly_node_t *dst, const curly_node_part_t *part,
+			curly_node_t ***children_ret, unsigned int *nchildren_ret,
+			curly_attr_t ***attrs_ret, unsigned int *nattrs_ret)
+{
+	curly_node_t **children;
+	curly_attr_t **attrs;
+	unsigned int i, nchildren = 0, nattrs = 0;
+
+	children = calloc(part->count + 1, sizeof(children[0]));
+	attrs = calloc(part->count + 1, sizeof(attrs[0]));
+
+	for (i = 0; i < part->count; ++i) {
+		const curly_node_key_t *key = &part->keys[i];
+
+		if (key->type == NULL) {
+			if ((attrs[nattrs] = __curly_node_find_attr_key(dst, key)) != NULL)
+				nattrs++;
+		} else {
+			if ((children[nchildren] = __curly_node_find_key(dst, key)) != NULL)
+				nchildren++;
+		}
+	}
+
+	*children_ret = children;
+	*nchildren_ret = __curly_pointer_sort((void **) children, nchildren);
+	*attrs_ret = attrs;
+	*nattrs_ret = __curly_pointer_sort((void **) attrs, nattrs);
+}
+
+/*
+ * Check whether the children and attributes described by part can take
+ * the place of those described by old: what they follow must still be
+ * there, and none of them may exist in dst unless it belongs to old.
+ */
+bool
+curly_node_part_fits(curly_node_t *dst, const curly_node_part_t *old, const curly_node_part_t *part)
+{
+	curly_node_t **children, *child;
+	curly_attr_t **attrs, *attr;
+	unsigned int i, nchildren, nattrs;
+	bool fits = true;
+
+	if (dst->frozen)
+		return false;
+	if (dst->cow_src)
+		curly_node_unshare(dst);
+
+	if (old->after_child.type && __curly_node_find_key(dst, &old->after_child) == NULL)
+		return false;
+	if (old->after_attr && __curly_attr_list_get_attr_atom(dst, curly_atom_of(old->after_attr)) == NULL)
+		return false;
+
+	__curly_node_part_collect(dst, old, &children, &nchildren, &attrs, &nattrs);
+	for (i = 0; fits && i < part->count; ++i) {
+		const curly_node_key_t *key = &part->keys[i];
+
+		if (key->type == NULL) {
+			attr = __curly_node_find_attr_key(dst, key);
+			fits = !attr || __curly_pointer_find((void * const *) attrs, nattrs, attr);
+		} else {
+			child = __curly_node_find_key(dst, key);
+			fits = !child || __curly_pointer_find((void * const *) children, nchildren, child);
+		}
+	}
+
+	free(children);
+	free(attrs);
+	return fits;
+}
+
+static unsigned int
+__curly_node_update_part_children(curly_node_t *dst, const curly_node_t *src, const curly_node_part_t *old,
+			curly_node_t **replaced, unsigned int nreplaced,
+			void (*changed)(curly_node_t *, void *), void *user_data, bool *modified)
+{
+	const curly_node_t *src_child;
+	curly_node_t **list, **match, *child, *after, **pos;
+	unsigned int i, j, n = 0, nsrc = 0, count = 0;
+	bool *reused;
+	bool inserted = false;
+
+	for (child = dst->children; child; child = child->next)
+		n++;
+	list = calloc(n + 1, sizeof(list[0]));
+	for (i = 0, child = dst->children; child; child = child->next)
+		list[i++] = child;
+
+	/* Find the children of dst that src has new versions of */
+	for (src_child = src->children; src_child; src_child = src_child->next)
+		nsrc++;
+	match = calloc(nsrc + 1, sizeof(match[0]));
+	reused = calloc(nreplaced + 1, sizeof(reused[0]));
+	for (j = 0, src_child = src->children; src_child; src_child = src_child->next, ++j) {
+		curly_node_key_t key = { src_child->type, src_child->name };
+		void * const *found;
+
+		child = __curly_node_find_key(dst, &key);
+		if (child && (found = __curly_pointer_find((void * const *) replaced, nreplaced, child)) != NULL) {
+			reused[found - (void * const *) replaced] = true;
+			match[j] = child;
+		}
+	}
+
+	after = old->after_child.type? __curly_node_find_key(dst, &old->after_child) : NULL;
+
+	dst->children = NULL;
+	pos = &dst->children;
+	__curly_child_index_free(dst);
+
+	for (i = 0; i <= n; ++i) {
+		if (!inserted && (i == n || after == NULL || (i && list[i - 1] == after))) {
+			for (j = 0, src_child = src->children; src_child; src_child = src_child->next, ++j) {
+				bool new_child = false;
+
+				if ((child = match[j]) == NULL) {
+					child = __curly_node_dup(src_child);
+					child->parent = dst;
+					new_child = true;
+				}
+
+				count += __curly_node_update(child, src_child, changed, user_data, new_child);
+
+				child->next = NULL;
+				*pos = child;
+				pos = &child->next;
+			}
+			inserted = true;
+		}
+
+		if (i < n && !__curly_pointer_find((void * const *) replaced, nreplaced, list[i])) {
+			list[i]->next = NULL;
+			*pos = list[i];
+			pos = &list[i]->next;
+		}
+	}
+
+	for (i = 0; i < nreplaced; ++i) {
+		if (!reused[i]) {
+			replaced[i]->next = NULL;
+			curly_node_free(replaced[i]);
+		}
+	}
+
+	/* Did the list of children change? */
+	for (i = 0, child = dst->children; child; child = child->next, ++i) {
+		if (i >= n || list[i] != child)
+			*modified = true;
+	}
+	if (i != n)
+		*modified = true;
+
+	curly_node_index_children(dst);
+
+	free(reused);
+	free(match);
+	free(list);
+	return count;
+}
+
+static void
+__curly_node_update_part_attrs(curly_node_t *dst, const curly_node_t *src, const curly_node_part_t *old,
+			curly_attr_t **replaced, unsigned int nreplaced, bool *modified)
+{
+	const curly_attr_t **list, *src_attr, *after;
+	const curly_attr_t **result;
+	curly_attr_t *attr, **pos;
+	unsigned int i, n = 0, nsrc = 0, k = 0;
+	bool *from_src, inserted = false, same;
+
+	for (attr = dst->attrs; attr; attr = attr->next)
+		n++;
+	for (src_attr = src->attrs; src_attr; src_attr = src_attr->next)
+		nsrc++;
+
+	list = calloc(n + 1, sizeof(list[0]));
+	for (i = 0, attr = dst->attrs; attr; attr = attr->next)
+		list[i++] = attr;
+
+	result = calloc(n + nsrc + 1, sizeof(result[0]));
+	from_src = calloc(n + nsrc + 1, sizeof(from_src[0]));
+
+	after = NULL;
+	if (old->after_attr)
+		after = __curly_attr_list_get_attr_atom(dst, curly_atom_of(old->after_attr));
+
+	for (i = 0; i <= n; ++i) {
+		if (!inserted && (i == n || after == NULL || (i && list[i - 1] == after))) {
+			for (src_attr = src->attrs; src_attr; src_attr = src_attr->next) {
+				from_src[k] = true;
+				result[k++] = src_attr;
+			}
+			inserted = true;
+		}
+
+		if (i < n && !__curly_pointer_find((void * const *) replaced, nreplaced, list[i]))
+			result[k++] = list[i];
+	}
+
+	/* Leave things alone if nothing changed */
+	same = (k == n);
+	for (i = 0; same && i < k; ++i)
+		same = (result[i] == list[i] || __curly_attr_equal(result[i], list[i]));
+
+	if (!same) {
+		pos = &dst->attrs;
+		for (i = 0; i < k; ++i) {
+			attr = from_src[i]? __curly_attr_clone(result[i]) : (curly_attr_t *) result[i];
+			*pos = attr;
+			pos = &attr->next;
+		}
+		*pos = NULL;
+
+		for (i = 0; i < nreplaced; ++i)
+			__curly_attr_free(replaced[i]);
+
+		__curly_attr_index_build(dst);
+		*modified = true;
+	}
+
+	free(from_src);
+	free(result);
+	free(list);
+}
+
+unsigned int
+curly_node_update_part(curly_node_t *dst, const curly_node_t *src, const curly_node_part_t *old,
+			void (*changed)(curly_node_t *, void *), void *user_data)
+{
+	curly_node_t **children;
+	curly_attr_t **attrs;
+	unsigned int nchildren, nattrs, count;
+	bool modified = false;
+
+	if (__curly_node_is_frozen(dst, "update"))
+		return 0;
+
+	__curly_node_modify(dst);
+	src = curly_node_contents(src);
+
+	__curly_node_part_collect(dst, old, &children, &nchildren, &attrs, &nattrs);
+	__curly_node_update_part_attrs(dst, src, old, attrs, nattrs, &modified);
+	count = __curly_node_update_part_children(dst, src, old, children, nchildren, changed, user_data, &modified);
+	free(children);
+	free(attrs);
+
+	if (modified) {
+		__curly_node_invalidate_iterators(dst, NULL);
+		if (changed)
+			changed(dst, user_data);
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Attribute accessors
+ */
+void
+curly_node_set_attr_slice(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value)
+{
+	if (__curly_node_is_frozen(cfg, "set attribute"))
+		return;
+
+	/* Setting an attribute may delete a curly_attr_t.
+	 * Invalidate all iterators. */
+	__curly_node_invalidate_iterators(cfg, NULL);
+
+	__curly_node_modify(cfg);
+	__curly_attr_list_assign(cfg, name, value);
+}
+
+void
+curly_node_set_attr(curly_node_t *cfg, const char *name, const char *value)
+{
+	curly_slice_t name_slice = curly_slice_from_string(name);
+	curly_slice_t value_slice = curly_slice_from_string(value);
+	curly_journal_t *journal;
+
+	curly_node_set_attr_slice(cfg, &name_slice, &value_slice);
+	if ((journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_set_attr(journal, cfg, name, value);
+}
+
+void
+curly_node_set_attr_list(curly_node_t *cfg, const char *name, const char * const *values)
+{
+	curly_slice_t name_slice = curly_slice_from_string(name);
+	curly_journal_t *journal;
+
+	if (__curly_node_is_frozen(cfg, "set attribute"))
+		return;
+
+	/* Setting an attribute may delete a curly_attr_t.
+	 * Invalidate all iterators. */
+	__curly_node_invalidate_iterators(cfg, NULL);
+
+	__curly_node_modify(cfg);
+	__curly_attr_list_assign_list(cfg, &name_slice, values);
+	if ((journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_set_attr_list(journal, cfg, name, values);
+}
+
+void
+curly_node_add_attr_list_slice(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value)
+{
+	if (__curly_node_is_frozen(cfg, "add attribute"))
+		return;
+
+	__curly_node_modify(cfg);
+	__curly_attr_list_append(cfg, name, value);
+}
+
+/*
+ * Append several values at once, reserving room for all of them first
+ */
+void
+curly_node_add_attr_list_slices(curly_node_t *cfg, const curly_slice_t *name,
+				const curly_slice_t *values, unsigned int count)
+{
+	if (count == 0 || __curly_node_is_frozen(cfg, "add attribute"))
+		return;
+
+	__curly_node_modify(cfg);
+	__curly_attr_list_append_slices(cfg, name, values, count);
+}
+
+void
+curly_node_append_attr_values(curly_node_t *cfg, const char *name, const char * const *values, unsigned int count)
+{
+	curly_slice_t name_slice = curly_slice_from_string(name);
+	curly_slice_t *slices;
+	curly_journal_t *journal;
+	unsigned int i;
+
+	if (count == 0)
+		return;
+
+	slices = calloc(count, sizeof(slices[0]));
+	for (i = 0; i < count; ++i)
+		slices[i] = curly_slice_from_string(values[i]);
+
+	curly_node_add_attr_list_slices(cfg, &name_slice, slices, count);
+	free(slices);
+
+	if ((journal = curly_node_journal(cfg)) != NULL) {
+		for (i = 0; i < count; ++i)
+			curly_journal_add_attr(journal, cfg, name, values[i]);
+	}
+}
+
+void
+curly_node_add_attr_list(curly_node_t *cfg, const char *name, const char *value)
+{
+	curly_slice_t name_slice = curly_slice_from_string(name);
+	curly_slice_t value_slice = curly_slice_from_string(value);
+	curly_journal_t *journal;
+
+	curly_node_add_attr_list_slice(cfg, &name_slice, &value_slice);
+	if ((journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_add_attr(journal, cfg, name, value);
+}
+
+const char *
+curly_node_get_attr(curly_node_t *cfg, const char *name)
+{
+	return __curly_attr_list_get_string(cfg, name);
+}
+
+const char * const *
+curly_node_get_attr_list(curly_node_t *cfg, const char *name)
+{
+	return __curly_attr_list_get_list_value(cfg, name);
+}
+
+void
+curly_node_set_attr_atom(curly_node_t *cfg, const curly_atom_t *name, const char *value)
+{
+	curly_slice_t value_slice = curly_slice_from_string(value);
+	curly_journal_t *journal;
+	curly_attr_t *attr;
+
+	if (__curly_node_is_frozen(cfg, "set attribute"))
+		return;
+
+	__curly_node_modify(cfg);
+
+	/* Creating or dropping an attribute goes the long way */
+	if (value == NULL || *value == '\0'
+	 || (attr = __curly_attr_list_get_attr_atom(cfg, name)) == NULL) {
+		curly_node_set_attr(cfg, name->value, value);
+		return;
+	}
+
+	__curly_node_invalidate_iterators(cfg, NULL);
+
+	__curly_attr_clear(attr);
+	__curly_attr_append(__curly_node_arena(cfg), attr, &value_slice);
+
+	if ((journal = curly_node_journal(cfg)) != NULL)
+		curly_journal_set_attr(journal, cfg, name->value, value);
+}
+
+curly_attr_t *
+curly_node_find_attr(curly_node_t *cfg, const char *name)
+{
+	curly_slice_t name_slice = curly_slice_from_string(name);
+
+	return __curly_attr_list_get_attr((curly_node_t *) curly_node_contents(cfg), &name_slice, 0);
+}
+
+curly_attr_t *
+curly_node_find_attr_atom(curly_node_t *cfg, const curly_atom_t *name)
+{
+	return __curly_attr_list_get_attr_atom(cfg, name);
+}
+
+const char *
+curly_node_get_attr_atom(curly_node_t *cfg, const curly_atom_t *name)
+{
+	curly_attr_t *attr;
+
+	attr = __curly_attr_list_get_attr_atom(cfg, name);
+	if (attr && attr->nvalues)
+		return attr->values[0];
+	return NULL;
 }
 
-static void
-__curly_node_invalidate_iterators(curly_node_t *cfg, const curly_node_t *child)
+const char * const *
+curly_node_get_attr_list_atom(curly_node_t *cfg, const curly_atom_t *name)
 {
-	curly_iter_t *iter;
+	curly_attr_t *attr;
 
-	for (iter = cfg->iterators; iter; iter = iter->chain) {
-		iter->next_item = NULL;
-		iter->valid = false;
-	}
+	attr = __curly_attr_list_get_attr_atom(cfg, name);
+	if (attr && attr->nvalues)
+		return (const char * const *) attr->values;
+	return NULL;
 }
 
 /*
- * Accessor functions for child nodes
+ * Nodes with many attributes index them by name. The list remains
+ * the authority on ordering; the index only speeds up lookups.
+ *
+ * The index is an open addressing table with linear probing, so that
+ * attributes need no chain pointer of their own. It is kept at most
+ * half full.
  */
-curly_node_t *
-curly_node_get_child(const curly_node_t *cfg, const char *type, const char *name)
+#define CURLY_ATTR_INDEX_THRESHOLD	16
+
+struct curly_attr_index {
+	unsigned int	size;		/* number of slots, a power of 2 */
+	unsigned int	count;
+	curly_attr_t *	tail;
+	curly_attr_t **	slots;
+
+	/* Built while parsing into an arena */
+	bool		in_arena;
+	bool		slots_in_arena;
+};
+
+static inline uint64_t
+__curly_attr_hash(const curly_slice_t *name)
 {
-	curly_node_t *child;
+	return curly_hash_bytes(CURLY_HASH_INIT, name->ptr, name->len);
+}
 
-	for (child = cfg->children; child; child = child->next) {
-		if (type && xstrcmp(child->type, type))
-			continue;
-		if (name && xstrcmp(child->name, name))
-			continue;
-		return child;
+static curly_attr_t *
+__curly_attr_index_find(const struct curly_attr_index *idx, const curly_slice_t *name)
+{
+	unsigned int mask = idx->size - 1, i;
+	curly_attr_t *attr;
+
+	for (i = __curly_attr_hash(name) & mask; (attr = idx->slots[i]) != NULL; i = (i + 1) & mask) {
+		if (curly_slice_equal(name, attr->name))
+			return attr;
 	}
 	return NULL;
 }
 
-
-curly_node_t *
-curly_node_add_child(curly_node_t *cfg, const char *type, const char *name)
+static curly_attr_t *
+__curly_attr_index_find_atom(const struct curly_attr_index *idx, const char *name)
 {
-	curly_node_t *child, **pos;
+	unsigned int mask = idx->size - 1, i;
+	curly_attr_t *attr;
 
-	if (curly_node_get_child(cfg, type, name) != NULL) {
-		fprintf(stderr, "duplicate %s group named \"%s\"\n", type, name);
-		return NULL;
+	for (i = curly_atom_hash(name) & mask; (attr = idx->slots[i]) != NULL; i = (i + 1) & mask) {
+		if (attr->name == name)
+			return attr;
 	}
-
-	/* Find the tail of the list */
-	for (pos = &cfg->children; (child = *pos) != NULL; pos = &child->next)
-		;
-
-	*pos = child = __curly_node_new(type, name);
-	return child;
+	return NULL;
 }
 
-unsigned int
-curly_node_drop_child(curly_node_t *cfg, const curly_node_t *child)
+static void
+__curly_attr_index_insert(struct curly_attr_index *idx, curly_attr_t *attr)
 {
-	curly_node_t *cur, **pos;
-	unsigned int count = 0;
+	unsigned int mask = idx->size - 1, i;
 
-	__curly_node_invalidate_iterators(cfg, child);
+	for (i = curly_atom_hash(attr->name) & mask; idx->slots[i]; i = (i + 1) & mask)
+		;
+	idx->slots[i] = attr;
+	idx->count++;
+}
 
-	for (pos = &cfg->children; (cur = *pos) != NULL; ) {
-		if (cur == child) {
-			*pos = cur->next;
-			cur->next = NULL;
+static void
+__curly_attr_index_remove(struct curly_attr_index *idx, curly_attr_t *attr)
+{
+	unsigned int mask = idx->size - 1, i, j, home;
 
-			__curly_node_free(cur);
-			count += 1;
-		} else {
-			pos = &cur->next;
+	for (i = curly_atom_hash(attr->name) & mask; idx->slots[i] != attr; i = (i + 1) & mask) {
+		if (idx->slots[i] == NULL)
+			return;
+	}
+	idx->slots[i] = NULL;
+	idx->count--;
+
+	/* Move back entries that could no longer be found past the hole */
+	for (j = (i + 1) & mask; idx->slots[j]; j = (j + 1) & mask) {
+		home = curly_atom_hash(idx->slots[j]->name) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx->slots[i] = idx->slots[j];
+			idx->slots[j] = NULL;
+			i = j;
 		}
 	}
-
-	return count;
 }
 
-const char **
-curly_node_get_children(const curly_node_t *cfg, const char *type)
+static void
+__curly_attr_index_fill(curly_node_t *cfg, struct curly_attr_index *idx, unsigned int size)
 {
-	const curly_node_t *node;
-	unsigned int n, count;
-	const char **result;
-
-	for (count = 0, node = cfg->children; node; node = node->next, ++count)
-		;
+	curly_arena_t *arena = __curly_node_arena(cfg);
+	curly_attr_t *attr;
 
-	result = calloc(count + 1, sizeof(result[0]));
-	for (n = 0, node = cfg->children; node; node = node->next) {
-		if (type == NULL || !xstrcmp(node->type, type))
-			result[n++] = node->name;
+	if (!idx->slots_in_arena)
+		free(idx->slots);
+	if (arena)
+		idx->slots = curly_arena_alloc(arena, size * sizeof(idx->slots[0]));
+	else
+		idx->slots = calloc(size, sizeof(idx->slots[0]));
+	idx->slots_in_arena = (arena != NULL);
+	idx->size = size;
+	idx->count = 0;
+	idx->tail = NULL;
+
+	for (attr = cfg->attrs; attr; attr = attr->next) {
+		__curly_attr_index_insert(idx, attr);
+		idx->tail = attr;
 	}
-	result[n++] = NULL;
-
-	return result;
 }
 
+static void
+__curly_attr_index_free(curly_node_t *cfg)
+{
+	struct curly_attr_index *idx = cfg->attr_index;
+
+	if (idx) {
+		if (!idx->slots_in_arena)
+			free(idx->slots);
+		if (!idx->in_arena)
+			free(idx);
+		cfg->attr_index = NULL;
+	}
+}
 
-const char **
-curly_node_get_attr_names(const curly_node_t *cfg)
+static curly_attr_t *
+__curly_attr_index_tail(const curly_node_t *cfg)
 {
-	return __curly_attr_list_get_names(&cfg->attrs);
+	return cfg->attr_index? cfg->attr_index->tail : NULL;
 }
 
-/*
- * Copy all attributes and children from one config node to another
- */
-void
-curly_node_copy(curly_node_t *dst, const curly_node_t *src)
+static void
+__curly_attr_index_build(curly_node_t *cfg)
 {
-	const curly_node_t *src_child;
-	curly_node_t **pos;
+	unsigned int count = 0, size = 32;
+	curly_arena_t *arena;
+	curly_attr_t *attr;
 
-	__curly_node_clear(dst);
-	__curly_attr_list_copy(&dst->attrs, src->attrs);
+	__curly_attr_index_free(cfg);
 
-	pos = &dst->children;
-	for (src_child = src->children; src_child; src_child = src_child->next) {
-		curly_node_t *clone;
+	for (attr = cfg->attrs; attr; attr = attr->next)
+		count++;
+	if (count < CURLY_ATTR_INDEX_THRESHOLD)
+		return;
 
-		/* Recursively create a deep copy of the child node */
-		clone = __curly_node_new(src_child->type, src_child->name);
-		curly_node_copy(clone, src_child);
+	while (size < 2 * count)
+		size <<= 1;
 
-		/* Append to list */
-		*pos = clone;
-		pos = &clone->next;
+	if ((arena = __curly_node_arena(cfg)) != NULL) {
+		cfg->attr_index = curly_arena_alloc(arena, sizeof(struct curly_attr_index));
+		cfg->attr_index->in_arena = true;
+	} else {
+		cfg->attr_index = calloc(1, sizeof(struct curly_attr_index));
 	}
+	__curly_attr_index_fill(cfg, cfg->attr_index, size);
 }
 
 /*
- * Attribute accessors
+ * Look up an attribute. If create is nonzero, a missing attribute is
+ * created, with room for that many values.
  */
-void
-curly_node_set_attr(curly_node_t *cfg, const char *name, const char *value)
+static curly_attr_t *
+__curly_attr_list_get_attr(curly_node_t *cfg, const curly_slice_t *name, unsigned int create)
 {
-	/* Setting an attribute may delete a curly_attr_t.
-	 * Invalidate all iterators. */
-	__curly_node_invalidate_iterators(cfg, NULL);
+	struct curly_attr_index *idx = cfg->attr_index;
+	curly_attr_t **pos, *attr;
+	unsigned int count = 0;
 
-	__curly_attr_list_assign(&cfg->attrs, name, value);
-}
+	if (cfg->frozen)
+		return curly_frozen_get_attr(cfg, name);
 
-void
-curly_node_set_attr_list(curly_node_t *cfg, const char *name, const char * const *values)
-{
-	/* Setting an attribute may delete a curly_attr_t.
-	 * Invalidate all iterators. */
-	__curly_node_invalidate_iterators(cfg, NULL);
+	if (idx != NULL) {
+		if ((attr = __curly_attr_index_find(idx, name)) != NULL)
+			return attr;
 
-	__curly_attr_list_assign_list(&cfg->attrs, name, values);
-}
+		if (!create)
+			return NULL;
 
-void
-curly_node_add_attr_list(curly_node_t *cfg, const char *name, const char *value)
-{
-	__curly_attr_list_append(&cfg->attrs, name, value);
-}
+		attr = __curly_attr_new(__curly_node_arena(cfg), name, create);
+		idx->tail->next = attr;
+		idx->tail = attr;
 
-const char *
-curly_node_get_attr(curly_node_t *cfg, const char *name)
-{
-	return __curly_attr_list_get_string(&cfg->attrs, name);
-}
+		__curly_attr_index_insert(idx, attr);
+		if (2 * idx->count > idx->size)
+			__curly_attr_index_fill(cfg, idx, 2 * idx->size);
+		return attr;
+	}
 
-const char * const *
-curly_node_get_attr_list(curly_node_t *cfg, const char *name)
-{
-	return __curly_attr_list_get_list_value(&cfg->attrs, name);
+	for (pos = &cfg->attrs; (attr = *pos) != NULL; pos = &attr->next, ++count) {
+		if (curly_slice_equal(name, attr->name))
+			return attr;
+	}
+
+	if (!create)
+		return NULL;
+
+	*pos = attr = __curly_attr_new(__curly_node_arena(cfg), name, create);
+	if (count + 1 >= CURLY_ATTR_INDEX_THRESHOLD)
+		__curly_attr_index_build(cfg);
+	return attr;
 }
 
 static curly_attr_t *
-__curly_attr_list_get_attr(curly_attr_t **list, const char *name, int create)
+__curly_attr_list_get_attr_atom(curly_node_t *cfg, const curly_atom_t *name)
 {
-	curly_attr_t **pos, *attr;
+	curly_attr_t *attr;
 
-	for (pos = list; (attr = *pos) != NULL; pos = &attr->next) {
-		if (!strcmp(attr->name, name))
-			return attr;
+	cfg = (curly_node_t *) curly_node_contents(cfg);
+
+	if (cfg->frozen) {
+		curly_slice_t name_slice = { name->value, name->len };
+
+		return curly_frozen_get_attr(cfg, &name_slice);
 	}
 
-	if (!create)
-		return NULL;
+	if (cfg->attr_index != NULL)
+		return __curly_attr_index_find_atom(cfg->attr_index, name->value);
 
-	*pos = __curly_attr_new(name);
-	return *pos;
+	for (attr = cfg->attrs; attr; attr = attr->next) {
+		if (attr->name == name->value)
+			return attr;
+	}
+	return NULL;
 }
 
 static void
-__curly_attr_list_drop(curly_attr_t **list, const char *name)
+__curly_attr_list_drop(curly_node_t *cfg, const curly_slice_t *name)
 {
-	curly_attr_t **pos, *attr;
+	struct curly_attr_index *idx = cfg->attr_index;
+	curly_attr_t **pos, *attr, *prev = NULL;
+
+	/* Avoid walking the list for attributes we do not have */
+	if (idx && __curly_attr_list_get_attr(cfg, name, 0) == NULL)
+		return;
 
-	for (pos = list; (attr = *pos) != NULL; pos = &attr->next) {
-		if (!strcmp(attr->name, name)) {
+	for (pos = &cfg->attrs; (attr = *pos) != NULL; pos = &attr->next) {
+		if (curly_slice_equal(name, attr->name)) {
 			*pos = attr->next;
+			if (idx) {
+				__curly_attr_index_remove(idx, attr);
+				if (idx->tail == attr)
+					idx->tail = prev;
+				if (idx->count == 0)
+					__curly_attr_index_free(cfg);
+			}
 			__curly_attr_free(attr);
 			return;
 		}
+		prev = attr;
 	}
 }
 
+/*
+ * Make room for count more values. Once a list outgrows the values
+ * stored inline, it moves to the heap, and its capacity doubles
+ * whenever it fills up.
+ */
+#define CURLY_ATTR_VALUES_MIN	8
+
 static void
-__curly_attr_append(curly_attr_t *attr, const char *value)
+__curly_attr_reserve(curly_arena_t *arena, curly_attr_t *attr, unsigned int count)
 {
-	char *s;
+	unsigned int need = attr->nvalues + count, capacity;
+	char **values;
 
-	if (attr->nvalues >= CURLIES_NODE_SHORTLIST_MAX) {
-		unsigned int new_size;
+	if (need <= attr->capacity)
+		return;
 
-		new_size = (attr->nvalues + 2) * sizeof(char *);
-		if (attr->values == attr->short_list) {
-			attr->values = malloc(new_size);
-			memcpy(attr->values, attr->short_list, sizeof(attr->short_list));
-		} else {
-			attr->values = realloc(attr->values, new_size);
-		}
+	capacity = CURLY_ATTR_VALUES_MIN;
+	while (capacity < need)
+		capacity *= 2;
+
+	if (attr->values == attr->inline_values || attr->values_in_arena) {
+		if (arena)
+			values = curly_arena_alloc(arena, (capacity + 1) * sizeof(char *));
+		else
+			values = malloc((capacity + 1) * sizeof(char *));
+		memcpy(values, attr->values, (attr->nvalues + 1) * sizeof(char *));
+		attr->values = values;
+		attr->values_in_arena = (arena != NULL);
+	} else {
+		attr->values = realloc(attr->values, (capacity + 1) * sizeof(char *));
+	}
+	attr->capacity = capacity;
+}
+
+/*
+ * Append a value, handing over the reference the caller holds. The
+ * arena holds the values of attributes built while parsing; once it
+ * is sealed, the attribute takes references of its own.
+ */
+static void
+__curly_attr_append_atom(curly_arena_t *arena, curly_attr_t *attr, char *value)
+{
+	unsigned int n;
+
+	if (attr->arena_values && arena == NULL) {
+		for (n = 0; n < attr->nvalues; ++n)
+			curly_atom_ref(attr->values[n]);
+		attr->arena_values = false;
 	}
 
-	attr->values[attr->nvalues++] = s = strdup(value);
+	__curly_attr_reserve(arena, attr, 1);
+
+	if (attr->arena_values)
+		value = curly_arena_hold_atom(arena, value);
+	attr->values[attr->nvalues++] = value;
 	attr->values[attr->nvalues] = NULL;
+}
+
+static void
+__curly_attr_append(curly_arena_t *arena, curly_attr_t *attr, const curly_slice_t *value)
+{
+	curly_slice_t copy;
+	char *s;
+
+	if (memchr(value->ptr, '\n', value->len) == NULL) {
+		__curly_attr_append_atom(arena, attr, curly_atom_intern(value));
+		return;
+	}
 
 	/* Replace newlines with a blank */
-	while ((s = strchr(s, '\n')) != NULL)
+	s = strndup(value->ptr, value->len);
+	copy = (curly_slice_t) { s, value->len };
+	while ((s = memchr(s, '\n', copy.ptr + copy.len - s)) != NULL)
 		*s = ' ';
+
+	__curly_attr_append_atom(arena, attr, curly_atom_intern(&copy));
+	free((char *) copy.ptr);
 }
 
 void
-__curly_attr_list_assign(curly_attr_t **list, const char *name, const char *value)
+__curly_attr_list_assign(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value)
 {
+	curly_arena_t *arena = __curly_node_arena(cfg);
 	curly_attr_t *attr;
 
-	if (value == NULL || *value == '\0') {
-		__curly_attr_list_drop(list, name);
+	if (value->ptr == NULL || value->len == 0) {
+		__curly_attr_list_drop(cfg, name);
 	} else {
-		attr = __curly_attr_list_get_attr(list, name, 1);
+		attr = __curly_attr_list_get_attr(cfg, name, 1);
 		__curly_attr_clear(attr);
-		__curly_attr_append(attr, value);
+		__curly_attr_append(arena, attr, value);
 	}
 }
 
 void
-__curly_attr_list_assign_list(curly_attr_t **attr_list, const char *name, const char * const *values)
+__curly_attr_list_assign_list(curly_node_t *cfg, const curly_slice_t *name, const char * const *values)
 {
+	curly_arena_t *arena = __curly_node_arena(cfg);
 	curly_attr_t *attr;
+	unsigned int count;
 
 	if (values == NULL || *values == NULL) {
-		__curly_attr_list_drop(attr_list, name);
+		__curly_attr_list_drop(cfg, name);
 	} else {
-		attr = __curly_attr_list_get_attr(attr_list, name, 1);
+		for (count = 0; values[count]; ++count)
+			;
+
+		attr = __curly_attr_list_get_attr(cfg, name, count);
 		__curly_attr_clear(attr);
+		__curly_attr_reserve(arena, attr, count);
 
-		while (values && *values)
-			__curly_attr_append(attr, *values++);
+		while (values && *values) {
+			curly_slice_t value = curly_slice_from_string(*values++);
+
+			__curly_attr_append(arena, attr, &value);
+		}
 	}
 }
 
 void
-__curly_attr_list_append(curly_attr_t **attr_list, const char *name, const char *value)
+__curly_attr_list_append(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value)
 {
+	curly_arena_t *arena = __curly_node_arena(cfg);
 	curly_attr_t *attr;
 
-	attr = __curly_attr_list_get_attr(attr_list, name, 1);
-	if (value == NULL)
+	attr = __curly_attr_list_get_attr(cfg, name, 1);
+	if (value->ptr == NULL)
 		return;
 
-	__curly_attr_append(attr, value);
+	__curly_attr_append(arena, attr, value);
+}
+
+void
+__curly_attr_list_append_slices(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *values, unsigned int count)
+{
+	curly_arena_t *arena = __curly_node_arena(cfg);
+	curly_attr_t *attr;
+	unsigned int i;
+
+	attr = __curly_attr_list_get_attr(cfg, name, count);
+	__curly_attr_reserve(arena, attr, count);
+	for (i = 0; i < count; ++i) {
+		if (values[i].ptr != NULL)
+			__curly_attr_append(arena, attr, &values[i]);
+	}
 }
 
 const char *
-__curly_attr_list_get_string(curly_attr_t **list, const char *name)
+__curly_attr_list_get_string(curly_node_t *cfg, const char *name)
 {
+	curly_slice_t name_slice = curly_slice_from_string(name);
 	curly_attr_t *attr;
 
-	attr = __curly_attr_list_get_attr(list, name, 0);
+	attr = __curly_attr_list_get_attr((curly_node_t *) curly_node_contents(cfg), &name_slice, 0);
 	if (attr && attr->nvalues)
 		return attr->values[0];
 	return NULL;
 }
 
 const char * const *
-__curly_attr_list_get_list_value(curly_attr_t **attr_list, const char *name)
+__curly_attr_list_get_list_value(curly_node_t *cfg, const char *name)
 {
+	curly_slice_t name_slice = curly_slice_from_string(name);
 	curly_attr_t *attr;
 
-	attr = __curly_attr_list_get_attr(attr_list, name, 0);
+	attr = __curly_attr_list_get_attr((curly_node_t *) curly_node_contents(cfg), &name_slice, 0);
 	if (attr && attr->nvalues)
 		return (const char * const *) attr->values;
 	return NULL;
 }
 
 void
-__curly_attr_list_copy(curly_attr_t **dst, const curly_attr_t *src_attr)
+__curly_attr_list_copy(curly_node_t *dst, const curly_attr_t *src_attr)
 {
+	curly_attr_t **pos;
+
 	__curly_attr_list_free(dst);
 
+	pos = &dst->attrs;
 	while (src_attr != NULL) {
-		*dst = __curly_attr_clone(src_attr);
+		*pos = __curly_attr_clone(src_attr);
 		src_attr = src_attr->next;
-		dst = &(*dst)->next;
+		pos = &(*pos)->next;
 	}
+
+	__curly_attr_index_build(dst);
 }
 
 const char **
@@ -467,22 +2085,57 @@ __curly_attr_clear(curly_attr_t *attr)
 {
 	unsigned int n;
 
-	for (n = 0; n < attr->nvalues; ++n)
-		free(attr->values[n]);
-	if (attr->values != attr->short_list)
-		free(attr->values);
-	attr->values = attr->short_list;
+	for (n = 0; n < attr->nvalues && !attr->arena_values; ++n)
+		curly_atom_unref(attr->values[n]);
+	/* There is always room for one value inline */
+	if (attr->values != attr->inline_values) {
+		if (!attr->values_in_arena)
+			free(attr->values);
+		attr->values = attr->inline_values;
+		attr->values_in_arena = false;
+		attr->capacity = 1;
+	}
+	attr->values[0] = NULL;
 	attr->nvalues = 0;
+
+	free(attr->typed);
+	attr->typed = NULL;
+}
+
+/*
+ * Allocate an attribute with room for count values inline
+ */
+static curly_attr_t *
+__curly_attr_alloc(curly_arena_t *arena, unsigned int count)
+{
+	curly_attr_t *attr;
+	size_t size;
+
+	if (count == 0)
+		count = 1;
+
+	size = sizeof(*attr) + (count + 1) * sizeof(attr->inline_values[0]);
+	if (arena) {
+		attr = curly_arena_alloc(arena, size);
+		attr->in_arena = true;
+		attr->arena_values = true;
+	} else {
+		attr = calloc(1, size);
+	}
+	attr->values = attr->inline_values;
+	attr->capacity = count;
+	return attr;
 }
 
 static curly_attr_t *
-__curly_attr_new(const char *name)
+__curly_attr_new(curly_arena_t *arena, const curly_slice_t *name, unsigned int count)
 {
 	curly_attr_t *attr;
 
-	attr = calloc(1, sizeof(*attr));
-	attr->name = strdup(name);
-	attr->values = attr->short_list;
+	attr = __curly_attr_alloc(arena, count);
+	attr->name = curly_atom_intern(name);
+	if (arena)
+		attr->name = curly_arena_hold_atom(arena, attr->name);
 	return attr;
 }
 
@@ -492,29 +2145,33 @@ __curly_attr_clone(const curly_attr_t *src_attr)
 	curly_attr_t *attr;
 	char **values;
 
-	attr = __curly_attr_new(src_attr->name);
+	attr = __curly_attr_alloc(NULL, src_attr->nvalues);
+	attr->name = curly_atom_ref(src_attr->name);
 
 	values = src_attr->values;
 	while (values && *values)
-		__curly_attr_append(attr, *values++);
+		__curly_attr_append_atom(NULL, attr, curly_atom_ref(*values++));
 	return attr;
 }
 
 static void
 __curly_attr_free(curly_attr_t *attr)
 {
-	free(attr->name);
 	__curly_attr_clear(attr);
-	free(attr);
+	if (!attr->in_arena) {
+		curly_atom_unref(attr->name);
+		free(attr);
+	}
 }
 
 void
-__curly_attr_list_free(curly_attr_t **list)
+__curly_attr_list_free(curly_node_t *cfg)
 {
 	curly_attr_t *attr;
 
-	while ((attr = *list) != NULL) {
-		*list = attr->next;
+	__curly_attr_index_free(cfg);
+	while ((attr = cfg->attrs) != NULL) {
+		cfg->attrs = attr->next;
 
 		__curly_attr_free(attr);
 	}
@@ -553,34 +2210,64 @@ curly_attr_get_values(const curly_attr_t *attr)
 /*
  * Iterate over curly nodes
  */
-curly_iter_t *
-curly_node_iterate(curly_node_t *node)
+void
+curly_iter_init(curly_iter_t *iter, curly_node_t *node, const char *type)
 {
-	curly_iter_t *iter;
+	/* The iterator returns our children, so we need stand-ins;
+	 * attributes can be read from the contents we share */
+	curly_node_cow_children(node);
+
+	/* Nothing is written to the node, so that snapshots can be
+	 * iterated by several threads at once */
+	iter->node = node;
+	iter->modcount = node->modcount;
+	iter->type = type;
+	iter->next_item = node->children;
+	iter->next_attr = curly_node_contents(node)->attrs;
+}
 
-	iter = calloc(1, sizeof(*iter));
+void
+curly_iter_destroy(curly_iter_t *iter)
+{
+	iter->node = NULL;
+}
 
-	/* Attach to iterator */
-	__curly_node_attach_iterator(node, iter);
+static inline bool
+__curly_iter_valid(const curly_iter_t *iter)
+{
+	return iter->node != NULL && iter->node->modcount == iter->modcount;
+}
 
-	/* Prime the next value */
-	iter->next_item = node->children;
-	iter->next_attr = node->attrs;
-	iter->valid = true;
+curly_iter_t *
+curly_node_iterate(curly_node_t *node)
+{
+	curly_iter_t *iter;
 
+	iter = malloc(sizeof(*iter));
+	curly_iter_init(iter, node, NULL);
 	return iter;
 }
 
+static inline bool
+__curly_iter_type_match(const curly_iter_t *iter, const curly_node_t *child)
+{
+	/* Types are atoms, so most matches are found by pointer */
+	return iter->type == NULL || child->type == iter->type || !xstrcmp(child->type, iter->type);
+}
+
 curly_node_t *
 curly_iter_next_node(curly_iter_t *iter)
 {
 	curly_node_t *item;
 
-	if (!iter->valid)
+	if (!__curly_iter_valid(iter))
 		return NULL;
 
-	if ((item = iter->next_item) != NULL)
+	while ((item = iter->next_item) != NULL) {
 		iter->next_item = item->next;
+		if (__curly_iter_type_match(iter, item))
+			break;
+	}
 
 	return item;
 }
@@ -590,7 +2277,7 @@ curly_iter_next_attr(curly_iter_t *iter)
 {
 	curly_attr_t *attr;
 
-	if (!iter->valid)
+	if (!__curly_iter_valid(iter))
 		return NULL;
 
 	if ((attr = iter->next_attr) != NULL)
@@ -602,9 +2289,29 @@ curly_iter_next_attr(curly_iter_t *iter)
 void
 curly_iter_free(curly_iter_t *iter)
 {
-	if (iter->node) {
-		__curly_node_detach_iterator(iter->node, iter);
-	}
+	curly_iter_destroy(iter);
+	free(iter);
+}
+
+/*
+ * Visit children without allocating. The iterator makes it safe for
+ * visit to change the node; doing so ends the walk.
+ */
+int
+curly_node_foreach_child(curly_node_t *cfg, const char *type,
+			int (*visit)(curly_node_t *child, void *user_data),
+			void *user_data)
+{
+	curly_iter_t iter;
+	curly_node_t *child;
+	int rv = 0;
+
+	curly_iter_init(&iter, cfg, type);
+	while (rv == 0 && (child = curly_iter_next_node(&iter)) != NULL)
+		rv = visit(child, user_data);
+	curly_iter_destroy(&iter);
+
+	return rv;
 }
 
 /*
@@ -670,3 +2377,46 @@ curly_node_read(const char *path)
 	return __curly_node_read(path);
 }
 
+curly_node_t *
+curly_node_read_flags(const char *path, unsigned int flags)
+{
+	char cache_path[PATH_MAX];
+	curly_node_t *cfg;
+
+	if (flags & CURLY_READ_F_CACHE) {
+		if (snprintf(cache_path, sizeof(cache_path), "%s.cache", path) >= (int) sizeof(cache_path))
+			flags &= ~CURLY_READ_F_CACHE;
+		else if ((cfg = curly_binary_cache_load(path, cache_path)) != NULL)
+			return cfg;
+	}
+
+	if (flags & CURLY_READ_F_ARENA)
+		cfg = curly_parse_arena(path, (flags & CURLY_READ_F_PARALLEL)? 0 : 1);
+	else if (flags & CURLY_READ_F_PARALLEL)
+		cfg = curly_parse_parallel(path, 0);
+	else
+		cfg = __curly_node_read(path);
+
+	if (cfg && (flags & CURLY_READ_F_CACHE))
+		curly_binary_cache_store(cfg, cache_path);
+	return cfg;
+}
+
+int
+curly_node_reload(curly_node_t *cfg, void (*changed)(curly_node_t *, void *), void *user_data)
+{
+	return curly_reload(cfg, changed, user_data);
+}
+
+const char **
+curly_node_get_source_files(const curly_node_t *cfg)
+{
+	return curly_source_files(cfg);
+}
+
+curly_node_t *
+curly_node_parse_buffer(const char *buf, size_t len, const char *origin_name)
+{
+	return curly_parse_buffer(buf, len, origin_name);
+}
+
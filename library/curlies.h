@@ -21,6 +21,8 @@
 #define CURLIES_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /*
  * Handling curly config files
@@ -28,13 +30,19 @@
 typedef struct curly_node	curly_node_t;
 typedef struct curly_attr	curly_attr_t;
 typedef struct curly_iter	curly_iter_t;
+typedef struct curly_atom	curly_atom_t;
 
 extern curly_node_t *		curly_node_new(void);
 extern void			curly_node_free(curly_node_t *);
 extern void			curly_node_copy(curly_node_t *dst, const curly_node_t *src);
+extern void			curly_node_copy_cow(curly_node_t *dst, const curly_node_t *src);
 extern int			curly_node_write(curly_node_t *cfg, const char *path);
 extern int			curly_node_write_fp(curly_node_t *cfg, FILE *fp);
 extern curly_node_t *		curly_node_read(const char *path);
+extern curly_node_t *		curly_node_read_flags(const char *path, unsigned int flags);
+extern int			curly_node_write_binary(const curly_node_t *cfg, const char *path);
+extern curly_node_t *		curly_node_read_binary(const char *path);
+extern curly_node_t *		curly_node_parse_buffer(const char *buf, size_t len, const char *origin_name);
 extern const char *		curly_node_name(const curly_node_t *cfg);
 extern const char *		curly_node_type(const curly_node_t *cfg);
 extern curly_node_t *		curly_node_get_child(const curly_node_t *cfg, const char *type, const char *name);
@@ -45,13 +53,85 @@ extern const char **		curly_node_get_attr_names(const curly_node_t *);
 extern void			curly_node_set_attr(curly_node_t *cfg, const char *name, const char *value);
 extern void			curly_node_set_attr_list(curly_node_t *cfg, const char *name, const char * const *value);
 extern void			curly_node_add_attr_list(curly_node_t *cfg, const char *name, const char *value);
+extern void			curly_node_append_attr_values(curly_node_t *cfg, const char *name,
+						const char * const *values, unsigned int count);
 extern const char *		curly_node_get_attr(curly_node_t *cfg, const char *name);
 extern const char * const *	curly_node_get_attr_list(curly_node_t *cfg, const char *name);
 
+/*
+ * Typed attribute accessors. Each parses the first value of the
+ * attribute once, and caches the result until the attribute is assigned
+ * again. They return false if the attribute is not set, or if its value
+ * is invalid; the latter is reported along with the file and line the
+ * node was defined at.
+ *
+ * Integers are decimal, or hexadecimal with a 0x prefix, as in "0x1f";
+ * a leading zero does not make them octal, so "010" is ten. Only signed
+ * integers may start with a minus sign.
+ *
+ * Booleans are true, yes, on, 1 or false, no, off, 0. A duration is a
+ * sequence of numbers with units ms, s, m, h or d, as in "1h30m", and is
+ * returned in milliseconds; a number without unit is in seconds. An IPv4
+ * prefix is a dotted quad that may be shortened, followed by an optional
+ * prefix length, as in "192.168.1/24"; without one, the length is the
+ * number of bits given.
+ */
+typedef struct curly_ipv4_prefix {
+	uint8_t			addr[4];	/* network byte order */
+	unsigned int		len;
+} curly_ipv4_prefix_t;
+
+extern bool			curly_node_get_int(curly_node_t *cfg, const char *name, int *value);
+extern bool			curly_node_get_uint64(curly_node_t *cfg, const char *name, uint64_t *value);
+extern bool			curly_node_get_bool(curly_node_t *cfg, const char *name, bool *value);
+extern bool			curly_node_get_duration(curly_node_t *cfg, const char *name, uint64_t *msec);
+extern bool			curly_node_get_ipv4_prefix(curly_node_t *cfg, const char *name, curly_ipv4_prefix_t *);
+extern bool			curly_node_get_ipv6(curly_node_t *cfg, const char *name, uint8_t addr[16]);
+
+/*
+ * Atoms. All strings in a tree are interned; an atom is a handle to an
+ * interned string. Looking up children and attributes by atom compares
+ * pointers rather than strings. curly_atom() returns a reference that
+ * must be dropped with curly_atom_release().
+ */
+extern curly_atom_t *		curly_atom(const char *string);
+extern void			curly_atom_release(curly_atom_t *);
+extern const char *		curly_atom_string(const curly_atom_t *);
+extern curly_node_t *		curly_node_get_child_atom(const curly_node_t *cfg, const curly_atom_t *type, const curly_atom_t *name);
+extern void			curly_node_set_attr_atom(curly_node_t *cfg, const curly_atom_t *name, const char *value);
+extern const char *		curly_node_get_attr_atom(curly_node_t *cfg, const curly_atom_t *name);
+extern const char * const *	curly_node_get_attr_list_atom(curly_node_t *cfg, const curly_atom_t *name);
+
+/*
+ * Iterators over the children and attributes of a node. An iterator may
+ * live on the stack: curly_iter_init() sets it up without allocating,
+ * and curly_iter_destroy() must be called before it goes out of scope.
+ * With a type, only children of that type are returned. Changing the
+ * node ends the iteration; freeing it while an iterator is in use is
+ * not allowed.
+ *
+ * curly_node_foreach_child() calls visit for each child of the given
+ * type (or all children if type is NULL), until visit returns nonzero;
+ * it returns that value, or 0.
+ */
+struct curly_iter {
+	/* private */
+	const curly_node_t *	node;
+	unsigned int		modcount;
+	const char *		type;
+	curly_node_t *		next_item;
+	curly_attr_t *		next_attr;
+};
+
+extern void			curly_iter_init(curly_iter_t *, curly_node_t *, const char *type);
+extern void			curly_iter_destroy(curly_iter_t *);
 extern curly_iter_t *		curly_node_iterate(curly_node_t *);
 extern curly_node_t *		curly_iter_next_node(curly_iter_t *);
 extern curly_attr_t *		curly_iter_next_attr(curly_iter_t *);
 extern void			curly_iter_free(curly_iter_t *);
+extern int			curly_node_foreach_child(curly_node_t *, const char *type,
+						int (*visit)(curly_node_t *child, void *user_data),
+						void *user_data);
 
 extern const char *		curly_attr_get_name(const curly_attr_t *);
 extern unsigned int		curly_attr_get_count(const curly_attr_t *);
@@ -64,4 +144,149 @@ extern const char *		curly_node_format_to_string(int fmt);
 extern const char *		curly_node_get_source_file(const curly_node_t *);
 extern unsigned int		curly_node_get_source_line(const curly_node_t *);
 
+/*
+ * A tree returned by curly_node_read() remembers the files it was read
+ * from. curly_node_reload() re-reads only those files that changed since,
+ * and updates the tree in place. Nodes that exist before and after the
+ * reload are preserved; the changed callback is invoked for every node
+ * whose attributes or children changed, and for every node that was added.
+ * Returns the number of nodes reported, or -1 on error (in which case the
+ * tree is left untouched).
+ */
+extern int			curly_node_reload(curly_node_t *, void (*changed)(curly_node_t *, void *user_data),
+						void *user_data);
+extern const char **		curly_node_get_source_files(const curly_node_t *);
+
+/*
+ * Flags for curly_node_read_flags()
+ */
+#define CURLY_READ_F_PARALLEL		0x0001	/* read and parse include files in parallel */
+#define CURLY_READ_F_CACHE		0x0002	/* use a binary cache, stored as <path>.cache */
+#define CURLY_READ_F_ARENA		0x0004	/* allocate the tree in large chunks, for faster load and free */
+
+/*
+ * Event based parsing.
+ * Rather than building a tree, the parser invokes these callbacks as it
+ * goes. Strings passed to a callback are only valid for the duration of
+ * that call. Any callback may be NULL; returning false aborts the parse.
+ *
+ * An attribute with a single value replaces any previous value, while a
+ * comma separated list of values is appended to it.
+ * The include callback is invoked with the resolved path before the
+ * contents of the included file are reported.
+ */
+#define CURLY_EVENT_F_UPDATE		0x0001	/* node was declared with %update */
+
+typedef struct curly_event_handler {
+	bool			(*begin_node)(void *user_data, const char *type, const char *name,
+						const char *file, unsigned int line, unsigned int flags);
+	bool			(*attribute)(void *user_data, const char *name,
+						const char * const *values, unsigned int count);
+	bool			(*end_node)(void *user_data);
+	bool			(*include)(void *user_data, const char *path);
+} curly_event_handler_t;
+
+extern bool			curly_events_read(const char *path, const curly_event_handler_t *, void *user_data);
+extern bool			curly_events_parse_buffer(const char *buf, size_t len, const char *origin_name,
+						const curly_event_handler_t *, void *user_data);
+
+/*
+ * Compiled paths, such as "node[client]/interface[eth0]/ipaddr".
+ * Each type[name] component selects a child; an empty name matches any.
+ * A path may end in a plain attribute name.
+ *
+ * A path caches the result of its last lookup, which remains valid
+ * until the tree is modified. Repeated lookups in an unchanged tree
+ * only compare the tree's generation. Only lookups from a root node are
+ * cached. As the cache lives in the path, a path must not be used by
+ * several threads at once.
+ */
+typedef struct curly_path	curly_path_t;
+
+extern curly_path_t *		curly_path_compile(const char *path);
+extern void			curly_path_free(curly_path_t *);
+extern curly_node_t *		curly_node_lookup(curly_node_t *root, curly_path_t *path);
+extern const char *		curly_node_lookup_attr(curly_node_t *root, curly_path_t *path);
+extern const char * const *	curly_node_lookup_attr_list(curly_node_t *root, curly_path_t *path);
+
+/*
+ * Selectors find all nodes or attribute values matching a pattern, such
+ * as "node[*]/interface[eth*][network=private]/ipaddr". They extend the
+ * path syntax with wildcards in types, names and attribute names, and
+ * with [attr] and [attr=value] predicates following a type[name].
+ *
+ * The select functions store up to max results in the caller's array,
+ * in tree order, and return the total number of matches. Call them with
+ * a larger array if that exceeds max. curly_node_select() is for
+ * selectors that end in a type[name], curly_node_select_values() for
+ * those ending in an attribute name; it returns all values of all
+ * matching attributes. The results remain valid until the tree changes.
+ */
+typedef struct curly_selector	curly_selector_t;
+
+extern curly_selector_t *	curly_selector_compile(const char *selector);
+extern void			curly_selector_free(curly_selector_t *);
+extern bool			curly_selector_selects_attr(const curly_selector_t *);
+extern unsigned int		curly_node_select(curly_node_t *root, const curly_selector_t *,
+						curly_node_t **nodes, unsigned int max);
+extern unsigned int		curly_node_select_values(curly_node_t *root, const curly_selector_t *,
+						const char **values, unsigned int max);
+
+/*
+ * Content hashes. curly_node_hash() covers the type and name of a node,
+ * its attributes and their values, and its children, recursively, all
+ * in order. It is computed on demand and cached until the node or one
+ * of its descendants changes, so comparing the hashes of two subtrees
+ * again is O(1), and changes can be located by descending only into
+ * children whose hashes differ.
+ *
+ * curly_node_equal() compares two subtrees. It returns false as soon as
+ * hashes differ, and does not descend into subtrees that are copies on
+ * write of the same node.
+ */
+extern uint64_t			curly_node_hash(curly_node_t *cfg);
+extern bool			curly_node_equal(curly_node_t *a, curly_node_t *b);
+
+/*
+ * Frozen trees. curly_node_freeze() makes a read-only copy of a tree,
+ * packed into a single allocation, with faster lookups. Functions that
+ * modify a frozen tree fail.
+ *
+ * A snapshot holder publishes frozen trees for concurrent readers. A
+ * reader acquires the current tree without locking, and must release
+ * it when done. The tree is freed when the last reader has released
+ * it and a newer one has been published. In between, reading it with
+ * the lookup, attribute and iterator functions does not write to any
+ * memory shared with other threads. Readers must not make copy on
+ * write copies of it; use curly_node_copy() instead.
+ *
+ * curly_snapshot_publish() takes ownership of the tree it is passed,
+ * and freezes it unless it is frozen already.
+ */
+typedef struct curly_snapshot	curly_snapshot_t;
+
+extern curly_node_t *		curly_node_freeze(const curly_node_t *cfg);
+extern bool			curly_node_is_frozen(const curly_node_t *cfg);
+
+extern curly_snapshot_t *	curly_snapshot_new(void);
+extern void			curly_snapshot_free(curly_snapshot_t *);
+extern void			curly_snapshot_publish(curly_snapshot_t *, curly_node_t *tree);
+extern curly_node_t *		curly_snapshot_acquire(curly_snapshot_t *);
+extern void			curly_snapshot_release(curly_node_t *tree);
+
+/*
+ * Journaling. While a journal is attached to a tree, every change made
+ * through the functions above is appended to a log file. The tree can be
+ * rebuilt from the base file and the log with curly_journal_replay().
+ * Compacting the journal writes the tree back to the base file and
+ * starts over with an empty log. As that would inline included files,
+ * only configs read from a single file can be journaled.
+ */
+typedef struct curly_journal	curly_journal_t;
+
+extern curly_journal_t *	curly_journal_open(curly_node_t *root, const char *base_path, const char *log_path);
+extern void			curly_journal_close(curly_journal_t *);
+extern int			curly_journal_compact(curly_journal_t *);
+extern curly_node_t *		curly_journal_replay(const char *base_path, const char *log_path);
+
 #endif /* CURLIES_H */
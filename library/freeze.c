@@ -0,0 +1,319 @@
+/*
+ * libcurly frozen trees - immutable snapshots in flat arrays
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * A frozen tree lives in a single block of memory, which holds
+ *  - all nodes, in breadth first order, so that the children of
+ *    each node are adjacent
+ *  - all attributes, with those of each node adjacent
+ *  - all attribute values
+ *  - for each node, pointers to its children sorted by type and name,
+ *    and pointers to its attributes sorted by name
+ *
+ * The nodes are regular curly_node_t's, with their lists linked in
+ * their original order, so that all read accessors work as usual.
+ * Lookups use binary search on the sorted arrays, though. Strings are
+ * atoms shared with the tree the snapshot was made from.
+ *
+ * The block belongs to the root node; all other nodes of the snapshot
+ * go away along with it. The root is reference counted, so that a
+ * snapshot can be shared between threads (see snapshot.c).
+ */
+struct curly_frozen_layout {
+	unsigned int	nnodes;
+	unsigned int	nattrs;
+	unsigned int	nvalues;
+};
+
+static void
+__curly_frozen_count(const curly_node_t *node, struct curly_frozen_layout *layout)
+{
+	const curly_attr_t *attr;
+	const curly_node_t *child;
+
+	node = curly_node_contents(node);
+
+	for (attr = node->attrs; attr; attr = attr->next) {
+		layout->nattrs++;
+		layout->nvalues += attr->nvalues + 1;
+	}
+
+	for (child = node->children; child; child = child->next) {
+		layout->nnodes++;
+		__curly_frozen_count(child, layout);
+	}
+}
+
+static int
+__curly_frozen_strcmp(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != NULL) - (b != NULL);
+	return strcmp(a, b);
+}
+
+static int
+__curly_frozen_child_cmp(const void *ap, const void *bp)
+{
+	const curly_node_t *a = *(const curly_node_t **) ap;
+	const curly_node_t *b = *(const curly_node_t **) bp;
+	int r;
+
+	if ((r = __curly_frozen_strcmp(a->type, b->type)) == 0
+	 && (r = __curly_frozen_strcmp(a->name, b->name)) == 0)
+		r = (a > b) - (a < b);
+	return r;
+}
+
+static int
+__curly_frozen_attr_cmp(const void *ap, const void *bp)
+{
+	const curly_attr_t *a = *(const curly_attr_t **) ap;
+	const curly_attr_t *b = *(const curly_attr_t **) bp;
+
+	return strcmp(a->name, b->name);
+}
+
+static void
+__curly_frozen_copy_attrs(curly_node_t *node, const curly_node_t *src,
+			curly_attr_t **attrs, char ***values)
+{
+	const curly_attr_t *src_attr;
+	curly_attr_t **pos = &node->attrs;
+	unsigned int n;
+
+	for (src_attr = src->attrs; src_attr; src_attr = src_attr->next) {
+		curly_attr_t *attr = (*attrs)++;
+
+		attr->name = curly_atom_ref(src_attr->name);
+		attr->nvalues = src_attr->nvalues;
+		attr->values = *values;
+		for (n = 0; n < src_attr->nvalues; ++n)
+			attr->values[n] = curly_atom_ref(src_attr->values[n]);
+		*values += src_attr->nvalues + 1;
+
+		*pos = attr;
+		pos = &attr->next;
+	}
+}
+
+curly_node_t *
+curly_node_freeze(const curly_node_t *cfg)
+{
+	struct curly_frozen_layout layout = { .nnodes = 1 };
+	const curly_node_t **origin, *src, *src_child;
+	struct curly_frozen_node *frozen;
+	curly_node_t *nodes, **child_ptrs;
+	curly_attr_t *attrs, **attr_ptrs;
+	unsigned int i, next_node = 1;
+	char **values;
+	void *block;
+
+	__curly_frozen_count(cfg, &layout);
+
+	block = calloc(1, layout.nnodes * sizeof(nodes[0])
+			+ layout.nnodes * sizeof(frozen[0])
+			+ layout.nnodes * sizeof(child_ptrs[0])
+			+ layout.nattrs * sizeof(attrs[0])
+			+ layout.nattrs * sizeof(attr_ptrs[0])
+			+ layout.nvalues * sizeof(values[0]));
+
+	nodes = block;
+	frozen = (void *) (nodes + layout.nnodes);
+	child_ptrs = (void *) (frozen + layout.nnodes);
+	attrs = (void *) (child_ptrs + layout.nnodes);
+	attr_ptrs = (void *) (attrs + layout.nattrs);
+	values = (void *) (attr_ptrs + layout.nattrs);
+
+	/* The source node each node was copied from */
+	origin = calloc(layout.nnodes, sizeof(origin[0]));
+
+	nodes[0].generation = curly_tree_generation_new();
+	nodes[0].type = curly_atom_ref(cfg->type);
+	nodes[0].name = curly_atom_ref(cfg->name);
+	curly_origin_set(&nodes[0].origin, cfg->origin.path, cfg->origin.line);
+	origin[0] = cfg;
+
+	for (i = 0; i < layout.nnodes; ++i) {
+		curly_node_t *node = &nodes[i], **pos = &node->children;
+		struct curly_frozen_node *f = &frozen[i];
+		curly_attr_t *attr;
+
+		src = curly_node_contents(origin[i]);
+		node->frozen = f;
+
+		f->attrs = attr_ptrs;
+		__curly_frozen_copy_attrs(node, src, &attrs, &values);
+		for (attr = node->attrs; attr; attr = attr->next)
+			attr_ptrs[f->nattrs++] = attr;
+		qsort(f->attrs, f->nattrs, sizeof(f->attrs[0]), __curly_frozen_attr_cmp);
+		attr_ptrs += f->nattrs;
+
+		f->children = child_ptrs;
+		for (src_child = src->children; src_child; src_child = src_child->next) {
+			curly_node_t *child = &nodes[next_node];
+
+			origin[next_node++] = src_child;
+			child->parent = node;
+			child->type = curly_atom_ref(src_child->type);
+			child->name = curly_atom_ref(src_child->name);
+			curly_origin_set(&child->origin, src_child->origin.path, src_child->origin.line);
+			if (child->type == NULL || child->name == NULL)
+				f->nwild++;
+
+			*pos = child;
+			pos = &child->next;
+			child_ptrs[f->nchildren++] = child;
+		}
+		qsort(f->children, f->nchildren, sizeof(f->children[0]), __curly_frozen_child_cmp);
+		child_ptrs += f->nchildren;
+	}
+
+	free(origin);
+
+	/* Readers must not have to write the hashes */
+	curly_node_hash(nodes);
+
+	frozen[0].refcount = 1;
+	return nodes;
+}
+
+/*
+ * Release the snapshot that root belongs to
+ */
+static void
+curly_frozen_free(curly_node_t *root)
+{
+	unsigned int i, n, nnodes = 1;
+	curly_node_t *nodes = root;
+
+	/* Copies sharing parts of the snapshot need their own contents.
+	 * Parents come before their children, so the stand-ins created
+	 * for the children of a copy are taken care of further down. */
+	for (i = 0; i < nnodes; ++i) {
+		curly_node_t *node = &nodes[i];
+
+		nnodes += node->frozen->nchildren;
+		while (node->cow_users)
+			curly_node_unshare(node->cow_users);
+	}
+
+	for (i = 0; i < nnodes; ++i) {
+		curly_node_t *node = &nodes[i];
+		curly_attr_t *attr;
+
+		for (attr = node->attrs; attr; attr = attr->next) {
+			curly_atom_unref(attr->name);
+			for (n = 0; n < attr->nvalues; ++n)
+				curly_atom_unref(attr->values[n]);
+		}
+
+		curly_origin_destroy(&node->origin);
+		curly_atom_unref(node->type);
+		curly_atom_unref(node->name);
+	}
+
+	free(root);
+}
+
+/*
+ * Take and drop references to a snapshot. These may be called from
+ * any thread; the last reference frees it.
+ */
+curly_node_t *
+curly_frozen_get(curly_node_t *root)
+{
+	__atomic_add_fetch(&root->frozen->refcount, 1, __ATOMIC_RELAXED);
+	return root;
+}
+
+void
+curly_frozen_put(curly_node_t *root)
+{
+	if (__atomic_sub_fetch(&root->frozen->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		curly_frozen_free(root);
+}
+
+/*
+ * Lookups by binary search
+ */
+static int
+__curly_frozen_slice_cmp(const curly_slice_t *slice, const char *s)
+{
+	int r;
+
+	if ((r = strncmp(slice->ptr, s, slice->len)) != 0)
+		return r;
+	return s[slice->len]? -1 : 0;
+}
+
+curly_node_t *
+curly_frozen_get_child(const curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name)
+{
+	const struct curly_frozen_node *f = cfg->frozen;
+	unsigned int lo = 0, hi = f->nchildren;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		curly_node_t *child = f->children[mid];
+		int r;
+
+		if ((r = __curly_frozen_slice_cmp(type, child->type)) == 0
+		 && (r = __curly_frozen_slice_cmp(name, child->name)) == 0) {
+			/* Return the first one in list order */
+			while (mid > 0
+			    && f->children[mid - 1]->type == child->type
+			    && f->children[mid - 1]->name == child->name)
+				child = f->children[--mid];
+			return child;
+		}
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+curly_attr_t *
+curly_frozen_get_attr(const curly_node_t *cfg, const curly_slice_t *name)
+{
+	const struct curly_frozen_node *f = cfg->frozen;
+	unsigned int lo = 0, hi = f->nattrs;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int r;
+
+		if ((r = __curly_frozen_slice_cmp(name, f->attrs[mid]->name)) == 0)
+			return f->attrs[mid];
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
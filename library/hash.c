@@ -0,0 +1,124 @@
+/*
+ * libcurly content hashes - compare trees by the hashes of their subtrees
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * The hash of a node combines its type and name with the hash of its
+ * contents, which covers its attributes and values in order, and the
+ * hashes of its children in order. Strings are atoms, which carry their
+ * hash already, so hashing a node costs a few multiplications per
+ * attribute value and child.
+ *
+ * The contents hash is cached in the node that holds the contents, so
+ * copies on write share it with their source. Any change to a node
+ * clears the cached hash of the node and its ancestors, see
+ * __curly_node_changed(). Frozen trees have all hashes computed when
+ * they are made, and are never written to afterwards.
+ */
+#define CURLY_HASH_NULL		0x6a09e667f3bcc908ULL
+
+static inline uint64_t
+__curly_hash_mix(uint64_t hash, uint64_t value)
+{
+	hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+	return hash ^ (hash >> 32);
+}
+
+static inline uint64_t
+__curly_hash_atom(const char *value)
+{
+	return value? curly_atom_hash(value) : CURLY_HASH_NULL;
+}
+
+static uint64_t
+__curly_hash_contents(curly_node_t *cfg)
+{
+	const curly_attr_t *attr;
+	curly_node_t *child;
+	uint64_t hash = CURLY_HASH_INIT;
+	unsigned int n, count = 0;
+
+	if (cfg->contents_hash_valid)
+		return cfg->contents_hash;
+
+	for (attr = cfg->attrs; attr; attr = attr->next, ++count) {
+		hash = __curly_hash_mix(hash, curly_atom_hash(attr->name));
+		hash = __curly_hash_mix(hash, attr->nvalues);
+		for (n = 0; n < attr->nvalues; ++n)
+			hash = __curly_hash_mix(hash, curly_atom_hash(attr->values[n]));
+	}
+	hash = __curly_hash_mix(hash, count);
+
+	for (child = cfg->children, count = 0; child; child = child->next, ++count)
+		hash = __curly_hash_mix(hash, curly_node_hash(child));
+	hash = __curly_hash_mix(hash, count);
+
+	cfg->contents_hash = hash;
+	cfg->contents_hash_valid = true;
+	return hash;
+}
+
+uint64_t
+curly_node_hash(curly_node_t *cfg)
+{
+	uint64_t hash = CURLY_HASH_INIT;
+
+	hash = __curly_hash_mix(hash, __curly_hash_atom(cfg->type));
+	hash = __curly_hash_mix(hash, __curly_hash_atom(cfg->name));
+	return __curly_hash_mix(hash, __curly_hash_contents((curly_node_t *) curly_node_contents(cfg)));
+}
+
+/*
+ * Nodes with different hashes differ. Nodes with equal hashes are
+ * compared in full, so that a collision cannot make them equal; this
+ * only compares pointers, and stops at subtrees that share contents.
+ */
+bool
+curly_node_equal(curly_node_t *a, curly_node_t *b)
+{
+	const curly_node_t *ca, *cb;
+	curly_node_t *x, *y;
+
+	if (a == b)
+		return true;
+	if (a->type != b->type || a->name != b->name)
+		return false;
+
+	ca = curly_node_contents(a);
+	cb = curly_node_contents(b);
+	if (ca == cb)
+		return true;
+
+	if (curly_node_hash(a) != curly_node_hash(b))
+		return false;
+
+	if (!curly_attr_list_equal(ca->attrs, cb->attrs))
+		return false;
+
+	for (x = ca->children, y = cb->children; x && y; x = x->next, y = y->next) {
+		if (!curly_node_equal(x, y))
+			return false;
+	}
+	return x == NULL && y == NULL;
+}
@@ -21,10 +21,26 @@
 #ifndef CURLIES_INTERNAL_H
 #define CURLIES_INTERNAL_H
 
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "config.h"
 
 typedef struct curly_shared_string curly_shared_string_t;
 typedef struct curly_origin curly_origin_t;
+typedef struct curly_slice curly_slice_t;
+typedef struct curly_include_cache curly_include_cache_t;
+typedef struct curly_arena curly_arena_t;
+
+/*
+ * A (pointer, length) reference to a string that is not necessarily
+ * NUL terminated, such as a token inside the parser's input buffer.
+ * A NULL ptr means "no string".
+ */
+struct curly_slice {
+	const char *	ptr;
+	size_t		len;
+};
 
 struct curly_shared_string {
 	char *		value;
@@ -37,18 +53,36 @@ struct curly_origin {
 };
 
 
-#define CURLIES_NODE_SHORTLIST_MAX	2
+/*
+ * The values of an attribute are stored right behind it, in the same
+ * allocation, which is sized for the values it is created with. Only a
+ * list that grows beyond that moves to a separate array on the heap.
+ */
 struct curly_attr {
 	curly_attr_t *	next;
 	char *		name;
+	char **		values;
+
+	/* Parsed form of values[0], see typed.c */
+	struct curly_attr_typed *typed;
 
 	unsigned int	nvalues;
-	char **		values;
-	char *		short_list[CURLIES_NODE_SHORTLIST_MAX+1];
+
+	/* Number of values that fit into values[], not counting
+	 * the terminating NULL. Attributes built in an arena may have
+	 * values[] in the arena too, and the arena holds the references
+	 * to their name and values until the values are changed. */
+	unsigned int	capacity : 29,
+			in_arena : 1,
+			arena_values : 1,
+			values_in_arena : 1;
+
+	char *		inline_values[];
 };
 
 struct curly_node {
 	curly_node_t *	next;
+	curly_node_t *	parent;
 
 	curly_origin_t	origin;
 
@@ -56,29 +90,288 @@ struct curly_node {
 	char *		type;
 	char *		name;
 
-	/* Attributes */
+	/* Attributes; nodes with many of them index them by name */
 	curly_attr_t *	attrs;
+	struct curly_attr_index *attr_index;
 
-	/* Attach active iterators here */
-	curly_iter_t *	iterators;
+	/* Bumped by every change that may remove children or attributes.
+	 * Iterators remember the count they started with, and stop when
+	 * it changes. */
+	unsigned int	modcount;
 
 	curly_node_t *	children;
+
+	/* Nodes with many children index them by type and name */
+	struct curly_child_index *child_index;
+	curly_node_t *	hash_next;
+
+	/* Root nodes only: the files this tree was read from */
+	curly_include_cache_t *sources;
+
+	/* Root nodes only: journal of all changes made to the tree */
+	curly_journal_t *journal;
+
+	/* Root nodes only: bumped whenever the tree changes. The upper
+	 * half identifies the tree, so that a tree allocated at the
+	 * address of a freed one is not mistaken for it. */
+	uint64_t	generation;
+
+	/* Hash of the attributes and children, computed on demand by
+	 * curly_node_hash(), see hash.c */
+	uint64_t	contents_hash;
+	bool		contents_hash_valid;
+
+	/* Nodes built by the parser may be allocated from an arena, which
+	 * is owned by the root node, and holds their type, name and origin */
+	curly_arena_t *	arena;
+	bool		in_arena;
+
+	/* Copy on write: a node created by curly_node_copy_cow() has no
+	 * attributes or children of its own until it is modified, and
+	 * shares those of cow_src instead. cow_users lists all nodes
+	 * sharing ours.
+	 * Looking up a child needs a node whose parent is the copy, so the
+	 * first lookup gives it stand-ins for the children of cow_src, and
+	 * sets cow_children; it still shares everything else. */
+	curly_node_t *	cow_src;
+	bool		cow_children;
+	curly_node_t *	cow_users;
+	curly_node_t *	cow_next;
+	curly_node_t **	cow_pprev;
+
+	/* Nodes of a snapshot made by curly_node_freeze() */
+	struct curly_frozen_node *frozen;
+};
+
+struct curly_frozen_node {
+	unsigned int	nchildren;
+	unsigned int	nwild;		/* children with a NULL type or name */
+	unsigned int	nattrs;
+	curly_node_t **	children;	/* sorted by type and name */
+	curly_attr_t **	attrs;		/* sorted by name */
+	unsigned int	refcount;	/* root only; see curly_frozen_put() */
 };
 
-struct curly_iter {
-	curly_iter_t *	chain;
+/*
+ * Return the node that holds the attributes and children of cfg; this
+ * is cfg itself unless it is an unmodified copy on write.
+ */
+static inline const curly_node_t *
+curly_node_contents(const curly_node_t *cfg)
+{
+	while (cfg->cow_src)
+		cfg = cfg->cow_src;
+	return cfg;
+}
 
-	bool		valid;
+static inline curly_slice_t
+curly_slice_from_string(const char *s)
+{
+	return (curly_slice_t) { s, s? strlen(s) : 0 };
+}
+
+static inline bool
+curly_slice_equal(const curly_slice_t *slice, const char *s)
+{
+	return slice->ptr && !strncmp(slice->ptr, s, slice->len) && s[slice->len] == '\0';
+}
+
+/*
+ * 64bit FNV-1a hash
+ */
+#define CURLY_HASH_INIT		0xcbf29ce484222325ULL
 
-	curly_node_t *	node;
-	curly_node_t *	next_item;
-	curly_attr_t *	next_attr;
+static inline uint64_t
+curly_hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Interned strings, see atom.c. All type names, node names, attribute
+ * names and values in a tree point to the value of an atom.
+ */
+struct curly_atom {
+	curly_atom_t *	next;
+	curly_atom_t **	pprev;
+	uint64_t	hash;		/* curly_hash_bytes() of the value */
+	unsigned int	refcount;
+	size_t		len;
+	char		value[];
 };
 
+static inline curly_atom_t *
+curly_atom_of(const char *value)
+{
+	return (curly_atom_t *) (value - offsetof(curly_atom_t, value));
+}
+
+static inline uint64_t
+curly_atom_hash(const char *value)
+{
+	return curly_atom_of(value)->hash;
+}
+
+/*
+ * Arena allocation, see arena.c
+ */
+extern curly_arena_t *	curly_arena_new(void);
+extern void		curly_arena_free(curly_arena_t *);
+extern void *		curly_arena_alloc(curly_arena_t *, size_t);
+extern void		curly_arena_seal(curly_arena_t *);
+extern bool		curly_arena_sealed(const curly_arena_t *);
+extern void		curly_arena_touch(curly_arena_t *);
+extern bool		curly_arena_touched(const curly_arena_t *);
+extern char *		curly_arena_hold_atom(curly_arena_t *, char *value);
+extern curly_shared_string_t *curly_arena_hold_path(curly_arena_t *, curly_shared_string_t *);
+
+extern char *		curly_atom_intern(const curly_slice_t *);
+extern char *		curly_atom_ref(char *value);
+extern void		curly_atom_unref(char *value);
+
+/*
+ * A file that a tree was read from, and the hash of its contents
+ */
+typedef struct curly_source {
+	const char *	path;
+	uint64_t	hash;
+	bool		glob;	/* path is a wildcard pattern, hash covers the matches */
+} curly_source_t;
+
+/*
+ * A child (type and name) or attribute (name, with a NULL type) of a
+ * node. Both strings are atoms.
+ */
+typedef struct curly_node_key {
+	char *		type;
+	char *		name;
+} curly_node_key_t;
+
+/*
+ * Some of the children and attributes of a node, along with the child
+ * and attribute that came right before them (NULL if none did), see
+ * curly_node_update_part().
+ */
+typedef struct curly_node_part {
+	unsigned int	count;
+	curly_node_key_t *keys;
+
+	curly_node_key_t after_child;
+	char *		after_attr;
+} curly_node_part_t;
+
+/*
+ * Character classes used by the lexer, see scanner.c
+ */
+#define CURLY_CC_SPACE		0x01
+#define CURLY_CC_ALNUM		0x02
+#define CURLY_CC_IDENT		0x04
+
+extern const unsigned char	curly_ctype[256];
+
+static inline bool
+curly_isspace(char cc)
+{
+	return curly_ctype[(unsigned char) cc] & CURLY_CC_SPACE;
+}
+
+static inline bool
+curly_isalnum(char cc)
+{
+	return curly_ctype[(unsigned char) cc] & CURLY_CC_ALNUM;
+}
+
+static inline bool
+curly_isident(char cc)
+{
+	return curly_ctype[(unsigned char) cc] & CURLY_CC_IDENT;
+}
+
+/*
+ * Bulk scanning primitives. Each of these returns a pointer to the first
+ * character at or after pos that terminates the run (or end).
+ */
+typedef struct curly_scanner {
+	const char *	name;
+
+	/* skip white space, and count the newlines we skipped */
+	const char *	(*skip_space)(const char *pos, const char *end, unsigned int *newlines);
+	/* skip characters that can be part of an identifier */
+	const char *	(*skip_ident)(const char *pos, const char *end);
+	/* find the next '"', '\\' or newline */
+	const char *	(*find_string_special)(const char *pos, const char *end);
+	/* find the next '\\' or newline */
+	const char *	(*find_line_special)(const char *pos, const char *end);
+} curly_scanner_t;
+
+extern const curly_scanner_t *curly_scanner_get(void);
+
 extern curly_node_t *	curly_parse(const char *filename);
+extern curly_node_t *	curly_parse_parallel(const char *filename, unsigned int nthreads);
+extern curly_node_t *	curly_parse_arena(const char *filename, unsigned int nthreads);
+extern curly_node_t *	curly_node_new_arena(void);
+extern int		curly_reload(curly_node_t *root, void (*changed)(curly_node_t *, void *), void *user_data);
+extern const char **	curly_source_files(const curly_node_t *root);
+extern curly_source_t *	curly_source_list(const curly_node_t *root, unsigned int *count);
+extern bool		curly_source_list_restore(curly_node_t *root, const curly_source_t *list, unsigned int count);
+extern bool		curly_glob_hash(const char *pattern, uint64_t *hash);
+extern void		curly_include_cache_free(curly_include_cache_t *);
+extern curly_node_t *	curly_parse_buffer(const char *buf, size_t len, const char *origin_name);
 extern void		curly_write(const curly_node_t *cfg, const char *filename);
 extern void		curly_print(const curly_node_t *cfg, FILE *fp);
 
+extern curly_node_t *	curly_node_get_child_slice(const curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name);
+extern curly_node_t *	curly_node_add_child_slice(curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name);
+extern void		curly_node_set_attr_slice(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value);
+extern void		curly_node_add_attr_list_slice(curly_node_t *cfg, const curly_slice_t *name, const curly_slice_t *value);
+extern void		curly_node_add_attr_list_slices(curly_node_t *cfg, const curly_slice_t *name,
+				const curly_slice_t *values, unsigned int count);
+extern void		curly_node_clear(curly_node_t *cfg);
+extern void		curly_node_index_children(curly_node_t *cfg);
+extern void		curly_node_unshare(curly_node_t *cfg);
+extern void		curly_node_set_origin(curly_node_t *cfg, curly_shared_string_t *path, unsigned int line);
+extern void		curly_node_cow_children(const curly_node_t *cfg);
+extern curly_attr_t *	curly_node_find_attr(curly_node_t *cfg, const char *name);
+extern curly_attr_t *	curly_node_find_attr_atom(curly_node_t *cfg, const curly_atom_t *name);
+extern bool		curly_attr_list_equal(const curly_attr_t *a, const curly_attr_t *b);
+extern uint64_t		curly_tree_generation_new(void);
+extern curly_node_t *	curly_frozen_get(curly_node_t *root);
+extern void		curly_frozen_put(curly_node_t *root);
+extern curly_node_t *	curly_frozen_get_child(const curly_node_t *cfg, const curly_slice_t *type, const curly_slice_t *name);
+extern curly_attr_t *	curly_frozen_get_attr(const curly_node_t *cfg, const curly_slice_t *name);
+extern unsigned int	curly_node_update(curly_node_t *dst, const curly_node_t *src,
+				void (*changed)(curly_node_t *, void *), void *user_data);
+extern bool		curly_node_part_fits(curly_node_t *dst, const curly_node_part_t *old, const curly_node_part_t *part);
+extern unsigned int	curly_node_update_part(curly_node_t *dst, const curly_node_t *src, const curly_node_part_t *old,
+				void (*changed)(curly_node_t *, void *), void *user_data);
+extern curly_node_t *	curly_node_get_child_key(curly_node_t *cfg, const curly_node_key_t *key);
+extern curly_node_t *	curly_node_last_child(const curly_node_t *cfg);
+extern curly_attr_t *	curly_node_last_attr(const curly_node_t *cfg);
+
+/*
+ * Binary cache, see binary.c
+ */
+extern curly_node_t *	curly_binary_cache_load(const char *path, const char *cache_path);
+extern void		curly_binary_cache_store(const curly_node_t *cfg, const char *cache_path);
+
+/*
+ * Journal hooks, see journal.c
+ */
+extern curly_journal_t *curly_node_journal(const curly_node_t *);
+extern void		curly_journal_set_attr(curly_journal_t *, const curly_node_t *, const char *name, const char *value);
+extern void		curly_journal_set_attr_list(curly_journal_t *, const curly_node_t *, const char *name, const char * const *values);
+extern void		curly_journal_add_attr(curly_journal_t *, const curly_node_t *, const char *name, const char *value);
+extern void		curly_journal_add_child(curly_journal_t *, const curly_node_t *, const char *type, const char *name);
+extern void		curly_journal_drop_child(curly_journal_t *, const curly_node_t *child);
+extern void		curly_journal_copy(curly_journal_t *, const curly_node_t *);
+extern void		curly_journal_detach(curly_journal_t *);
+
 extern void		curly_origin_init(curly_origin_t *, const char *path);
 extern void		curly_origin_set(curly_origin_t *dst, curly_shared_string_t *fo, unsigned int line);
 extern void		curly_origin_destroy(curly_origin_t *dst);
@@ -0,0 +1,803 @@
+/*
+ * libcurly journal - an append-only log of changes made to a tree
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * The log starts with a header that identifies the base file it applies
+ * to by a hash of its contents, and those of any files it includes.
+ * Compaction rewrites the base file before truncating the log, so if we
+ * crash in between, we're left with a log that no longer matches the
+ * base file, and replay ignores it.
+ *
+ * Each record is prefixed with its length, so that a record that was
+ * only partially written can be detected and skipped. A record consists
+ * of an opcode, the path of the node it applies to, and its arguments.
+ * Numbers are encoded as LEB128 varints, and strings as their length plus
+ * one (0 meaning NULL) followed by the characters. A node path is the
+ * number of levels below the root, followed by the type and name of the
+ * node on each level.
+ */
+#define CURLY_JOURNAL_MAGIC	"CURLYJNL"
+#define CURLY_JOURNAL_MAGIC_LEN	8
+#define CURLY_JOURNAL_HDR_LEN	(CURLY_JOURNAL_MAGIC_LEN + 8)
+
+enum {
+	CURLY_JOURNAL_SET_ATTR = 1,
+	CURLY_JOURNAL_SET_ATTR_LIST,
+	CURLY_JOURNAL_ADD_ATTR,
+	CURLY_JOURNAL_ADD_CHILD,
+	CURLY_JOURNAL_DROP_CHILD,
+	CURLY_JOURNAL_CLEAR,
+};
+
+struct curly_journal {
+	curly_node_t *	root;
+	char *		base_path;
+	char *		log_path;
+
+	int		fd;
+	bool		failed;
+
+	/* The record we're currently assembling */
+	unsigned char *	buf;
+	size_t		len;
+	size_t		size;
+};
+
+static bool
+__curly_journal_hash_file(const char *path, uint64_t *hash_ret)
+{
+	uint64_t hash = CURLY_HASH_INIT;
+	char buffer[65536];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		/* A base file that does not exist yet is the same as an empty one */
+		if (errno == ENOENT) {
+			*hash_ret = hash;
+			return true;
+		}
+		fprintf(stderr, "%s: %m\n", path);
+		return false;
+	}
+
+	while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: read error: %m\n", path);
+			close(fd);
+			return false;
+		}
+		hash = curly_hash_bytes(hash, buffer, n);
+	}
+
+	close(fd);
+	*hash_ret = hash;
+	return true;
+}
+
+static uint64_t
+__curly_journal_hash_add(uint64_t hash, uint64_t value)
+{
+	unsigned char buf[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; ++i)
+		buf[i] = value >> (8 * i);
+	return curly_hash_bytes(hash, buf, sizeof(buf));
+}
+
+/*
+ * The hash of all files a tree was read from, as they were when we read
+ * them. A tree that was not read from a file stands for the base file.
+ */
+static bool
+__curly_journal_hash_sources(const curly_node_t *root, const char *base_path, uint64_t *hash_ret)
+{
+	uint64_t hash = CURLY_HASH_INIT, value;
+	curly_source_t *list;
+	unsigned int i, count;
+
+	if (!(list = curly_source_list(root, &count))) {
+		if (!__curly_journal_hash_file(base_path, &value))
+			return false;
+		*hash_ret = __curly_journal_hash_add(hash, value);
+		return true;
+	}
+
+	for (i = 0; i < count; ++i)
+		hash = __curly_journal_hash_add(hash, list[i].hash);
+	free(list);
+
+	*hash_ret = hash;
+	return true;
+}
+
+static void
+__curly_journal_header(unsigned char *hdr, uint64_t hash)
+{
+	unsigned int i;
+
+	memcpy(hdr, CURLY_JOURNAL_MAGIC, CURLY_JOURNAL_MAGIC_LEN);
+	for (i = 0; i < 8; ++i)
+		hdr[CURLY_JOURNAL_MAGIC_LEN + i] = hash >> (8 * i);
+}
+
+static bool
+__curly_write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+ * Start a new log for the base file with the given hash
+ */
+static bool
+__curly_journal_reset(curly_journal_t *journal, uint64_t hash)
+{
+	unsigned char hdr[CURLY_JOURNAL_HDR_LEN];
+
+	__curly_journal_header(hdr, hash);
+	if (ftruncate(journal->fd, 0) < 0
+	 || !__curly_write_all(journal->fd, hdr, sizeof(hdr))
+	 || fsync(journal->fd) < 0) {
+		fprintf(stderr, "%s: unable to write journal: %m\n", journal->log_path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Encoding of records
+ */
+static void
+__curly_journal_reserve(curly_journal_t *journal, size_t count)
+{
+	if (journal->len + count > journal->size) {
+		journal->size = 2 * (journal->len + count) + 256;
+		journal->buf = realloc(journal->buf, journal->size);
+	}
+}
+
+static void
+__curly_journal_put_number(curly_journal_t *journal, uint64_t value)
+{
+	__curly_journal_reserve(journal, 10);
+	do {
+		unsigned char cc = value & 0x7f;
+
+		value >>= 7;
+		if (value)
+			cc |= 0x80;
+		journal->buf[journal->len++] = cc;
+	} while (value);
+}
+
+static void
+__curly_journal_put_string(curly_journal_t *journal, const char *s)
+{
+	size_t len;
+
+	if (s == NULL) {
+		__curly_journal_put_number(journal, 0);
+		return;
+	}
+
+	len = strlen(s);
+	__curly_journal_put_number(journal, len + 1);
+	__curly_journal_reserve(journal, len);
+	memcpy(journal->buf + journal->len, s, len);
+	journal->len += len;
+}
+
+static void
+__curly_journal_put_path_r(curly_journal_t *journal, const curly_node_t *node)
+{
+	if (node->parent == NULL)
+		return;
+
+	__curly_journal_put_path_r(journal, node->parent);
+	__curly_journal_put_string(journal, node->type);
+	__curly_journal_put_string(journal, node->name);
+}
+
+static void
+__curly_journal_begin(curly_journal_t *journal, unsigned int op, const curly_node_t *node)
+{
+	const curly_node_t *n;
+	unsigned int depth = 0;
+
+	for (n = node; n->parent; n = n->parent)
+		depth++;
+
+	journal->len = 0;
+	__curly_journal_put_number(journal, op);
+	__curly_journal_put_number(journal, depth);
+	__curly_journal_put_path_r(journal, node);
+}
+
+/*
+ * Append the record to the log, using a single write so that
+ * a record is never interleaved with anything else.
+ */
+static void
+__curly_journal_commit(curly_journal_t *journal)
+{
+	unsigned char prefix[10];
+	struct iovec iov[2];
+	size_t prefix_len = 0, len = journal->len;
+	ssize_t n;
+
+	if (journal->failed)
+		return;
+
+	do {
+		prefix[prefix_len] = len & 0x7f;
+		len >>= 7;
+		if (len)
+			prefix[prefix_len] |= 0x80;
+		prefix_len++;
+	} while (len);
+
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = prefix_len;
+	iov[1].iov_base = journal->buf;
+	iov[1].iov_len = journal->len;
+
+	do {
+		n = writev(journal->fd, iov, 2);
+	} while (n < 0 && errno == EINTR);
+
+	if (n != (ssize_t) (prefix_len + journal->len)) {
+		if (n < 0)
+			fprintf(stderr, "%s: unable to write journal: %m\n", journal->log_path);
+		else
+			fprintf(stderr, "%s: short write to journal\n", journal->log_path);
+		journal->failed = true;
+	}
+}
+
+/*
+ * Hooks called by the mutator functions
+ */
+curly_journal_t *
+curly_node_journal(const curly_node_t *node)
+{
+	while (node->parent)
+		node = node->parent;
+	return node->journal;
+}
+
+void
+curly_journal_set_attr(curly_journal_t *journal, const curly_node_t *node, const char *name, const char *value)
+{
+	__curly_journal_begin(journal, CURLY_JOURNAL_SET_ATTR, node);
+	__curly_journal_put_string(journal, name);
+	__curly_journal_put_string(journal, value);
+	__curly_journal_commit(journal);
+}
+
+void
+curly_journal_set_attr_list(curly_journal_t *journal, const curly_node_t *node, const char *name, const char * const *values)
+{
+	unsigned int i, count = 0;
+
+	while (values && values[count])
+		count++;
+
+	__curly_journal_begin(journal, CURLY_JOURNAL_SET_ATTR_LIST, node);
+	__curly_journal_put_string(journal, name);
+	__curly_journal_put_number(journal, count);
+	for (i = 0; i < count; ++i)
+		__curly_journal_put_string(journal, values[i]);
+	__curly_journal_commit(journal);
+}
+
+void
+curly_journal_add_attr(curly_journal_t *journal, const curly_node_t *node, const char *name, const char *value)
+{
+	__curly_journal_begin(journal, CURLY_JOURNAL_ADD_ATTR, node);
+	__curly_journal_put_string(journal, name);
+	__curly_journal_put_string(journal, value);
+	__curly_journal_commit(journal);
+}
+
+void
+curly_journal_add_child(curly_journal_t *journal, const curly_node_t *node, const char *type, const char *name)
+{
+	__curly_journal_begin(journal, CURLY_JOURNAL_ADD_CHILD, node);
+	__curly_journal_put_string(journal, type);
+	__curly_journal_put_string(journal, name);
+	__curly_journal_commit(journal);
+}
+
+void
+curly_journal_drop_child(curly_journal_t *journal, const curly_node_t *child)
+{
+	__curly_journal_begin(journal, CURLY_JOURNAL_DROP_CHILD, child);
+	__curly_journal_commit(journal);
+}
+
+static void
+__curly_journal_put_contents(curly_journal_t *journal, const curly_node_t *node)
+{
+	const curly_attr_t *attr;
+	const curly_node_t *child;
+
+	/* Records refer to nodes by their path, so we need stand-ins
+	 * for the children of a copy on write */
+	curly_node_cow_children(node);
+
+	for (attr = curly_node_contents(node)->attrs; attr; attr = attr->next) {
+		if (attr->nvalues == 0)
+			curly_journal_add_attr(journal, node, attr->name, NULL);
+		else
+			curly_journal_set_attr_list(journal, node, attr->name, (const char * const *) attr->values);
+	}
+
+	for (child = node->children; child; child = child->next) {
+		curly_journal_add_child(journal, node, child->type, child->name);
+		__curly_journal_put_contents(journal, child);
+	}
+}
+
+/*
+ * The contents of node were replaced wholesale
+ */
+void
+curly_journal_copy(curly_journal_t *journal, const curly_node_t *node)
+{
+	__curly_journal_begin(journal, CURLY_JOURNAL_CLEAR, node);
+	__curly_journal_commit(journal);
+
+	__curly_journal_put_contents(journal, node);
+}
+
+/*
+ * The tree was freed while the journal was still attached
+ */
+void
+curly_journal_detach(curly_journal_t *journal)
+{
+	journal->root = NULL;
+}
+
+static bool
+__curly_journal_has_includes(const curly_node_t *root)
+{
+	curly_source_t *list;
+	unsigned int count;
+
+	list = curly_source_list(root, &count);
+	if (list)
+		free(list);
+	return count > 1;
+}
+
+/*
+ * Attach a journal to a tree. The tree is expected to reflect the
+ * contents of the base file plus any changes already recorded in the log,
+ * which is what curly_journal_replay() returns. If the log does not
+ * exist, or belongs to a different version of the base file, a new log
+ * is started.
+ *
+ * Compaction writes the whole tree to the base file, which would pull
+ * in the contents of all included files; so trees read from more than
+ * one file cannot have a journal.
+ */
+curly_journal_t *
+curly_journal_open(curly_node_t *root, const char *base_path, const char *log_path)
+{
+	unsigned char hdr[CURLY_JOURNAL_HDR_LEN], expect[CURLY_JOURNAL_HDR_LEN];
+	curly_journal_t *journal;
+	uint64_t hash;
+	ssize_t n;
+	int fd;
+
+	if (root->parent != NULL || root->journal != NULL || root->frozen != NULL) {
+		fprintf(stderr, "curly_journal_open: not a root node, journal already attached, or tree is frozen\n");
+		return NULL;
+	}
+
+	if (__curly_journal_has_includes(root)) {
+		fprintf(stderr, "curly_journal_open: %s includes other files\n", base_path);
+		return NULL;
+	}
+
+	if (!__curly_journal_hash_sources(root, base_path, &hash))
+		return NULL;
+
+	if ((fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "%s: %m\n", log_path);
+		return NULL;
+	}
+
+	journal = calloc(1, sizeof(*journal));
+	journal->root = root;
+	journal->base_path = strdup(base_path);
+	journal->log_path = strdup(log_path);
+	journal->fd = fd;
+
+	__curly_journal_header(expect, hash);
+	n = pread(fd, hdr, sizeof(hdr), 0);
+	if (n != sizeof(hdr) || memcmp(hdr, expect, sizeof(hdr))) {
+		if (!__curly_journal_reset(journal, hash)) {
+			curly_journal_close(journal);
+			return NULL;
+		}
+	}
+
+	root->journal = journal;
+	return journal;
+}
+
+void
+curly_journal_close(curly_journal_t *journal)
+{
+	if (journal->root)
+		journal->root->journal = NULL;
+	if (journal->fd >= 0)
+		close(journal->fd);
+	if (journal->buf)
+		free(journal->buf);
+	free(journal->base_path);
+	free(journal->log_path);
+	free(journal);
+}
+
+/*
+ * Fold the log into the base file: write the current tree to the base
+ * file, and start over with an empty log.
+ */
+int
+curly_journal_compact(curly_journal_t *journal)
+{
+	char tmp_path[PATH_MAX];
+	uint64_t hash;
+	FILE *fp;
+
+	if (journal->root == NULL)
+		return -1;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->base_path);
+	if ((fp = fopen(tmp_path, "w")) == NULL) {
+		fprintf(stderr, "Unable to open %s: %m\n", tmp_path);
+		return -1;
+	}
+
+	curly_node_write_fp(journal->root, fp);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		fprintf(stderr, "%s: write error: %m\n", tmp_path);
+		fclose(fp);
+		unlink(tmp_path);
+		return -1;
+	}
+	fclose(fp);
+
+	if (rename(tmp_path, journal->base_path) < 0) {
+		fprintf(stderr, "Unable to rename %s to %s: %m\n", tmp_path, journal->base_path);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if (!__curly_journal_hash_file(journal->base_path, &hash)
+	 || !__curly_journal_reset(journal, __curly_journal_hash_add(CURLY_HASH_INIT, hash)))
+		return -1;
+
+	journal->failed = false;
+	return 0;
+}
+
+/*
+ * Replaying a log
+ */
+struct curly_journal_reader {
+	const unsigned char *pos;
+	const unsigned char *end;
+	bool		error;
+};
+
+static uint64_t
+__curly_journal_get_number(struct curly_journal_reader *r)
+{
+	uint64_t value = 0;
+	unsigned int shift = 0;
+	unsigned char cc;
+
+	do {
+		if (r->pos >= r->end || shift > 63) {
+			r->error = true;
+			return 0;
+		}
+		cc = *r->pos++;
+		value |= (uint64_t) (cc & 0x7f) << shift;
+		shift += 7;
+	} while (cc & 0x80);
+
+	return value;
+}
+
+static curly_slice_t
+__curly_journal_get_string(struct curly_journal_reader *r)
+{
+	curly_slice_t s = { NULL, 0 };
+	uint64_t len;
+
+	len = __curly_journal_get_number(r);
+	if (r->error || len-- == 0)
+		return s;
+
+	if (len > (uint64_t) (r->end - r->pos)) {
+		r->error = true;
+		return s;
+	}
+
+	s.ptr = (const char *) r->pos;
+	s.len = len;
+	r->pos += len;
+	return s;
+}
+
+static inline bool
+__curly_slice_matches(const curly_slice_t *s, const char *string)
+{
+	if (s->ptr == NULL || string == NULL)
+		return s->ptr == NULL && string == NULL;
+	return curly_slice_equal(s, string);
+}
+
+static curly_node_t *
+__curly_journal_get_node(struct curly_journal_reader *r, curly_node_t *root)
+{
+	curly_node_t *node = root, *child;
+	uint64_t depth;
+
+	depth = __curly_journal_get_number(r);
+	while (!r->error && depth--) {
+		curly_slice_t type = __curly_journal_get_string(r);
+		curly_slice_t name = __curly_journal_get_string(r);
+
+		for (child = node->children; child; child = child->next) {
+			if (__curly_slice_matches(&type, child->type)
+			 && __curly_slice_matches(&name, child->name))
+				break;
+		}
+
+		if (child == NULL) {
+			r->error = true;
+			return NULL;
+		}
+		node = child;
+	}
+
+	return r->error? NULL : node;
+}
+
+static bool
+__curly_journal_apply(struct curly_journal_reader *r, curly_node_t *root)
+{
+	curly_slice_t name, value;
+	curly_node_t *node;
+	char *name_string;
+	char **values;
+	uint64_t op, i, count;
+
+	op = __curly_journal_get_number(r);
+	if (!(node = __curly_journal_get_node(r, root)))
+		return false;
+
+	switch (op) {
+	case CURLY_JOURNAL_SET_ATTR:
+	case CURLY_JOURNAL_ADD_ATTR:
+		name = __curly_journal_get_string(r);
+		value = __curly_journal_get_string(r);
+		if (r->error || name.ptr == NULL)
+			return false;
+
+		if (op == CURLY_JOURNAL_SET_ATTR)
+			curly_node_set_attr_slice(node, &name, &value);
+		else
+			curly_node_add_attr_list_slice(node, &name, &value);
+		break;
+
+	case CURLY_JOURNAL_SET_ATTR_LIST:
+		name = __curly_journal_get_string(r);
+		count = __curly_journal_get_number(r);
+		if (r->error || name.ptr == NULL || count > (uint64_t) (r->end - r->pos))
+			return false;
+
+		values = calloc(count + 1, sizeof(values[0]));
+		for (i = 0; i < count && !r->error; ++i) {
+			value = __curly_journal_get_string(r);
+			values[i] = value.ptr? strndup(value.ptr, value.len) : strdup("");
+		}
+
+		if (!r->error) {
+			name_string = strndup(name.ptr, name.len);
+			curly_node_set_attr_list(node, name_string, (const char * const *) values);
+			free(name_string);
+		}
+
+		for (i = 0; i < count; ++i)
+			free(values[i]);
+		free(values);
+		break;
+
+	case CURLY_JOURNAL_ADD_CHILD:
+		name = __curly_journal_get_string(r);
+		value = __curly_journal_get_string(r);
+		if (r->error || curly_node_add_child_slice(node, &name, &value) == NULL)
+			return false;
+		break;
+
+	case CURLY_JOURNAL_DROP_CHILD:
+		if (node->parent == NULL)
+			return false;
+		curly_node_drop_child(node->parent, node);
+		break;
+
+	case CURLY_JOURNAL_CLEAR:
+		curly_node_clear(node);
+		break;
+
+	default:
+		return false;
+	}
+
+	return !r->error;
+}
+
+static bool
+__curly_journal_read_log(const char *path, unsigned char **data_ret, size_t *size_ret)
+{
+	unsigned char *data = NULL;
+	size_t size = 0, alloc = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %m\n", path);
+		return false;
+	}
+
+	while (true) {
+		if (size == alloc) {
+			alloc = alloc? 2 * alloc : 65536;
+			data = realloc(data, alloc);
+		}
+
+		n = read(fd, data + size, alloc - size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: read error: %m\n", path);
+			free(data);
+			close(fd);
+			return false;
+		}
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	close(fd);
+	*data_ret = data;
+	*size_ret = size;
+	return true;
+}
+
+/*
+ * Rebuild a tree from the base file plus all changes recorded in the log.
+ * A missing log is the same as an empty one.
+ */
+curly_node_t *
+curly_journal_replay(const char *base_path, const char *log_path)
+{
+	unsigned char expect[CURLY_JOURNAL_HDR_LEN];
+	struct curly_journal_reader r;
+	unsigned char *data = NULL;
+	size_t size = 0;
+	curly_node_t *cfg;
+	uint64_t hash;
+
+	if (access(base_path, F_OK) == 0)
+		cfg = curly_node_read(base_path);
+	else
+		cfg = curly_node_new();
+	if (cfg == NULL)
+		return NULL;
+
+	if (access(log_path, F_OK) < 0)
+		return cfg;
+
+	if (!__curly_journal_hash_sources(cfg, base_path, &hash)
+	 || !__curly_journal_read_log(log_path, &data, &size))
+		goto failed;
+
+	__curly_journal_header(expect, hash);
+	if (size < sizeof(expect) || memcmp(data, expect, sizeof(expect))) {
+		if (size)
+			fprintf(stderr, "%s: journal does not belong to %s or the files it includes, ignored\n",
+					log_path, base_path);
+		free(data);
+		return cfg;
+	}
+
+	r.pos = data + sizeof(expect);
+	r.end = data + size;
+	r.error = false;
+
+	while (r.pos < r.end) {
+		struct curly_journal_reader record;
+		uint64_t len;
+
+		len = __curly_journal_get_number(&r);
+		if (r.error || len > (uint64_t) (r.end - r.pos)) {
+			fprintf(stderr, "%s: ignoring incomplete record at end of journal\n", log_path);
+			break;
+		}
+
+		/* A record we cannot apply only loses that change */
+		record.pos = r.pos;
+		record.end = r.pos + len;
+		record.error = false;
+		if (!__curly_journal_apply(&record, cfg))
+			fprintf(stderr, "%s: ignoring bad journal record at offset %lu\n", log_path,
+					(unsigned long) (r.pos - data));
+
+		r.pos += len;
+	}
+
+	free(data);
+	return cfg;
+
+failed:
+	if (data)
+		free(data);
+	curly_node_free(cfg);
+	return NULL;
+}
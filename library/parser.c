@@ -24,16 +24,36 @@
 #include <limits.h>
 #include <libgen.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "curlies.h"
 #include "internal.h"
 
 typedef struct curly_file curly_file_t;
 typedef struct curly_parser curly_parser_t;
+typedef struct curly_parser_ops curly_parser_ops_t;
 
-curly_file_t *	curly_file_open(const char *filename, const char *mode);
+curly_file_t *	curly_file_open(const char *filename);
+curly_file_t *	curly_file_from_buffer(const char *name, const char *data, size_t size);
 void		curly_file_close(curly_file_t *file);
-static bool	curly_parse_include(curly_parser_t *p, const char *filename, curly_node_t *cfg);
+static bool	curly_parse_include(curly_parser_t *p, const char *filename, void *ctx);
+static bool	curly_include_process(curly_parser_t *p, const char *name, void *ctx);
+static bool	__curly_include_process_one(curly_parser_t *p, const char *name, void *ctx);
+static const char * const *curly_include_expand(curly_include_cache_t *, const char * const *name, unsigned int *count);
+static void	curly_include_cache_prefetch(curly_include_cache_t *, const char * const *names, unsigned int count);
+static const char *curly_include_cache_resolve(curly_include_cache_t *, const char *name);
+static curly_include_cache_t *curly_include_cache_new(bool record);
+static void	curly_include_cache_forget(curly_include_cache_t *);
+static bool	curly_include_tracking(const curly_parser_t *, const curly_node_t *);
+static void	curly_include_track(curly_parser_t *, curly_node_t *, char *type, char *name, bool existed);
+static bool	__curly_parse_tracked(const char *filename, curly_include_cache_t *includes,
+			const curly_parser_ops_t *ops, void *ctx, unsigned int nthreads);
 
 static curly_shared_string_t *curly_shared_string_new(const char *path);
 static void	curly_shared_string_release(curly_shared_string_t *);
@@ -51,39 +71,108 @@ typedef enum {
 	Comma,
 } curly_token_t;
 
-#define CURLY_MODIFIER_UPDATE	0x0001
+#define CURLY_MODIFIER_UPDATE	CURLY_EVENT_F_UPDATE
 
 void		curly_parser_pushback(curly_parser_t *, curly_token_t);
 void		curly_parser_error(curly_parser_t *, const char *);
-curly_token_t	curly_parser_get_token(curly_parser_t *parser, char **token_string);
+curly_token_t	curly_parser_get_token(curly_parser_t *parser, curly_slice_t *token);
 const char *	curly_token_name(curly_token_t token);
+static void	__curly_parser_scratch_reset(curly_parser_t *);
 
+/*
+ * The entire file is held in memory while we parse it; either
+ * mmapped, or (for pipes and the like) read into a heap buffer.
+ */
 struct curly_file {
 	unsigned int	lineno;
 	char *		name;
-	FILE *		h;
+
+	const char *	data;
+	size_t		size;
+
+	void *		mapped;
+	char *		buffer;
+};
+
+/*
+ * The grammar is driven by curly_parser_do(), which reports what it
+ * finds through these callbacks. ctx is an opaque per-group context;
+ * begin_node returns the context for the new group, or NULL to abort.
+ * When building a tree, the context is the curly_node_t being filled in.
+ *
+ * The include callback is invoked with the path of an include file
+ * (relative to the current working directory, but not resolved yet),
+ * and is responsible for processing it (usually by calling
+ * curly_include_process).
+ */
+struct curly_parser_ops {
+	void *		(*begin_node)(curly_parser_t *, void *ctx,
+					const curly_slice_t *type, const curly_slice_t *name,
+					unsigned int modifiers);
+	bool		(*end_node)(curly_parser_t *, void *ctx);
+	bool		(*attribute)(curly_parser_t *, void *ctx,
+					const curly_slice_t *name,
+					const curly_slice_t *values, unsigned int count);
+	bool		(*include)(curly_parser_t *, void *ctx, const char *path);
+};
+
+/*
+ * Scratch memory for string constants that contain escapes or
+ * continuation lines, and thus cannot be returned as a slice of the
+ * input buffer. Strings allocated here remain valid until the parser
+ * starts on the next statement.
+ */
+struct curly_scratch_chunk {
+	struct curly_scratch_chunk *next;
+	size_t		size;
+	size_t		used;
+	char		data[];
 };
 
 struct curly_parser {
 	curly_file_t *	file;
+	const curly_parser_ops_t *ops;
 
 	curly_shared_string_t *file_origin;
 
+	/* Include files seen during this top-level parse */
+	curly_include_cache_t *includes;
+
+	/* Where the file we're parsing was included, if we're
+	 * building a tree that remembers that */
+	struct curly_include_point *point;
+
 	bool		error;
 	bool		trace;
 
+	const curly_scanner_t *scanner;
+
 	curly_token_t	save;
+	curly_slice_t	token;
+	const char *	token_start;
+
+	const char *	pos;
+	const char *	end;
 
-	char *		pos;
-	char		linebuf[1024];
-	char		toknbuf[1024];
+	struct curly_scratch_chunk *scratch;
+	struct curly_scratch_chunk *scratch_current;
+
+	/* The values of the attribute statement we're currently parsing */
+	curly_slice_t *	values;
+	unsigned int	values_size;
 };
 
 void
-curly_parser_init(curly_parser_t *parser, curly_file_t *file)
+curly_parser_init(curly_parser_t *parser, curly_file_t *file, const curly_parser_ops_t *ops, curly_include_cache_t *includes)
 {
 	memset(parser, 0, sizeof(*parser));
 	parser->file = file;
+	parser->ops = ops;
+	parser->includes = includes;
+	parser->scanner = curly_scanner_get();
+	parser->trace = !!getenv("CURLIES_TRACE");
+	parser->pos = file->data;
+	parser->end = file->data + file->size;
 
 	parser->file_origin = curly_shared_string_new(file->name);
 }
@@ -91,6 +180,8 @@ curly_parser_init(curly_parser_t *parser, curly_file_t *file)
 void
 curly_parser_destroy(curly_parser_t *parser)
 {
+	struct curly_scratch_chunk *chunk;
+
 	if (parser->file) {
 		curly_file_close(parser->file);
 		parser->file = NULL;
@@ -98,6 +189,14 @@ curly_parser_destroy(curly_parser_t *parser)
 
 	curly_shared_string_release(parser->file_origin);
 
+	while ((chunk = parser->scratch) != NULL) {
+		parser->scratch = chunk->next;
+		free(chunk);
+	}
+
+	if (parser->values)
+		free(parser->values);
+
 	memset(parser, 0, sizeof(*parser));
 }
 
@@ -113,23 +212,41 @@ save_string(char **var, const char *value)
 }
 
 static int
-curly_process_modifier(const char *value)
+curly_process_modifier(const curly_slice_t *value)
 {
-	if (!strcmp(value, "update"))
+	if (curly_slice_equal(value, "update"))
 		return CURLY_MODIFIER_UPDATE;
 	return -1;
 }
 
+static bool
+__curly_parser_add_value(curly_parser_t *p, unsigned int index, const curly_slice_t *value)
+{
+	if (index >= p->values_size) {
+		p->values_size = 2 * index + 8;
+		p->values = realloc(p->values, p->values_size * sizeof(p->values[0]));
+	}
+	p->values[index] = *value;
+	return true;
+}
+
 bool
-curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifiers)
+curly_parser_do(curly_parser_t *p, void *ctx, unsigned int group_modifiers)
 {
+	const curly_parser_ops_t *ops = p->ops;
 	curly_token_t tok;
-	char *value;
+	curly_slice_t value;
 
-	while ((tok = curly_parser_get_token(p, &value)) != EndOfFile) {
-		char *identifier = NULL, *name = NULL;
+	while (true) {
+		curly_slice_t identifier, name = { NULL, 0 };
 		unsigned int modifiers = group_modifiers;
-		curly_node_t *subgroup;
+		unsigned int count;
+		void *subgroup;
+
+		__curly_parser_scratch_reset(p);
+
+		if ((tok = curly_parser_get_token(p, &value)) == EndOfFile)
+			break;
 
 		switch (tok) {
 		case Error:
@@ -151,7 +268,7 @@ curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifie
 			do {
 				int m;
 
-				if ((m = curly_process_modifier(value)) < 0) {
+				if ((m = curly_process_modifier(&value)) < 0) {
 					curly_parser_error(p, "unknown modifier");
 					return false;
 				}
@@ -168,32 +285,35 @@ curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifie
 		}
 
 		/* include "blah.conf"; */
-		if (!strcmp(value, "include")) {
+		if (curly_slice_equal(&value, "include")) {
+			char *filename;
+
 			tok = curly_parser_get_token(p, &value);
 			if (tok != Identifier && tok != StringConstant)
 				goto unexpected_token_error;
 
-			save_string(&name, value);
+			name = value;
 			if (curly_parser_get_token(p, &value) != Semicolon)
 				goto unexpected_token_error;
 
-			if (!curly_parse_include(p, name, cfg)) {
+			filename = strndup(name.ptr, name.len);
+			if (!curly_parse_include(p, filename, ctx)) {
 				curly_parser_error(p, "unable to process include statement");
-				save_string(&name, NULL);
+				free(filename);
 				return false;
 			}
-			save_string(&name, NULL);
+			free(filename);
 			continue;
 		}
 
-		save_string(&identifier, value);
+		identifier = value;
 
 		tok = curly_parser_get_token(p, &value);
 		if (tok == LeftBrace) {
 			/* identifier { ... group ... } */
 		} else
 		if (tok == Identifier || tok == StringConstant) {
-			save_string(&name, value);
+			name = value;
 
 			tok = curly_parser_get_token(p, &value);
 		} else {
@@ -206,24 +326,16 @@ curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifie
 
 		case Semicolon:
 			/* identifier value ";" */
-			curly_node_set_attr(cfg, identifier, name);
+			if (!ops->attribute(p, ctx, &identifier, &name, 1))
+				return false;
 			break;
 
 		case LeftBrace:
 			/* identifier { ... }
 			 * identifier name { ... } */
-			subgroup = NULL;
-			if (modifiers & CURLY_MODIFIER_UPDATE)
-				subgroup = curly_node_get_child(cfg, identifier, name);
+			subgroup = ops->begin_node(p, ctx, &identifier, &name, modifiers);
 			if (subgroup == NULL)
-				subgroup = curly_node_add_child(cfg, identifier, name);
-			if (subgroup == NULL) {
-				curly_parser_error(p, "unable to create subgroup");
 				return false;
-			}
-
-			/* Save file and line number where we defined this node */
-			curly_origin_set(&subgroup->origin, p->file_origin, p->file->lineno);
 
 			if (!curly_parser_do(p, subgroup, modifiers))
 				return false;
@@ -233,16 +345,20 @@ curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifie
 				curly_parser_error(p, "missing closing brace");
 				return false;
 			}
+
+			if (!ops->end_node(p, subgroup))
+				return false;
 			break;
 
 		case Comma:
 			/* identifier value, value, ... */
-			curly_node_add_attr_list(cfg, identifier, name);
+			count = 0;
+			__curly_parser_add_value(p, count++, &name);
 
 			while (tok == Comma) {
 				tok = curly_parser_get_token(p, &value);
 				if (tok == Identifier || tok == StringConstant) {
-					curly_node_add_attr_list(cfg, identifier, value);
+					__curly_parser_add_value(p, count++, &value);
 					tok = curly_parser_get_token(p, &value);
 				} else {
 					/* We could be more liberal here and accept things like
@@ -260,18 +376,17 @@ curly_parser_do(curly_parser_t *p, curly_node_t *cfg, unsigned int group_modifie
 
 			if (tok == RightBrace) {
 				curly_parser_pushback(p, tok);
-				break;
-			}
+			} else
 			if (tok != Semicolon)
 				goto unexpected_token_error;
+
+			if (!ops->attribute(p, ctx, &identifier, p->values, count))
+				return false;
 			break;
 
 		default:
 			goto unexpected_token_error;
 		}
-
-		save_string(&identifier, NULL);
-		save_string(&name, NULL);
 	}
 
 	return true;
@@ -281,382 +396,2992 @@ unexpected_token_error:
 	return false;
 }
 
+/*
+ * Parse a top-level file. With record set, include files are cached
+ * for the duration of this call, so that a file included several times
+ * is read and lexed only once. Otherwise, every include file is parsed
+ * straight from disk, and nothing of it is kept once it's done.
+ */
 static bool
-__curly_parse(const char *filename, curly_node_t *cfg)
+__curly_parse_file(curly_file_t *file, const curly_parser_ops_t *ops, void *ctx, bool record)
 {
+	curly_include_cache_t *includes;
 	curly_parser_t parser;
-	curly_file_t *file;
 	bool rv = true;
 
-	if (!(file = curly_file_open(filename, "r")))
-		return false;
+	includes = curly_include_cache_new(record);
 
-	curly_parser_init(&parser, file);
-	//parser.trace = true;
-	rv = curly_parser_do(&parser, cfg, 0);
+	curly_parser_init(&parser, file, ops, includes);
+	rv = curly_parser_do(&parser, ctx, 0);
 	curly_parser_destroy(&parser);
 
+	curly_include_cache_free(includes);
 	return rv;
 }
 
-curly_node_t *
-curly_parse(const char *filename)
+static bool
+__curly_parse(const char *filename, const curly_parser_ops_t *ops, void *ctx, bool record)
 {
-	curly_node_t *cfg;
+	curly_file_t *file;
 
-	cfg = curly_node_new();
-	if (!__curly_parse(filename, cfg)) {
-		curly_node_free(cfg);
-		cfg = NULL;
-	}
+	if (!(file = curly_file_open(filename)))
+		return false;
 
-	return cfg;
+	return __curly_parse_file(file, ops, ctx, record);
 }
 
-static const char *
-__curly_resolve_include(curly_parser_t *p, const char *filename)
+/*
+ * Build a tree of curly_node_t's
+ */
+static void *
+__curly_build_begin_node(curly_parser_t *p, void *ctx, const curly_slice_t *type, const curly_slice_t *name, unsigned int modifiers)
 {
-	static char resolved[PATH_MAX];
-	char pathbuf[PATH_MAX];
-	char *pathcopy = NULL, *dir = NULL;
-
-	if (filename[0] == '/')
-		return filename;
-
-	save_string(&pathcopy, p->file->name);
-	dir = dirname(pathcopy);
-
-	if (dir == NULL)
-		dir = ".";
-	snprintf(pathbuf, sizeof(pathbuf), "%s/%s", dir, filename);
-
-	if (p->trace)
-		fprintf(stderr, "### include \"%s\" from \"%s\" -> \"%s\"\n", filename, p->file->name, pathbuf);
-	save_string(&pathcopy, NULL);
-
-	if (realpath(pathbuf, resolved) == NULL) {
-		fprintf(stderr, "Error: Cannot resolve include file \"%s\": %m\n", pathbuf);
+	curly_node_t *cfg = ctx, *subgroup = NULL;
+	bool existed;
+
+	if (modifiers & CURLY_MODIFIER_UPDATE)
+		subgroup = curly_node_get_child_slice(cfg, type, name);
+	if (!(existed = (subgroup != NULL)))
+		subgroup = curly_node_add_child_slice(cfg, type, name);
+	if (subgroup == NULL) {
+		curly_parser_error(p, "unable to create subgroup");
 		return NULL;
 	}
 
-	return resolved;
+	if (curly_include_tracking(p, cfg))
+		curly_include_track(p, cfg, subgroup->type, subgroup->name, existed);
+
+	/* Save file and line number where we defined this node */
+	curly_node_set_origin(subgroup, p->file_origin, p->file->lineno);
+	return subgroup;
 }
 
 static bool
-curly_parse_include(curly_parser_t *p, const char *filename, curly_node_t *cfg)
+__curly_build_end_node(curly_parser_t *p, void *ctx)
 {
-	const char *include_path;
-
-	include_path = __curly_resolve_include(p, filename);
-	if (include_path == NULL)
-		return false;
-
-	if (p->trace)
-		fprintf(stderr, "### including \"%s\"\n", include_path);
-
-	return __curly_parse(include_path, cfg);
+	return true;
 }
 
-void
-__curly_print(const curly_node_t *cfg, FILE *fp, int indent)
+static bool
+__curly_build_attribute(curly_parser_t *p, void *ctx, const curly_slice_t *name, const curly_slice_t *values, unsigned int count)
 {
-	const curly_attr_t *attr;
-	const curly_node_t *child;
-
-	for (attr = cfg->attrs; attr; attr = attr->next) {
-		unsigned int n = 0;
+	curly_node_t *cfg = ctx;
+	char *key = NULL;
+	bool existed = false;
 
-		fprintf(fp, "%*.*s%-12s ",
-				indent, indent, "",
-				attr->name);
-		for (n = 0; n < attr->nvalues; ++n)  {
-			if (n)
-				fprintf(fp, ",\n%*.*s", indent + 13, indent + 13, "");
-			fprintf(fp, " \"%s\"", attr->values[n]);
-		}
-		fprintf(fp, ";\n");
+	if (curly_include_tracking(p, cfg)) {
+		key = curly_atom_intern(name);
+		existed = curly_node_find_attr_atom(cfg, curly_atom_of(key)) != NULL;
 	}
 
-	for (child = cfg->children; child; child = child->next) {
-		if (child->name) {
-			fprintf(fp, "%*.*s%s \"%s\" {\n",
-					indent, indent, "",
-					child->type,
-					child->name);
-		} else {
-			fprintf(fp, "%*.*s%s {\n",
-					indent, indent, "",
-					child->type);
-		}
+	/* A single value replaces the attribute, a list is appended to it */
+	if (count == 1)
+		curly_node_set_attr_slice(cfg, name, &values[0]);
+	else
+		curly_node_add_attr_list_slices(cfg, name, values, count);
 
-		__curly_print(child, fp, indent + 4);
-		fprintf(fp, "%*.*s}\n",
-				indent, indent, "");
+	if (key) {
+		curly_include_track(p, cfg, NULL, key, existed);
+		curly_atom_unref(key);
 	}
+	return true;
 }
 
-void
-curly_print(const curly_node_t *cfg, FILE *fp)
+static bool
+__curly_build_include(curly_parser_t *p, void *ctx, const char *name)
 {
-	__curly_print(cfg, fp, 0);
+	return curly_include_process(p, name, ctx);
 }
 
-curly_file_t *
-curly_file_open(const char *filename, const char *mode)
+static const curly_parser_ops_t	curly_build_ops = {
+	.begin_node	= __curly_build_begin_node,
+	.end_node	= __curly_build_end_node,
+	.attribute	= __curly_build_attribute,
+	.include	= __curly_build_include,
+};
+
+/*
+ * The tree returned by curly_parse() remembers all files it was read
+ * from, and where they were included, so that it can be reloaded
+ * incrementally. It does not hold on to their contents.
+ */
+static curly_node_t *
+__curly_parse_tree(const char *filename, unsigned int nthreads, bool arena)
 {
-	curly_file_t *file;
-	FILE *fp;
+	curly_include_cache_t *includes;
+	curly_node_t *cfg;
 
-	if (!(fp = fopen(filename, mode)))
+	cfg = arena? curly_node_new_arena() : curly_node_new();
+	includes = curly_include_cache_new(true);
+	if (!__curly_parse_tracked(filename, includes, &curly_build_ops, cfg, nthreads)) {
+		curly_include_cache_free(includes);
+		curly_node_free(cfg);
 		return NULL;
+	}
 
-	file = calloc(1, sizeof(*file));
-	file->name = strdup(filename);
-	file->h = fp;
-	return file;
+	/* Changes made later on are allocated from the heap */
+	if (cfg->arena)
+		curly_arena_seal(cfg->arena);
+
+	curly_include_cache_forget(includes);
+	cfg->sources = includes;
+	return cfg;
 }
 
-void
-curly_file_close(curly_file_t *file)
+curly_node_t *
+curly_parse(const char *filename)
 {
-	if (file->name)
-		free(file->name);
-	if (file->h)
-		fclose(file->h);
-	free(file);
+	return __curly_parse_tree(filename, 1, false);
 }
 
-int
-curly_file_gets(char *buffer, size_t size, curly_file_t *file)
+/*
+ * Parse a config file that the caller already holds in memory.
+ * The buffer does not need to be NUL terminated, and is not
+ * modified. Relative includes are resolved relative to the
+ * directory of origin_name.
+ */
+curly_node_t *
+curly_parse_buffer(const char *buf, size_t len, const char *origin_name)
 {
-	unsigned int offset = 0, k;
-
-	buffer[0] = '\0';
-	while (offset == 0 || buffer[offset-1] == '\\') {
-		if (offset)
-			buffer[offset-1] = ' ';
-
-		if (!fgets(buffer + offset, size - offset, file->h))
-			break;
+	curly_node_t *cfg;
+	curly_file_t *file;
 
-		file->lineno++;
+	if (origin_name == NULL)
+		origin_name = "<buffer>";
 
-		/* If we parsed a continuation line, collapse the
-		 * leading white space */
-		if (offset && isspace(buffer[offset])) {
-			for (k = offset; isspace(buffer[offset]); ++offset)
-				;
-			do {
-				buffer[k++] = buffer[offset++];
-			} while (buffer[offset]);
-			buffer[k] = '\0';
-		}
+	file = curly_file_from_buffer(origin_name, buf, len);
 
-		offset = strlen(buffer);
-		if (offset && buffer[offset-1] == '\n')
-			buffer[--offset] = '\0';
+	cfg = curly_node_new();
+	if (!__curly_parse_file(file, &curly_build_ops, cfg, true)) {
+		curly_node_free(cfg);
+		cfg = NULL;
 	}
 
-	return offset != 0;
+	return cfg;
 }
 
 /*
- * Track the origin of where a file was defined
+ * Event based parsing.
+ * This translates the parser callbacks into calls to the caller's
+ * curly_event_handler_t. All strings passed to the handler live in
+ * buffers that are reused for the next event, and include files are
+ * parsed directly rather than through recordings, so memory consumption
+ * does not depend on the size of the input.
  */
-curly_shared_string_t *
-curly_shared_string_new(const char *value)
-{
-	curly_shared_string_t *shared;
+struct curly_event_state {
+	const curly_event_handler_t *handler;
+	void *		user_data;
 
-	shared = calloc(1, sizeof(*shared));
-	save_string(&shared->value, value);
-	shared->refcount = 1;
-	return shared;
-}
+	char *		strings;
+	size_t		strings_size;
 
-static curly_shared_string_t *
-curly_shared_string_hold(curly_shared_string_t *shared)
-{
-	if (shared != NULL) {
-		shared->refcount += 1;
+	const char **	values;
+	unsigned int	values_size;
+};
 
-		/* Ensure that the refcount was >0 to begin with, and did not overflow when incrementing it */
-		assert(shared->refcount > 1);
+static char *
+__curly_event_strings(struct curly_event_state *state, size_t len)
+{
+	if (len > state->strings_size) {
+		state->strings_size = 2 * len;
+		state->strings = realloc(state->strings, state->strings_size);
 	}
-
-	return shared;
+	return state->strings;
 }
 
-static void
-curly_shared_string_release(curly_shared_string_t *shared)
+static const char *
+__curly_event_copy(char **pos, const curly_slice_t *s)
 {
-	assert(shared->refcount);
-	if (shared->refcount > 1) {
-		shared->refcount -= 1;
-		return;
-	}
+	char *result = *pos;
 
-	save_string(&shared->value, NULL);
-	free(shared);
-}
+	if (s->ptr == NULL)
+		return NULL;
 
-void
-curly_origin_destroy(curly_origin_t *origin)
-{
-	if (origin->path) {
-		curly_shared_string_release(origin->path);
-		origin->path = NULL;
-	}
-	origin->line = 0;
+	memcpy(result, s->ptr, s->len);
+	result[s->len] = '\0';
+	*pos += s->len + 1;
+	return result;
 }
 
-void
-curly_origin_init(curly_origin_t *origin, const char *path)
+static void *
+__curly_event_begin_node(curly_parser_t *p, void *ctx, const curly_slice_t *type, const curly_slice_t *name, unsigned int modifiers)
 {
-	origin->path = curly_shared_string_new(path);
-	origin->line = 0;
-}
+	struct curly_event_state *state = ctx;
+	const char *type_string, *name_string;
+	char *pos;
 
-void
-curly_origin_set(curly_origin_t *dst, curly_shared_string_t *path, unsigned int line)
-{
-	curly_origin_destroy(dst);
-	dst->path = curly_shared_string_hold(path);
-	dst->line = line;
+	if (state->handler->begin_node == NULL)
+		return state;
+
+	pos = __curly_event_strings(state, type->len + name->len + 2);
+	type_string = __curly_event_copy(&pos, type);
+	name_string = __curly_event_copy(&pos, name);
+
+	if (!state->handler->begin_node(state->user_data, type_string, name_string,
+				p->file->name, p->file->lineno, modifiers))
+		return NULL;
+	return state;
 }
 
-int
-curly_parser_fillbuf(curly_parser_t *parser)
+static bool
+__curly_event_end_node(curly_parser_t *p, void *ctx)
 {
-	return curly_file_gets(parser->linebuf, sizeof(parser->linebuf), parser->file);
+	struct curly_event_state *state = ctx;
+
+	if (state->handler->end_node == NULL)
+		return true;
+	return state->handler->end_node(state->user_data);
 }
 
-static char *
-__curly_parser_current(curly_parser_t *parser)
+static bool
+__curly_event_attribute(curly_parser_t *p, void *ctx, const curly_slice_t *name, const curly_slice_t *values, unsigned int count)
 {
-	while (parser->pos == NULL) {
-		if (!curly_parser_fillbuf(parser))
-			return NULL;
-
-		if (parser->trace)
-			fprintf(stderr, "### ---- new buffer: \"%s\"\n", parser->linebuf);
-		parser->pos = parser->linebuf;
+	struct curly_event_state *state = ctx;
+	const char *name_string;
+	unsigned int i;
+	size_t len;
+	char *pos;
+
+	if (state->handler->attribute == NULL)
+		return true;
+
+	if (count + 1 > state->values_size) {
+		state->values_size = 2 * count + 8;
+		state->values = realloc(state->values, state->values_size * sizeof(state->values[0]));
 	}
-	return parser->pos;
+
+	len = name->len + 1;
+	for (i = 0; i < count; ++i)
+		len += values[i].len + 1;
+
+	pos = __curly_event_strings(state, len);
+	name_string = __curly_event_copy(&pos, name);
+	for (i = 0; i < count; ++i)
+		state->values[i] = __curly_event_copy(&pos, &values[i]);
+	state->values[count] = NULL;
+
+	return state->handler->attribute(state->user_data, name_string, state->values, count);
 }
 
-void
-curly_parser_skip_ws(curly_parser_t *parser)
+static bool
+__curly_event_include(curly_parser_t *p, void *ctx, const char *name)
 {
-	while (1) {
-		char *pos;
-
-		if ((pos = __curly_parser_current(parser)) == NULL)
-			return;
+	struct curly_event_state *state = ctx;
+	const char * const *names;
+	unsigned int i, count;
+	const char *path;
 
-		pos = parser->pos;
-		while (isspace(*pos))
-			++pos;
+	if (state->handler->include == NULL)
+		return curly_include_process(p, name, ctx);
 
-		if (*pos && *pos != '#') {
-			parser->pos = pos;
-			break;
-		}
+	/* Report every file matched by a wildcard include separately */
+	if (!(names = curly_include_expand(p->includes, &name, &count)))
+		return false;
 
-		/* Hit a comment, discard the rest of the line */
-		parser->pos = NULL;
+	for (i = 0; i < count; ++i) {
+		if (!(path = curly_include_cache_resolve(p->includes, names[i])))
+			return false;
+		if (!state->handler->include(state->user_data, path))
+			return false;
+		if (!__curly_include_process_one(p, names[i], ctx))
+			return false;
 	}
+	return true;
 }
 
-void
-curly_parser_pushback(curly_parser_t *parser, curly_token_t token)
+static const curly_parser_ops_t	curly_event_ops = {
+	.begin_node	= __curly_event_begin_node,
+	.end_node	= __curly_event_end_node,
+	.attribute	= __curly_event_attribute,
+	.include	= __curly_event_include,
+};
+
+static void
+__curly_event_state_destroy(struct curly_event_state *state)
 {
-	if (parser->trace)
-		fprintf(stderr, "### pushback token %s(%u)\n", curly_token_name(token), token);
-	if (parser->save) {
-		curly_parser_error(parser, "Trying to push back more than one token - no workee");
-	}
-	parser->save = token;
+	if (state->strings)
+		free(state->strings);
+	if (state->values)
+		free(state->values);
 }
 
-curly_token_t
-curly_parser_get_token(curly_parser_t *parser, char **token_string)
+bool
+curly_events_read(const char *path, const curly_event_handler_t *handler, void *user_data)
 {
-	curly_token_t token;
-	char *pos, *dst;
+	struct curly_event_state state = { .handler = handler, .user_data = user_data };
+	bool rv;
 
-	if (parser->error)
-		return Error;
+	rv = __curly_parse(path, &curly_event_ops, &state, false);
+	__curly_event_state_destroy(&state);
+	return rv;
+}
 
-	if (parser->save != EndOfFile) {
-		token = parser->save;
-		*token_string = parser->toknbuf;
-		parser->save = EndOfFile;
+bool
+curly_events_parse_buffer(const char *buf, size_t len, const char *origin_name,
+			const curly_event_handler_t *handler, void *user_data)
+{
+	struct curly_event_state state = { .handler = handler, .user_data = user_data };
+	curly_file_t *file;
+	bool rv;
 
-		return token;
+	if (origin_name == NULL)
+		origin_name = "<buffer>";
+
+	file = curly_file_from_buffer(origin_name, buf, len);
+	rv = __curly_parse_file(file, &curly_event_ops, &state, false);
+	__curly_event_state_destroy(&state);
+	return rv;
+}
+
+/*
+ * Include handling.
+ *
+ * Within one top-level parse, every include file is read and lexed only
+ * once. The parser events it produces are recorded, and the recording is
+ * replayed into every group that includes the file. A cached recording
+ * is reused only as long as the file's inode, size and mtime are
+ * unchanged. The top-level file itself is parsed directly, and never
+ * recorded.
+ *
+ * Recordings refer to nested include files by the name given in the
+ * include statement, so that the name is resolved again every time the
+ * recording is replayed.
+ *
+ * Event based parses don't record anything; there, include files are
+ * parsed from disk every time they are included.
+ */
+#define CURLY_RECORD_BEGIN_NODE	1
+#define CURLY_RECORD_END_NODE	2
+#define CURLY_RECORD_ATTRIBUTE	3
+#define CURLY_RECORD_INCLUDE	4
+
+#define CURLY_RECORD_NULL	((size_t) -1)
+
+struct curly_record_string {
+	size_t		offset;		/* CURLY_RECORD_NULL for a NULL string */
+	size_t		len;
+};
+
+struct curly_record_event {
+	unsigned int	kind;
+	unsigned int	modifiers;
+	unsigned int	line;
+
+	/* The strings of this event are strings[first .. first + count - 1] */
+	unsigned int	first;
+	unsigned int	count;
+};
+
+struct curly_recording {
+	struct curly_record_event *events;
+	unsigned int	nevents;
+	unsigned int	events_size;
+
+	struct curly_record_string *strings;
+	unsigned int	nstrings;
+	unsigned int	strings_size;
+
+	char *		data;
+	size_t		data_len;
+	size_t		data_size;
+};
+
+struct curly_include {
+	char *		path;
+	bool		changed;	/* since the tree was built, see curly_reload() */
+
+	dev_t		dev;
+	ino_t		ino;
+	off_t		size;
+	struct timespec	mtime;
+	uint64_t	hash;		/* of the contents we recorded */
+
+	bool		loaded;		/* we tried to record it */
+	bool		valid;		/* ... and succeeded */
+	bool		recorded;	/* ... and still hold the recording */
+	bool		replaying;
+	bool		reachable;	/* used when walking the include graph */
+
+	struct curly_recording recording;
+};
+
+/*
+ * Trees that can be reloaded remember every place a file was included,
+ * which makes up the include graph. Each point also knows which children
+ * and attributes of the node it was included into came from that file
+ * (or the files it included there in turn). Everything below those
+ * children came from the file as well, so they are all we need to
+ * rebuild the part of the tree the file contributed to.
+ */
+struct curly_include_point {
+	struct curly_include_point *parent;	/* NULL if included by the top-level file */
+	struct curly_include *inc;
+
+	/* The node the file was included into, as a path of children
+	 * from the root. node is only valid while building the tree. */
+	curly_node_t *	node;
+	unsigned int	depth;
+	curly_node_key_t *path;
+
+	curly_node_part_t part;
+
+	/* Some file outside of this one touched what this one added,
+	 * or the other way round */
+	bool		shared;
+};
+
+/*
+ * While building a tree, who added which children and attributes
+ * of the nodes that files were included into. An entry with a NULL
+ * type and name marks the node itself as one of those.
+ */
+struct curly_include_owner {
+	const curly_node_t *node;
+	char *		type;
+	char *		name;
+	struct curly_include_point *point;
+};
+
+struct curly_include_path {
+	char *		name;
+	char *		resolved;
+};
+
+/*
+ * An include statement can name several files using shell wildcards,
+ * as in include "conf.d/[0-9]*.conf". The matching files are included in
+ * sorted order; a pattern that matches nothing is not an error.
+ */
+struct curly_include_glob {
+	char *		pattern;
+	unsigned int	count;
+	char **		matches;
+	uint64_t	hash;		/* of the list of matches */
+};
+
+struct curly_include_cache {
+	/* Protects the cache when include files are loaded in parallel */
+	pthread_mutex_t	lock;
+
+	/* Whether include files are recorded, or parsed directly */
+	bool		record;
+
+	unsigned int	count;
+	struct curly_include **entries;
+
+	/* The top-level file, and whether the tree built from it is
+	 * out of date with respect to the file metadata we hold */
+	struct curly_include *toplevel;
+	bool		stale;
+
+	/* Restored from a binary cache, which only lists the files; we
+	 * don't know where they were included until we parse them */
+	bool		untracked;
+
+	/* Where files were included into the tree; only trees parsed
+	 * from a top-level file track these */
+	unsigned int	npoints;
+	struct curly_include_point **points;
+
+	/* Only while building the tree */
+	unsigned int	nowners;
+	unsigned int	owners_size;
+	struct curly_include_owner *owners;
+
+	/* Results of realpath() for the include statements we've seen */
+	unsigned int	npaths;
+	struct curly_include_path *paths;
+
+	/* Expansions of the wildcard includes we've seen */
+	unsigned int	nglobs;
+	struct curly_include_glob *globs;
+};
+
+static void
+curly_recording_destroy(struct curly_recording *rec)
+{
+	if (rec->events)
+		free(rec->events);
+	if (rec->strings)
+		free(rec->strings);
+	if (rec->data)
+		free(rec->data);
+	memset(rec, 0, sizeof(*rec));
+}
+
+static struct curly_record_event *
+__curly_record_event(curly_parser_t *p, struct curly_recording *rec, unsigned int kind)
+{
+	struct curly_record_event *ev;
+
+	if (rec->nevents >= rec->events_size) {
+		rec->events_size = 2 * rec->events_size + 64;
+		rec->events = realloc(rec->events, rec->events_size * sizeof(rec->events[0]));
+	}
+
+	ev = &rec->events[rec->nevents++];
+	ev->kind = kind;
+	ev->modifiers = 0;
+	ev->line = p->file->lineno;
+	ev->first = rec->nstrings;
+	ev->count = 0;
+	return ev;
+}
+
+static void
+__curly_record_string(struct curly_recording *rec, struct curly_record_event *ev, const curly_slice_t *s)
+{
+	struct curly_record_string *rs;
+
+	if (rec->nstrings >= rec->strings_size) {
+		rec->strings_size = 2 * rec->strings_size + 64;
+		rec->strings = realloc(rec->strings, rec->strings_size * sizeof(rec->strings[0]));
+	}
+
+	rs = &rec->strings[rec->nstrings++];
+	ev->count++;
+
+	rs->len = s->len;
+	if (s->ptr == NULL) {
+		rs->offset = CURLY_RECORD_NULL;
+		return;
+	}
+
+	if (rec->data_len + s->len > rec->data_size) {
+		rec->data_size = 2 * (rec->data_len + s->len) + 4096;
+		rec->data = realloc(rec->data, rec->data_size);
+	}
+
+	memcpy(rec->data + rec->data_len, s->ptr, s->len);
+	rs->offset = rec->data_len;
+	rec->data_len += s->len;
+}
+
+static void *
+__curly_record_begin_node(curly_parser_t *p, void *ctx, const curly_slice_t *type, const curly_slice_t *name, unsigned int modifiers)
+{
+	struct curly_recording *rec = ctx;
+	struct curly_record_event *ev;
+
+	ev = __curly_record_event(p, rec, CURLY_RECORD_BEGIN_NODE);
+	ev->modifiers = modifiers;
+	__curly_record_string(rec, ev, type);
+	__curly_record_string(rec, ev, name);
+	return rec;
+}
+
+static bool
+__curly_record_end_node(curly_parser_t *p, void *ctx)
+{
+	__curly_record_event(p, ctx, CURLY_RECORD_END_NODE);
+	return true;
+}
+
+static bool
+__curly_record_attribute(curly_parser_t *p, void *ctx, const curly_slice_t *name, const curly_slice_t *values, unsigned int count)
+{
+	struct curly_recording *rec = ctx;
+	struct curly_record_event *ev;
+	unsigned int i;
+
+	ev = __curly_record_event(p, rec, CURLY_RECORD_ATTRIBUTE);
+	__curly_record_string(rec, ev, name);
+	for (i = 0; i < count; ++i)
+		__curly_record_string(rec, ev, &values[i]);
+	return true;
+}
+
+static bool
+__curly_record_include(curly_parser_t *p, void *ctx, const char *name)
+{
+	struct curly_recording *rec = ctx;
+	struct curly_record_event *ev;
+	curly_slice_t name_slice = curly_slice_from_string(name);
+
+	/* Nested includes are not processed while recording; that happens
+	 * when the recording is replayed. */
+	ev = __curly_record_event(p, rec, CURLY_RECORD_INCLUDE);
+	__curly_record_string(rec, ev, &name_slice);
+	return true;
+}
+
+static const curly_parser_ops_t	curly_record_ops = {
+	.begin_node	= __curly_record_begin_node,
+	.end_node	= __curly_record_end_node,
+	.attribute	= __curly_record_attribute,
+	.include	= __curly_record_include,
+};
+
+static inline curly_slice_t
+__curly_recording_slice(const struct curly_recording *rec, unsigned int index)
+{
+	const struct curly_record_string *rs = &rec->strings[index];
+
+	if (rs->offset == CURLY_RECORD_NULL)
+		return (curly_slice_t) { NULL, 0 };
+	return (curly_slice_t) { rec->data + rs->offset, rs->len };
+}
+
+/*
+ * Replay a recording through the parser's ops. The parser does not have
+ * any input of its own, it just provides the file name and line number
+ * of each event to the callbacks.
+ */
+static bool
+curly_recording_replay(curly_parser_t *p, const struct curly_recording *rec, void *ctx)
+{
+	const curly_parser_ops_t *ops = p->ops;
+	void **stack = NULL;
+	unsigned int depth = 0, stack_size = 0;
+	unsigned int i, k;
+	bool rv = false;
+
+	for (i = 0; i < rec->nevents; ++i) {
+		const struct curly_record_event *ev = &rec->events[i];
+		void *subgroup;
+		char *name;
+
+		p->file->lineno = ev->line;
+
+		for (k = 0; k < ev->count; ++k) {
+			curly_slice_t s = __curly_recording_slice(rec, ev->first + k);
+
+			__curly_parser_add_value(p, k, &s);
+		}
+
+		switch (ev->kind) {
+		case CURLY_RECORD_BEGIN_NODE:
+			subgroup = ops->begin_node(p, ctx, &p->values[0], &p->values[1], ev->modifiers);
+			if (subgroup == NULL)
+				goto out;
+
+			if (depth >= stack_size) {
+				stack_size = 2 * stack_size + 8;
+				stack = realloc(stack, stack_size * sizeof(stack[0]));
+			}
+			stack[depth++] = ctx;
+			ctx = subgroup;
+			break;
+
+		case CURLY_RECORD_END_NODE:
+			assert(depth);
+			if (!ops->end_node(p, ctx))
+				goto out;
+			ctx = stack[--depth];
+			break;
+
+		case CURLY_RECORD_ATTRIBUTE:
+			if (!ops->attribute(p, ctx, &p->values[0], &p->values[1], ev->count - 1))
+				goto out;
+			break;
+
+		case CURLY_RECORD_INCLUDE:
+			name = strndup(p->values[0].ptr, p->values[0].len);
+			if (!ops->include(p, ctx, name)) {
+				curly_parser_error(p, "unable to process include statement");
+				free(name);
+				goto out;
+			}
+			free(name);
+			break;
+		}
+	}
+
+	rv = true;
+
+out:
+	if (stack)
+		free(stack);
+	return rv;
+}
+
+static curly_include_cache_t *
+curly_include_cache_new(bool record)
+{
+	curly_include_cache_t *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->record = record;
+	return cache;
+}
+
+static void
+__curly_include_free(struct curly_include *inc)
+{
+	curly_recording_destroy(&inc->recording);
+	free(inc->path);
+	free(inc);
+}
+
+static inline void
+__curly_node_key_set(curly_node_key_t *key, char *type, char *name)
+{
+	key->type = curly_atom_ref(type);
+	key->name = curly_atom_ref(name);
+}
+
+static inline void
+__curly_node_key_destroy(curly_node_key_t *key)
+{
+	curly_atom_unref(key->type);
+	curly_atom_unref(key->name);
+	key->type = key->name = NULL;
+}
+
+static void
+curly_include_point_free(struct curly_include_point *point)
+{
+	unsigned int i;
+
+	for (i = 0; i < point->depth; ++i)
+		__curly_node_key_destroy(&point->path[i]);
+	for (i = 0; i < point->part.count; ++i)
+		__curly_node_key_destroy(&point->part.keys[i]);
+	__curly_node_key_destroy(&point->part.after_child);
+	curly_atom_unref(point->part.after_attr);
+
+	if (point->path)
+		free(point->path);
+	if (point->part.keys)
+		free(point->part.keys);
+	free(point);
+}
+
+static void
+__curly_include_points_free(struct curly_include_point **points, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		curly_include_point_free(points[i]);
+	if (points)
+		free(points);
+}
+
+static void
+__curly_include_cache_clear_paths(curly_include_cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->npaths; ++i) {
+		free(cache->paths[i].name);
+		free(cache->paths[i].resolved);
+	}
+
+	if (cache->paths)
+		free(cache->paths);
+	cache->paths = NULL;
+	cache->npaths = 0;
+}
+
+static void
+__curly_include_cache_clear_globs(curly_include_cache_t *cache)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < cache->nglobs; ++i) {
+		struct curly_include_glob *g = &cache->globs[i];
+
+		for (j = 0; j < g->count; ++j)
+			free(g->matches[j]);
+		if (g->matches)
+			free(g->matches);
+		free(g->pattern);
+	}
+
+	if (cache->globs)
+		free(cache->globs);
+	cache->globs = NULL;
+	cache->nglobs = 0;
+}
+
+void
+curly_include_cache_free(curly_include_cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; ++i)
+		__curly_include_free(cache->entries[i]);
+	if (cache->entries)
+		free(cache->entries);
+
+	__curly_include_points_free(cache->points, cache->npoints);
+	__curly_include_cache_clear_paths(cache);
+	__curly_include_cache_clear_globs(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/*
+ * Once a tree has been built, all we need to keep is what tells us
+ * whether any of its files changed: their path, inode, size and mtime.
+ */
+static void
+curly_include_cache_forget(curly_include_cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; ++i) {
+		struct curly_include *inc = cache->entries[i];
+
+		curly_recording_destroy(&inc->recording);
+		inc->recorded = false;
+	}
+
+	__curly_include_cache_clear_paths(cache);
+}
+
+static const char *
+__curly_include_cache_find_path(const curly_include_cache_t *cache, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->npaths; ++i) {
+		if (!strcmp(cache->paths[i].name, name))
+			return cache->paths[i].resolved;
+	}
+	return NULL;
+}
+
+static const char *
+curly_include_cache_resolve(curly_include_cache_t *cache, const char *name)
+{
+	struct curly_include_path *entry;
+	const char *found;
+	char *resolved;
+
+	pthread_mutex_lock(&cache->lock);
+	found = __curly_include_cache_find_path(cache, name);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (found != NULL)
+		return found;
+
+	if ((resolved = realpath(name, NULL)) == NULL) {
+		fprintf(stderr, "Error: Cannot resolve include file \"%s\": %m\n", name);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if ((found = __curly_include_cache_find_path(cache, name)) != NULL) {
+		/* Someone else beat us to it */
+		free(resolved);
+	} else {
+		cache->paths = realloc(cache->paths, (cache->npaths + 1) * sizeof(cache->paths[0]));
+		entry = &cache->paths[cache->npaths++];
+		entry->name = strdup(name);
+		entry->resolved = resolved;
+		found = resolved;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+static inline bool
+curly_include_is_glob(const char *name)
+{
+	return strpbrk(name, "*?[") != NULL;
+}
+
+static int
+__curly_glob_compare(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/*
+ * Expand a wildcard pattern into a list of regular files, sorted
+ * by name (and not by locale).
+ */
+static bool
+__curly_glob_expand(const char *pattern, char ***matches_ret, unsigned int *count_ret)
+{
+	char **matches = NULL;
+	unsigned int i, count = 0;
+	glob_t g;
+	int rv;
+
+	rv = glob(pattern, GLOB_NOSORT | GLOB_MARK, NULL, &g);
+	if (rv == GLOB_NOMATCH) {
+		*matches_ret = NULL;
+		*count_ret = 0;
+		return true;
+	}
+	if (rv != 0) {
+		fprintf(stderr, "Error: Cannot expand include pattern \"%s\"\n", pattern);
+		return false;
+	}
+
+	matches = calloc(g.gl_pathc, sizeof(matches[0]));
+	for (i = 0; i < g.gl_pathc; ++i) {
+		const char *path = g.gl_pathv[i];
+		size_t len = strlen(path);
+
+		/* GLOB_MARK appends a slash to directories */
+		if (len && path[len - 1] != '/')
+			matches[count++] = strdup(path);
+	}
+	globfree(&g);
+
+	qsort(matches, count, sizeof(matches[0]), __curly_glob_compare);
+	*matches_ret = matches;
+	*count_ret = count;
+	return true;
+}
+
+static uint64_t
+__curly_glob_hash(char * const *matches, unsigned int count)
+{
+	uint64_t hash = CURLY_HASH_INIT;
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		hash = curly_hash_bytes(hash, matches[i], strlen(matches[i]) + 1);
+	return hash;
+}
+
+/*
+ * Used to check whether the expansion of a wildcard include changed
+ */
+bool
+curly_glob_hash(const char *pattern, uint64_t *hash_ret)
+{
+	char **matches;
+	unsigned int i, count;
+
+	if (!__curly_glob_expand(pattern, &matches, &count))
+		return false;
+
+	*hash_ret = __curly_glob_hash(matches, count);
+	for (i = 0; i < count; ++i)
+		free(matches[i]);
+	if (matches)
+		free(matches);
+	return true;
+}
+
+/*
+ * Return the list of files an include statement refers to; for a
+ * plain file name, that is the name itself. Must be called with the
+ * cache locked while include files are loaded in parallel.
+ */
+static const char * const *
+curly_include_expand(curly_include_cache_t *cache, const char * const *name, unsigned int *count_ret)
+{
+	struct curly_include_glob *g;
+	unsigned int i;
+
+	if (!curly_include_is_glob(*name)) {
+		*count_ret = 1;
+		return name;
+	}
+
+	for (i = 0; i < cache->nglobs; ++i) {
+		g = &cache->globs[i];
+		if (!strcmp(g->pattern, *name))
+			goto found;
+	}
+
+	cache->globs = realloc(cache->globs, (cache->nglobs + 1) * sizeof(cache->globs[0]));
+	g = &cache->globs[cache->nglobs];
+	if (!__curly_glob_expand(*name, &g->matches, &g->count))
+		return NULL;
+	g->pattern = strdup(*name);
+	g->hash = __curly_glob_hash(g->matches, g->count);
+	cache->nglobs++;
+
+found:
+	*count_ret = g->count;
+	if (g->matches == NULL)
+		return name;	/* any non-NULL pointer will do */
+	return (const char * const *) g->matches;
+}
+
+/*
+ * Check whether any of the wildcard includes expands to a different
+ * list of files than before. The expansions are kept until we parse
+ * the whole config again; files reloaded on their own reuse them.
+ */
+static unsigned int
+__curly_include_cache_globs_changed(curly_include_cache_t *cache)
+{
+	unsigned int i, changed = 0;
+	uint64_t hash;
+
+	for (i = 0; i < cache->nglobs; ++i) {
+		const struct curly_include_glob *g = &cache->globs[i];
+
+		if (!curly_glob_hash(g->pattern, &hash) || hash != g->hash)
+			changed++;
+	}
+
+	return changed;
+}
+
+static inline bool
+__curly_include_unchanged(const struct curly_include *inc, const struct stat *stb)
+{
+	return inc->dev == stb->st_dev
+	    && inc->ino == stb->st_ino
+	    && inc->size == stb->st_size
+	    && inc->mtime.tv_sec == stb->st_mtim.tv_sec
+	    && inc->mtime.tv_nsec == stb->st_mtim.tv_nsec;
+}
+
+static bool
+curly_include_record(curly_include_cache_t *cache, struct curly_include *inc)
+{
+	curly_parser_t parser;
+	curly_file_t *file;
+	bool rv;
+
+	if (!(file = curly_file_open(inc->path)))
+		return false;
+
+	inc->hash = curly_hash_bytes(CURLY_HASH_INIT, file->data, file->size);
+	curly_parser_init(&parser, file, &curly_record_ops, cache);
+	rv = curly_parser_do(&parser, &inc->recording, 0);
+	curly_parser_destroy(&parser);
+
+	return rv;
+}
+
+/*
+ * (Re-)record an include file. The caller must make sure that nobody
+ * else touches this entry while we do.
+ */
+static bool
+curly_include_load(curly_include_cache_t *cache, struct curly_include *inc, const struct stat *stb)
+{
+	struct stat stb_buf;
+
+	if (stb == NULL) {
+		if (stat(inc->path, &stb_buf) < 0)
+			return false;
+		stb = &stb_buf;
+	}
+
+	curly_recording_destroy(&inc->recording);
+	inc->dev = stb->st_dev;
+	inc->ino = stb->st_ino;
+	inc->size = stb->st_size;
+	inc->mtime = stb->st_mtim;
+
+	inc->recorded = false;
+	if (!curly_include_record(cache, inc)) {
+		curly_recording_destroy(&inc->recording);
+		return false;
+	}
+
+	inc->recorded = true;
+	return true;
+}
+
+static struct curly_include *
+__curly_include_cache_find(const curly_include_cache_t *cache, const char *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; ++i) {
+		if (!strcmp(cache->entries[i]->path, path))
+			return cache->entries[i];
+	}
+	return NULL;
+}
+
+static struct curly_include *
+__curly_include_cache_add(curly_include_cache_t *cache, const char *path)
+{
+	struct curly_include *inc;
+
+	inc = calloc(1, sizeof(*inc));
+	inc->path = strdup(path);
+
+	cache->entries = realloc(cache->entries, (cache->count + 1) * sizeof(cache->entries[0]));
+	cache->entries[cache->count++] = inc;
+	return inc;
+}
+
+/*
+ * Find the recording for an include file, reading and lexing the file
+ * if we haven't seen it yet, or if it changed since we did. If we don't
+ * record include files, just return its entry.
+ */
+static struct curly_include *
+curly_include_cache_get(curly_include_cache_t *cache, const char *path, bool trace)
+{
+	struct curly_include *inc;
+	struct stat stb;
+
+	if (cache->record && stat(path, &stb) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((inc = __curly_include_cache_find(cache, path)) == NULL)
+		inc = __curly_include_cache_add(cache, path);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!cache->record)
+		return inc;
+
+	if (inc->loaded && __curly_include_unchanged(inc, &stb)) {
+		if (!inc->valid)
+			return NULL;
+		if (inc->recorded) {
+			if (trace)
+				fprintf(stderr, "### include cache hit for \"%s\"\n", path);
+			return inc;
+		}
+	}
+
+	/* Don't pull the recording from under an active replay */
+	if (inc->replaying)
+		return inc;
+
+	inc->valid = curly_include_load(cache, inc, &stb);
+	inc->loaded = true;
+	return inc->valid? inc : NULL;
+}
+
+/*
+ * Tracking what each include file added to the tree.
+ *
+ * We only look at the nodes files were included into. Whenever a file
+ * adds a child or attribute to one of these, we note that it belongs to
+ * the file, and to the files that included it at the same node. When
+ * somebody touches a child or attribute that belongs to someone else,
+ * the include points involved are marked as shared; reloading any of
+ * these means reloading the file they were all included from.
+ */
+static inline unsigned int
+__curly_include_owner_hash(const curly_node_t *node, const char *type, const char *name)
+{
+	uint64_t hash = (uintptr_t) node;
+
+	hash = (hash ^ (type? curly_atom_hash(type) : 0)) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (name? curly_atom_hash(name) : 0)) * 0x9e3779b97f4a7c15ULL;
+	return hash >> 32;
+}
+
+static struct curly_include_owner *
+__curly_include_owner_find(const curly_include_cache_t *cache, const curly_node_t *node, const char *type, const char *name)
+{
+	unsigned int mask = cache->owners_size - 1, i;
+	struct curly_include_owner *owner;
+
+	if (cache->owners_size == 0)
+		return NULL;
+
+	for (i = __curly_include_owner_hash(node, type, name) & mask; cache->owners[i].node; i = (i + 1) & mask) {
+		owner = &cache->owners[i];
+		if (owner->node == node && owner->type == type && owner->name == name)
+			return owner;
+	}
+	return NULL;
+}
+
+static void
+__curly_include_owner_insert(curly_include_cache_t *cache, const struct curly_include_owner *entry)
+{
+	unsigned int mask = cache->owners_size - 1, i;
+
+	i = __curly_include_owner_hash(entry->node, entry->type, entry->name) & mask;
+	while (cache->owners[i].node)
+		i = (i + 1) & mask;
+	cache->owners[i] = *entry;
+	cache->nowners++;
+}
+
+static void
+__curly_include_owner_add(curly_include_cache_t *cache, const curly_node_t *node, char *type, char *name,
+			struct curly_include_point *point)
+{
+	struct curly_include_owner entry = { node, curly_atom_ref(type), curly_atom_ref(name), point };
+
+	if (2 * (cache->nowners + 1) > cache->owners_size) {
+		struct curly_include_owner *old = cache->owners;
+		unsigned int i, size = cache->owners_size;
+
+		cache->owners_size = size? 2 * size : 64;
+		cache->owners = calloc(cache->owners_size, sizeof(cache->owners[0]));
+		cache->nowners = 0;
+		for (i = 0; i < size; ++i) {
+			if (old[i].node)
+				__curly_include_owner_insert(cache, &old[i]);
+		}
+		if (old)
+			free(old);
+	}
+
+	__curly_include_owner_insert(cache, &entry);
+}
+
+/*
+ * Done building the tree; forget about its nodes
+ */
+static void
+curly_include_track_done(curly_include_cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->owners_size; ++i) {
+		curly_atom_unref(cache->owners[i].type);
+		curly_atom_unref(cache->owners[i].name);
+	}
+	if (cache->owners)
+		free(cache->owners);
+	cache->owners = NULL;
+	cache->owners_size = cache->nowners = 0;
+
+	for (i = 0; i < cache->npoints; ++i)
+		cache->points[i]->node = NULL;
+}
+
+static bool
+curly_include_tracking(const curly_parser_t *p, const curly_node_t *node)
+{
+	return p->includes->nowners && __curly_include_owner_find(p->includes, node, NULL, NULL);
+}
+
+static inline bool
+__curly_include_point_within(const struct curly_include_point *point, const struct curly_include_point *ancestor)
+{
+	for (; point; point = point->parent) {
+		if (point == ancestor)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Mark the points that included a file at node, starting with point,
+ * unless they also included other
+ */
+static void
+__curly_include_mark_shared(struct curly_include_point *point, const struct curly_include_point *other, const curly_node_t *node)
+{
+	for (; point && point->node == node; point = point->parent) {
+		if (!__curly_include_point_within(other, point))
+			point->shared = true;
+	}
+}
+
+static void
+__curly_include_point_add_key(struct curly_include_point *point, char *type, char *name)
+{
+	curly_node_part_t *part = &point->part;
+
+	if ((part->count % 16) == 0)
+		part->keys = realloc(part->keys, (part->count + 16) * sizeof(part->keys[0]));
+	__curly_node_key_set(&part->keys[part->count++], type, name);
+}
+
+/*
+ * The parser is about to add or change a child (or an attribute, if
+ * type is NULL) of a node that files were included into. existed tells
+ * whether it was there before.
+ */
+static void
+curly_include_track(curly_parser_t *p, curly_node_t *node, char *type, char *name, bool existed)
+{
+	curly_include_cache_t *cache = p->includes;
+	struct curly_include_owner *owner;
+	struct curly_include_point *point, *other = NULL;
+	unsigned int i;
+
+	/* Removing an attribute leaves no trace in the tree. It would
+	 * remove what other files included here add after a reload, and
+	 * if a file included here went after it, we no longer know where
+	 * that file's attributes go. */
+	if (type == NULL && curly_node_find_attr_atom(node, curly_atom_of(name)) == NULL) {
+		for (i = 0; i < cache->npoints; ++i) {
+			point = cache->points[i];
+			if (point->node == node
+			 && (point->part.after_attr == name || !__curly_include_point_within(p->point, point)))
+				point->shared = true;
+		}
+	}
+
+	if ((owner = __curly_include_owner_find(cache, node, type, name)) != NULL) {
+		other = owner->point;
+	} else if (!existed) {
+		/* It's new, and belongs to everyone who included the
+		 * file we're parsing at this node */
+		__curly_include_owner_add(cache, node, type, name, p->point);
+		for (point = p->point; point && point->node == node; point = point->parent)
+			__curly_include_point_add_key(point, type, name);
+		return;
+	}
+
+	/* It's been there since before anyone was included here, or
+	 * someone else added it. */
+	__curly_include_mark_shared(p->point, other, node);
+	__curly_include_mark_shared(other, p->point, node);
+}
+
+/*
+ * Only trees track include points, so ctx is always a node
+ */
+static struct curly_include_point *
+curly_include_point_new(curly_parser_t *p, struct curly_include *inc, curly_node_t *node)
+{
+	curly_include_cache_t *cache = p->includes;
+	struct curly_include_point *point;
+	curly_node_t *child;
+	curly_attr_t *attr;
+	unsigned int i;
+
+	point = calloc(1, sizeof(*point));
+	point->parent = p->point;
+	point->inc = inc;
+	point->node = node;
+
+	for (child = node; child->parent; child = child->parent)
+		point->depth++;
+	point->path = calloc(point->depth + 1, sizeof(point->path[0]));
+	for (child = node, i = point->depth; child->parent; child = child->parent)
+		__curly_node_key_set(&point->path[--i], child->type, child->name);
+
+	/* Whatever this file adds goes after what's there now */
+	if ((child = curly_node_last_child(node)) != NULL)
+		__curly_node_key_set(&point->part.after_child, child->type, child->name);
+	if ((attr = curly_node_last_attr(node)) != NULL)
+		point->part.after_attr = curly_atom_ref((char *) curly_attr_get_name(attr));
+
+	if (!__curly_include_owner_find(cache, node, NULL, NULL))
+		__curly_include_owner_add(cache, node, NULL, NULL, NULL);
+
+	if ((cache->npoints % 64) == 0)
+		cache->points = realloc(cache->points, (cache->npoints + 64) * sizeof(cache->points[0]));
+	cache->points[cache->npoints++] = point;
+	return point;
+}
+
+/*
+ * Report the contents of the file at path to the parser's ops.
+ */
+static bool
+__curly_include_replay(curly_parser_t *p, const char *path, void *ctx)
+{
+	curly_include_cache_t *cache = p->includes;
+	struct curly_include *inc;
+	curly_parser_t replay;
+	curly_file_t *file;
+	bool rv;
+
+	if (!(inc = curly_include_cache_get(cache, path, p->trace)))
+		return false;
+
+	if (inc->replaying) {
+		fprintf(stderr, "%s: recursive include\n", path);
+		return false;
+	}
+
+	if (!cache->record && !(file = curly_file_open(path)))
+		return false;
+
+	inc->replaying = true;
+	if (cache->record) {
+		curly_parser_init(&replay, curly_file_from_buffer(path, NULL, 0), p->ops, cache);
+		if (cache->toplevel)
+			replay.point = curly_include_point_new(p, inc, ctx);
+		rv = curly_recording_replay(&replay, &inc->recording, ctx);
+	} else {
+		curly_parser_init(&replay, file, p->ops, cache);
+		rv = curly_parser_do(&replay, ctx, 0);
+	}
+	curly_parser_destroy(&replay);
+	inc->replaying = false;
+
+	return rv;
+}
+
+static bool
+__curly_include_process_one(curly_parser_t *p, const char *name, void *ctx)
+{
+	const char *path;
+
+	if (!(path = curly_include_cache_resolve(p->includes, name)))
+		return false;
+
+	if (p->trace)
+		fprintf(stderr, "### including \"%s\"\n", path);
+
+	return __curly_include_replay(p, path, ctx);
+}
+
+/*
+ * Process an include statement. name is the file name given in the
+ * include statement, joined with the directory of the including file.
+ */
+static bool
+curly_include_process(curly_parser_t *p, const char *name, void *ctx)
+{
+	const char * const *names;
+	unsigned int i, count;
+
+	if (!(names = curly_include_expand(p->includes, &name, &count)))
+		return false;
+
+	if (count > 1 && p->includes->record)
+		curly_include_cache_prefetch(p->includes, names, count);
+
+	for (i = 0; i < count; ++i) {
+		if (!__curly_include_process_one(p, names[i], ctx))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Parallel loading of include files.
+ *
+ * Starting from the include statements of the top-level file, all include
+ * files are recorded by a pool of worker threads. Whenever a worker
+ * finishes a file, the files it includes are queued in turn. Once
+ * everything has been loaded, the top-level file is parsed sequentially,
+ * and all includes are served from the cache. This produces exactly the
+ * same tree as a sequential parse, including %update semantics and
+ * origins.
+ */
+#define CURLY_INCLUDE_MAX_THREADS	16
+
+struct curly_include_loader {
+	curly_include_cache_t *cache;
+
+	pthread_cond_t	cond;
+	unsigned int	active;
+
+	/* Names of include files that need to be looked at */
+	char **		queue;
+	unsigned int	queued;
+	unsigned int	queue_size;
+};
+
+/* Queue an include file, unless we've seen it already.
+ * Must be called with the cache locked. */
+static void
+__curly_include_loader_queue(struct curly_include_loader *loader, const char *name)
+{
+	curly_include_cache_t *cache = loader->cache;
+	const char *path;
+
+	path = __curly_include_cache_find_path(cache, name);
+	if (path && __curly_include_cache_find(cache, path))
+		return;
+
+	if (loader->queued >= loader->queue_size) {
+		loader->queue_size = 2 * loader->queue_size + 16;
+		loader->queue = realloc(loader->queue, loader->queue_size * sizeof(loader->queue[0]));
+	}
+	loader->queue[loader->queued++] = strdup(name);
+	pthread_cond_signal(&loader->cond);
+}
+
+/* Queue all includes of a recording.
+ * Must be called with the cache locked. */
+static void
+__curly_include_loader_submit(struct curly_include_loader *loader, const struct curly_recording *rec)
+{
+	unsigned int i, j, count;
+
+	for (i = 0; i < rec->nevents; ++i) {
+		const struct curly_record_event *ev = &rec->events[i];
+		const char * const *names;
+		curly_slice_t s;
+		char *name;
+
+		if (ev->kind != CURLY_RECORD_INCLUDE)
+			continue;
+
+		s = __curly_recording_slice(rec, ev->first);
+		name = strndup(s.ptr, s.len);
+
+		if ((names = curly_include_expand(loader->cache, (const char * const *) &name, &count)) != NULL) {
+			for (j = 0; j < count; ++j)
+				__curly_include_loader_queue(loader, names[j]);
+		}
+		free(name);
+	}
+}
+
+static void *
+__curly_include_loader_worker(void *arg)
+{
+	struct curly_include_loader *loader = arg;
+	curly_include_cache_t *cache = loader->cache;
+	struct curly_include *inc;
+	const char *path;
+	char *name;
+	bool ok = false;
+
+	pthread_mutex_lock(&cache->lock);
+	while (true) {
+		if (loader->queued == 0) {
+			if (loader->active == 0)
+				break;
+			pthread_cond_wait(&loader->cond, &cache->lock);
+			continue;
+		}
+
+		name = loader->queue[--(loader->queued)];
+		loader->active++;
+		pthread_mutex_unlock(&cache->lock);
+
+		inc = NULL;
+		if ((path = curly_include_cache_resolve(cache, name)) != NULL) {
+			pthread_mutex_lock(&cache->lock);
+			if (__curly_include_cache_find(cache, path) == NULL)
+				inc = __curly_include_cache_add(cache, path);
+			pthread_mutex_unlock(&cache->lock);
+		}
+		free(name);
+
+		if (inc != NULL)
+			ok = curly_include_load(cache, inc, NULL);
+
+		pthread_mutex_lock(&cache->lock);
+		if (inc != NULL) {
+			inc->valid = ok;
+			inc->loaded = true;
+			if (ok)
+				__curly_include_loader_submit(loader, &inc->recording);
+		}
+		loader->active--;
+	}
+
+	/* We're done; make sure everyone else notices, too */
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+static unsigned int
+curly_include_loader_threads(void)
+{
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		return 1;
+	if (ncpus > CURLY_INCLUDE_MAX_THREADS)
+		return CURLY_INCLUDE_MAX_THREADS;
+	return ncpus;
+}
+
+static void
+__curly_include_loader_run(struct curly_include_loader *loader, unsigned int nthreads)
+{
+	pthread_t *threads;
+	unsigned int i, started = 0;
+
+	if (loader->queued) {
+		/* The calling thread is one of the workers */
+		threads = calloc(nthreads, sizeof(threads[0]));
+		for (i = 1; i < nthreads; ++i) {
+			if (pthread_create(&threads[started], NULL, __curly_include_loader_worker, loader) != 0)
+				break;
+			started++;
+		}
+
+		__curly_include_loader_worker(loader);
+
+		for (i = 0; i < started; ++i)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+
+	pthread_cond_destroy(&loader->cond);
+	if (loader->queue)
+		free(loader->queue);
+}
+
+/*
+ * To find the include statements of the top-level file, we lex it once
+ * without keeping anything but the names of the files it includes.
+ */
+static void *
+__curly_scan_begin_node(curly_parser_t *p, void *ctx, const curly_slice_t *type, const curly_slice_t *name, unsigned int modifiers)
+{
+	return ctx;
+}
+
+static bool
+__curly_scan_end_node(curly_parser_t *p, void *ctx)
+{
+	return true;
+}
+
+static bool
+__curly_scan_attribute(curly_parser_t *p, void *ctx, const curly_slice_t *name, const curly_slice_t *values, unsigned int count)
+{
+	return true;
+}
+
+static bool
+__curly_scan_include(curly_parser_t *p, void *ctx, const char *name)
+{
+	struct curly_include_loader *loader = ctx;
+	const char * const *names;
+	unsigned int i, count;
+
+	pthread_mutex_lock(&loader->cache->lock);
+	if ((names = curly_include_expand(loader->cache, &name, &count)) != NULL) {
+		for (i = 0; i < count; ++i)
+			__curly_include_loader_queue(loader, names[i]);
+	}
+	pthread_mutex_unlock(&loader->cache->lock);
+	return true;
+}
+
+static const curly_parser_ops_t	curly_scan_ops = {
+	.begin_node	= __curly_scan_begin_node,
+	.end_node	= __curly_scan_end_node,
+	.attribute	= __curly_scan_attribute,
+	.include	= __curly_scan_include,
+};
+
+/*
+ * Load everything the top-level file includes. Returns false if the
+ * file has a syntax error, which has been reported already.
+ */
+static bool
+curly_include_cache_preload(curly_include_cache_t *cache, const curly_file_t *file, unsigned int nthreads)
+{
+	struct curly_include_loader loader = { .cache = cache };
+	curly_parser_t scan;
+	bool rv;
+
+	pthread_cond_init(&loader.cond, NULL);
+
+	curly_parser_init(&scan, curly_file_from_buffer(file->name, file->data, file->size), &curly_scan_ops, cache);
+	scan.trace = false;
+	rv = curly_parser_do(&scan, &loader, 0);
+	curly_parser_destroy(&scan);
+
+	__curly_include_loader_run(&loader, nthreads);
+	return rv;
+}
+
+/*
+ * When a wildcard include matches several files we haven't seen yet,
+ * read them (and whatever they include) as one batch, so that the I/O
+ * for all of them overlaps.
+ */
+static void
+curly_include_cache_prefetch(curly_include_cache_t *cache, const char * const *names, unsigned int count)
+{
+	struct curly_include_loader loader = { .cache = cache };
+	unsigned int i, nthreads;
+
+	nthreads = curly_include_loader_threads();
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads <= 1)
+		return;
+
+	(void) curly_scanner_get();
+	pthread_cond_init(&loader.cond, NULL);
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < count; ++i)
+		__curly_include_loader_queue(&loader, names[i]);
+	pthread_mutex_unlock(&cache->lock);
+
+	/* A single file is not worth starting threads for */
+	if (loader.queued == 1)
+		free(loader.queue[--(loader.queued)]);
+	__curly_include_loader_run(&loader, nthreads);
+}
+
+/*
+ * Parse a top-level file, keeping track of all files involved in the
+ * include cache. With nthreads > 1, include files are loaded in parallel
+ * before the tree is built.
+ */
+static bool
+__curly_parse_tracked(const char *filename, curly_include_cache_t *includes,
+			const curly_parser_ops_t *ops, void *ctx, unsigned int nthreads)
+{
+	struct curly_include *top;
+	curly_parser_t parser;
+	curly_file_t *file;
+	struct stat stb;
+	bool rv;
+
+	/* The top-level file is not resolved, so that origins and error
+	 * messages refer to it by the name the caller gave us */
+	if ((top = includes->toplevel) == NULL) {
+		top = __curly_include_cache_add(includes, filename);
+		includes->toplevel = top;
+	}
+
+	if (stat(filename, &stb) < 0 || !(file = curly_file_open(filename)))
+		return false;
+
+	top->dev = stb.st_dev;
+	top->ino = stb.st_ino;
+	top->size = stb.st_size;
+	top->mtime = stb.st_mtim;
+	top->hash = curly_hash_bytes(CURLY_HASH_INIT, file->data, file->size);
+	top->loaded = top->valid = true;
+
+	if (nthreads > 1) {
+		/* Make sure the scanner is selected before we start any threads */
+		(void) curly_scanner_get();
+
+		if (!curly_include_cache_preload(includes, file, nthreads)) {
+			curly_file_close(file);
+			return false;
+		}
+	}
+
+	curly_parser_init(&parser, file, ops, includes);
+	top->replaying = true;
+	rv = curly_parser_do(&parser, ctx, 0);
+	top->replaying = false;
+	curly_parser_destroy(&parser);
+
+	curly_include_track_done(includes);
+	return rv;
+}
+
+/*
+ * Same as curly_parse, but read and parse all include files in parallel,
+ * using up to nthreads threads (0 picks a default based on the number
+ * of CPUs).
+ */
+curly_node_t *
+curly_parse_parallel(const char *filename, unsigned int nthreads)
+{
+	if (nthreads == 0)
+		nthreads = curly_include_loader_threads();
+	return __curly_parse_tree(filename, nthreads, false);
+}
+
+/*
+ * Same as curly_parse, but allocate the nodes and attributes of the
+ * tree from an arena. This makes reading and freeing large trees a lot
+ * cheaper. nthreads is as for curly_parse_parallel, except that 1
+ * means to not use any threads.
+ */
+curly_node_t *
+curly_parse_arena(const char *filename, unsigned int nthreads)
+{
+	if (nthreads == 0)
+		nthreads = curly_include_loader_threads();
+	return __curly_parse_tree(filename, nthreads, true);
+}
+
+/*
+ * Incremental reload.
+ *
+ * The include cache attached to a tree doubles as its dependency graph:
+ * it lists every place a file was included, along with each file's
+ * inode, size and mtime. On reload, we check whether any of the files
+ * included by the tree changed. If so, we parse each changed file again,
+ * starting from the place it was included, and swap what it contributes
+ * to the tree for the new version, so that nodes which did not change
+ * stay where they are.
+ *
+ * That is only possible if nobody else touched what the file added, and
+ * the new version does not step on anything outside of it either. If
+ * that's not the case, or the top-level file or a wildcard include
+ * changed, the whole config is parsed again, and merged into the tree.
+ */
+static void
+curly_include_cache_mark(curly_include_cache_t *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->count; ++i)
+		cache->entries[i]->reachable = cache->untracked;
+	for (i = 0; i < cache->npoints; ++i)
+		cache->points[i]->inc->reachable = true;
+	if (cache->toplevel)
+		cache->toplevel->reachable = true;
+}
+
+/* Forget about files that are no longer included */
+static void
+curly_include_cache_prune(curly_include_cache_t *cache)
+{
+	unsigned int i, j;
+
+	curly_include_cache_mark(cache);
+	for (i = j = 0; i < cache->count; ++i) {
+		struct curly_include *inc = cache->entries[i];
+
+		if (inc->reachable)
+			cache->entries[j++] = inc;
+		else
+			__curly_include_free(inc);
+	}
+	cache->count = j;
+}
+
+static bool
+__curly_include_point_same_path(const struct curly_include_point *a, const struct curly_include_point *b)
+{
+	unsigned int i;
+
+	if (a->depth != b->depth)
+		return false;
+	for (i = 0; i < a->depth; ++i) {
+		if (a->path[i].type != b->path[i].type || a->path[i].name != b->path[i].name)
+			return false;
+	}
+	return true;
+}
+
+static curly_node_t *
+__curly_include_point_lookup(curly_node_t *root, const struct curly_include_point *point)
+{
+	unsigned int i;
+
+	for (i = 0; root && i < point->depth; ++i)
+		root = curly_node_get_child_key(root, &point->path[i]);
+	return root;
+}
+
+static int
+__curly_node_key_compare(const void *a, const void *b)
+{
+	const curly_node_key_t *x = a, *y = b;
+	uintptr_t p, q;
+
+	if (x->type != y->type) {
+		p = (uintptr_t) x->type;
+		q = (uintptr_t) y->type;
+	} else {
+		p = (uintptr_t) x->name;
+		q = (uintptr_t) y->name;
+	}
+	return (p > q) - (p < q);
+}
+
+/* Sorted copy of the keys of a part, for looking them up */
+static curly_node_key_t *
+__curly_node_part_sorted(const curly_node_part_t *part)
+{
+	curly_node_key_t *keys;
+
+	keys = calloc(part->count + 1, sizeof(keys[0]));
+	if (part->count) {
+		memcpy(keys, part->keys, part->count * sizeof(keys[0]));
+		qsort(keys, part->count, sizeof(keys[0]), __curly_node_key_compare);
+	}
+	return keys;
+}
+
+static bool
+__curly_node_part_has(const curly_node_key_t *sorted, unsigned int count, char *type, char *name)
+{
+	curly_node_key_t key = { type, name };
+
+	return count && bsearch(&key, sorted, count, sizeof(key), __curly_node_key_compare);
+}
+
+/*
+ * Everything a file included at a given place contributes to the tree,
+ * built from scratch
+ */
+struct curly_include_rebuild {
+	struct curly_include_point *point;
+	struct curly_include_point *new_point;
+	unsigned int	first, last;	/* its new include points */
+	curly_node_t *	tree;
+};
+
+static bool
+__curly_include_rebuild(curly_include_cache_t *cache, struct curly_include_rebuild *rb)
+{
+	struct curly_include_point *point = rb->point, *up;
+	const char *origin;
+	curly_parser_t parser;
+	bool rv;
+
+	origin = point->parent? point->parent->inc->path : cache->toplevel->path;
+
+	/* Catch files that include themselves now */
+	cache->toplevel->replaying = true;
+	for (up = point->parent; up; up = up->parent)
+		up->inc->replaying = true;
+
+	rb->tree = curly_node_new_arena();
+	rb->first = cache->npoints;
+
+	curly_parser_init(&parser, curly_file_from_buffer(origin, NULL, 0), &curly_build_ops, cache);
+	parser.point = point->parent;
+	if (parser.trace)
+		fprintf(stderr, "### reloading \"%s\"\n", point->inc->path);
+	rv = __curly_include_replay(&parser, point->inc->path, rb->tree);
+	curly_parser_destroy(&parser);
+
+	rb->last = cache->npoints;
+	if (rb->last > rb->first)
+		rb->new_point = cache->points[rb->first];
+
+	cache->toplevel->replaying = false;
+	for (up = point->parent; up; up = up->parent)
+		up->inc->replaying = false;
+
+	curly_include_track_done(cache);
+	return rv && rb->new_point;
+}
+
+/*
+ * The new include points were made relative to the tree they were built
+ * in; move them to where the old one was.
+ */
+static void
+__curly_include_rebuild_relocate(curly_include_cache_t *cache, const struct curly_include_rebuild *rb)
+{
+	const struct curly_include_point *old = rb->point;
+	unsigned int i, j;
+
+	for (i = rb->first; i < rb->last; ++i) {
+		struct curly_include_point *point = cache->points[i];
+		curly_node_key_t *path;
+
+		path = calloc(old->depth + point->depth + 1, sizeof(path[0]));
+		for (j = 0; j < old->depth; ++j)
+			__curly_node_key_set(&path[j], old->path[j].type, old->path[j].name);
+		memcpy(path + old->depth, point->path, point->depth * sizeof(path[0]));
+		free(point->path);
+		point->path = path;
+
+		/* Files included at the top of the new tree had nothing
+		 * in front of them that the old tree doesn't have, too */
+		if (point->depth == 0) {
+			if (point->part.after_child.type == NULL)
+				__curly_node_key_set(&point->part.after_child,
+						old->part.after_child.type, old->part.after_child.name);
+			if (point->part.after_attr == NULL)
+				point->part.after_attr = curly_atom_ref(old->part.after_attr);
+		}
+		point->depth += old->depth;
+	}
+}
+
+/*
+ * Check whether what the file contributes now can take the place of
+ * what it contributed before. Besides fitting into the tree, it must
+ * not add anything that other files included at the same place added
+ * or removed: we couldn't tell who comes first.
+ */
+static bool
+__curly_include_rebuild_fits(curly_include_cache_t *cache, const struct curly_include_rebuild *rb, curly_node_t *node,
+			unsigned int npoints)
+{
+	const struct curly_include_point *old = rb->point;
+	curly_node_key_t *sorted, *added;
+	unsigned int i, j;
+	bool fits;
+
+	if (!curly_node_part_fits(node, &old->part, &rb->new_point->part))
+		return false;
+
+	sorted = __curly_node_part_sorted(&old->part);
+	added = __curly_node_part_sorted(&rb->new_point->part);
+
+	for (i = 0, fits = true; fits && i < npoints; ++i) {
+		const struct curly_include_point *point = cache->points[i];
+		const curly_node_part_t *part = &point->part;
+		bool ancestor;
+
+		if (__curly_include_point_within(point, old) || !__curly_include_point_same_path(point, old))
+			continue;
+
+		/* The files that included this one own what it added, too */
+		ancestor = __curly_include_point_within(old, point);
+		for (j = 0; fits && j < part->count; ++j) {
+			const curly_node_key_t *key = &part->keys[j];
+
+			if (__curly_node_part_has(added, rb->new_point->part.count, key->type, key->name)
+			 && !(ancestor && __curly_node_part_has(sorted, old->part.count, key->type, key->name)))
+				fits = false;
+		}
+	}
+
+	free(added);
+	free(sorted);
+	return fits;
+}
+
+/*
+ * Same as __curly_include_mark_shared, for include points that are
+ * not part of a tree being built
+ */
+static void
+__curly_include_mark_shared_at(struct curly_include_point *point, const struct curly_include_point *other,
+			const struct curly_include_point *where)
+{
+	for (; point && __curly_include_point_same_path(point, where); point = point->parent) {
+		if (!__curly_include_point_within(other, point))
+			point->shared = true;
+	}
+}
+
+/*
+ * Fix up the include points that are left after swapping what the old
+ * point contributed for the new one
+ */
+static void
+__curly_include_rebuild_fixup(curly_include_cache_t *cache, const struct curly_include_rebuild *rb, curly_node_t *node)
+{
+	const struct curly_include_point *old = rb->point, *new = rb->new_point;
+	curly_node_key_t *sorted, *keys;
+	curly_node_t *last_child;
+	curly_attr_t *last_attr;
+	bool removes = false, after = false;
+	unsigned int i, j, k;
+
+	sorted = __curly_node_part_sorted(&old->part);
+	for (j = 0; j < new->part.count; ++j) {
+		const curly_node_key_t *key = &new->part.keys[j];
+
+		if (key->type == NULL && !curly_node_find_attr_atom(node, curly_atom_of(key->name)))
+			removes = true;
+	}
+
+	last_child = curly_node_last_child(curly_node_contents(rb->tree));
+	last_attr = curly_node_last_attr(curly_node_contents(rb->tree));
+
+	/* The new points of this tree and of the ones we haven't applied
+	 * yet come last, and are left alone */
+	for (i = 0; i < rb->first; ++i) {
+		struct curly_include_point *point = cache->points[i];
+		curly_node_part_t *part = &point->part;
+
+		if (point == old)
+			after = true;
+		if (__curly_include_point_within(point, old)
+		 || !__curly_include_point_same_path(point, old))
+			continue;
+
+		if (__curly_include_point_within(old, point)) {
+			/* The files that included the old one at the same
+			 * place now own what the new one added instead */
+			keys = calloc(part->count + new->part.count + 1, sizeof(keys[0]));
+			for (j = k = 0; j < part->count; ++j) {
+				if (__curly_node_part_has(sorted, old->part.count, part->keys[j].type, part->keys[j].name))
+					__curly_node_key_destroy(&part->keys[j]);
+				else
+					keys[k++] = part->keys[j];
+			}
+			for (j = 0; j < new->part.count; ++j)
+				__curly_node_key_set(&keys[k++], new->part.keys[j].type, new->part.keys[j].name);
+			free(part->keys);
+			part->keys = keys;
+			part->count = k;
+			continue;
+		}
+
+		/* Whatever came right after the old file now comes after
+		 * the new one. Include points are in the order the files
+		 * were included in. */
+		if (after && (__curly_node_part_has(sorted, old->part.count, part->after_child.type, part->after_child.name)
+			   || (part->after_child.type == old->part.after_child.type
+			    && part->after_child.name == old->part.after_child.name))) {
+			__curly_node_key_destroy(&part->after_child);
+			if (last_child)
+				__curly_node_key_set(&part->after_child, last_child->type, last_child->name);
+			else
+				__curly_node_key_set(&part->after_child, old->part.after_child.type, old->part.after_child.name);
+		}
+		if (after && (part->after_attr == old->part.after_attr
+			   || __curly_node_part_has(sorted, old->part.count, NULL, part->after_attr))) {
+			curly_atom_unref(part->after_attr);
+			if (last_attr)
+				part->after_attr = curly_atom_ref((char *) curly_attr_get_name(last_attr));
+			else
+				part->after_attr = curly_atom_ref(old->part.after_attr);
+		}
+
+		/* The new file removes attributes that aren't there; files
+		 * included here before it must not add them */
+		if (removes)
+			__curly_include_mark_shared_at(point, rb->new_point, old);
+
+	}
+
+	free(sorted);
+}
+
+/*
+ * Put the new include points where the old one was, and drop the old
+ * one along with all the ones below it. Returns the number of points
+ * dropped.
+ */
+static unsigned int
+__curly_include_points_replace(curly_include_cache_t *cache, const struct curly_include_rebuild *rb)
+{
+	struct curly_include_point **points, **dead;
+	unsigned int i, j, n = 0, ndead = 0;
+
+	points = calloc(cache->npoints + 1, sizeof(points[0]));
+	dead = calloc(cache->npoints + 1, sizeof(dead[0]));
+	for (i = 0; i < cache->npoints; ++i) {
+		struct curly_include_point *point = cache->points[i];
+
+		if (rb->first <= i && i < rb->last)
+			continue;
+		if (point == rb->point) {
+			for (j = rb->first; j < rb->last; ++j)
+				points[n++] = cache->points[j];
+		}
+		if (__curly_include_point_within(point, rb->point))
+			dead[ndead++] = point;
+		else
+			points[n++] = point;
+	}
+
+	memcpy(cache->points, points, n * sizeof(points[0]));
+	cache->npoints = n;
+	free(points);
+
+	/* Only free them now, as they refer to each other */
+	__curly_include_points_free(dead, ndead);
+	return ndead;
+}
+
+static void
+__curly_include_rebuilds_free(curly_include_cache_t *cache, struct curly_include_rebuild *rebuilds, unsigned int count,
+			unsigned int npoints)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		if (rebuilds[i].tree)
+			curly_node_free(rebuilds[i].tree);
+	}
+	free(rebuilds);
+
+	/* Drop the include points of trees we did not use */
+	for (i = npoints; i < cache->npoints; ++i)
+		curly_include_point_free(cache->points[i]);
+	if (cache->npoints > npoints)
+		cache->npoints = npoints;
+}
+
+/*
+ * Reload only the files that changed, at the places they were included.
+ * Returns the number of nodes changed, -1 on error, or -2 if the whole
+ * config has to be parsed again.
+ */
+static int
+curly_reload_partial(curly_include_cache_t *cache, curly_node_t *root,
+			void (*changed)(curly_node_t *, void *), void *user_data)
+{
+	struct curly_include_rebuild *rebuilds;
+	unsigned int i, j, n = 0, ndead, npoints = cache->npoints;
+	curly_node_t *node;
+	int count = 0;
+
+	/* Find the files to parse again: those that changed, unless
+	 * they're included by a file that changed, too */
+	rebuilds = calloc(npoints + 1, sizeof(rebuilds[0]));
+	for (i = 0; i < npoints; ++i) {
+		struct curly_include_point *point = cache->points[i], *up;
+
+		if (!point->inc->changed)
+			continue;
+		for (up = point->parent; up && !up->inc->changed; up = up->parent)
+			;
+		if (up)
+			continue;
+
+		if (point->shared || !__curly_include_point_lookup(root, point))
+			goto full;
+		for (j = 0; j < n; ++j) {
+			if (__curly_include_point_same_path(point, rebuilds[j].point))
+				goto full;
+		}
+		rebuilds[n++].point = point;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (!__curly_include_rebuild(cache, &rebuilds[i])) {
+			__curly_include_rebuilds_free(cache, rebuilds, n, npoints);
+			return -1;
+		}
+	}
+
+	/* Make sure all of them fit before we touch the tree */
+	for (i = 0; i < n; ++i) {
+		struct curly_include_rebuild *rb = &rebuilds[i];
+
+		node = __curly_include_point_lookup(root, rb->point);
+		if (!__curly_include_rebuild_fits(cache, rb, node, npoints))
+			goto full;
+	}
+
+	for (i = 0; i < n; ++i) {
+		struct curly_include_rebuild *rb = &rebuilds[i];
+
+		node = __curly_include_point_lookup(root, rb->point);
+		count += curly_node_update_part(node, rb->tree, &rb->point->part, changed, user_data);
+
+		__curly_include_rebuild_relocate(cache, rb);
+		__curly_include_rebuild_fixup(cache, rb, node);
+
+		/* The new points of the remaining trees move up by as many
+		 * as we drop */
+		ndead = __curly_include_points_replace(cache, rb);
+		for (j = i + 1; j < n; ++j) {
+			rebuilds[j].first -= ndead;
+			rebuilds[j].last -= ndead;
+		}
+	}
+
+	__curly_include_rebuilds_free(cache, rebuilds, n, cache->npoints);
+	return count;
+
+full:
+	__curly_include_rebuilds_free(cache, rebuilds, n, npoints);
+	return -2;
+}
+
+int
+curly_reload(curly_node_t *root, void (*changed)(curly_node_t *, void *), void *user_data)
+{
+	curly_include_cache_t *cache = root->sources;
+	struct curly_include_point **points;
+	unsigned int i, npoints, modified = 0, globs;
+	curly_node_t *fresh;
+	struct stat stb;
+	int count;
+	bool rv;
+
+	if (cache == NULL || cache->toplevel == NULL) {
+		fprintf(stderr, "Cannot reload config: it was not read from a file\n");
+		return -1;
+	}
+
+	/* Symlinks may have changed, too, and so may the list
+	 * of files matched by wildcard includes */
+	__curly_include_cache_clear_paths(cache);
+	modified = globs = __curly_include_cache_globs_changed(cache);
+	curly_include_cache_mark(cache);
+
+	for (i = 0; i < cache->count; ++i) {
+		struct curly_include *inc = cache->entries[i];
+
+		inc->changed = inc->reachable
+			&& (stat(inc->path, &stb) < 0 || !inc->loaded || !__curly_include_unchanged(inc, &stb));
+		if (inc->changed)
+			modified++;
+	}
+
+	if (modified == 0 && !cache->stale)
+		return 0;
+
+	if (globs == 0 && !cache->stale && !cache->untracked && !cache->toplevel->changed) {
+		/* If this fails, the tree is out of date with respect
+		 * to the file metadata we hold */
+		cache->stale = true;
+		count = curly_reload_partial(cache, root, changed, user_data);
+		if (count != -2) {
+			if (count >= 0) {
+				cache->stale = false;
+				curly_include_cache_prune(cache);
+			}
+			curly_include_cache_forget(cache);
+			return count;
+		}
+	}
+
+	/* Until we've updated the tree successfully, it's out of date
+	 * with respect to the file metadata we hold */
+	cache->stale = true;
+
+	/* Include files are recorded while we parse, and forgotten again
+	 * when we're done. The new tree is thrown away after updating the
+	 * old one, so build it in an arena */
+	__curly_include_cache_clear_globs(cache);
+	points = cache->points;
+	npoints = cache->npoints;
+	cache->points = NULL;
+	cache->npoints = 0;
+
+	fresh = curly_node_new_arena();
+	rv = __curly_parse_tracked(cache->toplevel->path, cache, &curly_build_ops, fresh, 1);
+
+	if (!rv) {
+		__curly_include_points_free(cache->points, cache->npoints);
+		cache->points = points;
+		cache->npoints = npoints;
+		curly_include_cache_forget(cache);
+		curly_node_free(fresh);
+		return -1;
+	}
+
+	__curly_include_points_free(points, npoints);
+
+	count = curly_node_update(root, fresh, changed, user_data);
+	curly_node_free(fresh);
+
+	cache->stale = cache->untracked = false;
+	curly_include_cache_prune(cache);
+	curly_include_cache_forget(cache);
+	return count;
+}
+
+/*
+ * Return the names of all files a tree was read from; the top-level file
+ * comes first. The caller is responsible for freeing the array (but not
+ * the strings).
+ */
+const char **
+curly_source_files(const curly_node_t *root)
+{
+	curly_include_cache_t *cache = root->sources;
+	const char **result;
+	unsigned int i, n = 0;
+
+	if (cache == NULL || cache->toplevel == NULL)
+		return calloc(1, sizeof(result[0]));
+
+	curly_include_cache_mark(cache);
+
+	result = calloc(cache->count + 1, sizeof(result[0]));
+	result[n++] = cache->toplevel->path;
+	for (i = 0; i < cache->count; ++i) {
+		struct curly_include *inc = cache->entries[i];
+
+		if (inc->reachable && inc != cache->toplevel)
+			result[n++] = inc->path;
+	}
+	result[n] = NULL;
+
+	return result;
+}
+
+/*
+ * Same as above, but also return the hash of each file's contents as
+ * they were when we read them, and the wildcard patterns we expanded.
+ */
+curly_source_t *
+curly_source_list(const curly_node_t *root, unsigned int *count_ret)
+{
+	curly_include_cache_t *cache = root->sources;
+	curly_source_t *result;
+	unsigned int i, n = 0;
+
+	*count_ret = 0;
+	if (cache == NULL || cache->toplevel == NULL)
+		return NULL;
+
+	curly_include_cache_mark(cache);
+
+	result = calloc(cache->count + cache->nglobs, sizeof(result[0]));
+	result[n].path = cache->toplevel->path;
+	result[n++].hash = cache->toplevel->hash;
+	for (i = 0; i < cache->count; ++i) {
+		struct curly_include *inc = cache->entries[i];
+
+		if (inc->reachable && inc != cache->toplevel) {
+			result[n].path = inc->path;
+			result[n++].hash = inc->hash;
+		}
+	}
+
+	/* For wildcard includes, the list of matching files counts, too */
+	for (i = 0; i < cache->nglobs; ++i) {
+		result[n].path = cache->globs[i].pattern;
+		result[n].hash = cache->globs[i].hash;
+		result[n++].glob = true;
+	}
+
+	*count_ret = n;
+	return result;
+}
+
+/*
+ * Give a tree loaded from the binary cache the list of files it was
+ * read from, so that it can be reloaded like a parsed one. The first
+ * source is the top-level file. As we don't know where the others were
+ * included, the first reload that finds a change parses the whole
+ * config again.
+ */
+bool
+curly_source_list_restore(curly_node_t *root, const curly_source_t *list, unsigned int count)
+{
+	curly_include_cache_t *cache;
+	struct curly_include *inc;
+	struct stat stb;
+	unsigned int i;
+
+	if (count == 0 || list[0].glob)
+		return false;
+
+	cache = curly_include_cache_new(true);
+	cache->untracked = true;
+	for (i = 0; i < count; ++i) {
+		if (list[i].glob) {
+			struct curly_include_glob *g;
+
+			cache->globs = realloc(cache->globs, (cache->nglobs + 1) * sizeof(cache->globs[0]));
+			g = &cache->globs[cache->nglobs++];
+			memset(g, 0, sizeof(*g));
+			g->pattern = strdup(list[i].path);
+			g->hash = list[i].hash;
+			continue;
+		}
+
+		if (stat(list[i].path, &stb) < 0) {
+			curly_include_cache_free(cache);
+			return false;
+		}
+
+		inc = __curly_include_cache_add(cache, list[i].path);
+		inc->dev = stb.st_dev;
+		inc->ino = stb.st_ino;
+		inc->size = stb.st_size;
+		inc->mtime = stb.st_mtim;
+		inc->hash = list[i].hash;
+		inc->loaded = inc->valid = true;
+		if (i == 0)
+			cache->toplevel = inc;
+	}
+
+	if (root->sources)
+		curly_include_cache_free(root->sources);
+	root->sources = cache;
+	return true;
+}
+
+/*
+ * Build the path of an include file relative to the directory of the
+ * file that includes it.
+ */
+static char *
+__curly_include_name(curly_parser_t *p, const char *filename)
+{
+	char pathbuf[PATH_MAX];
+	char *pathcopy = NULL, *dir = NULL;
+
+	if (filename[0] == '/')
+		return strdup(filename);
+
+	save_string(&pathcopy, p->file->name);
+	dir = dirname(pathcopy);
+
+	if (dir == NULL)
+		dir = ".";
+	snprintf(pathbuf, sizeof(pathbuf), "%s/%s", dir, filename);
+
+	if (p->trace)
+		fprintf(stderr, "### include \"%s\" from \"%s\" -> \"%s\"\n", filename, p->file->name, pathbuf);
+	save_string(&pathcopy, NULL);
+
+	return strdup(pathbuf);
+}
+
+static bool
+curly_parse_include(curly_parser_t *p, const char *filename, void *ctx)
+{
+	char *name;
+	bool rv;
+
+	name = __curly_include_name(p, filename);
+	rv = p->ops->include(p, ctx, name);
+	free(name);
+
+	return rv;
+}
+
+void
+__curly_print(const curly_node_t *cfg, FILE *fp, int indent)
+{
+	const curly_attr_t *attr;
+	const curly_node_t *child;
+
+	cfg = curly_node_contents(cfg);
+	for (attr = cfg->attrs; attr; attr = attr->next) {
+		unsigned int n = 0;
+
+		fprintf(fp, "%*.*s%-12s ",
+				indent, indent, "",
+				attr->name);
+		for (n = 0; n < attr->nvalues; ++n)  {
+			if (n)
+				fprintf(fp, ",\n%*.*s", indent + 13, indent + 13, "");
+			fprintf(fp, " \"%s\"", attr->values[n]);
+		}
+		fprintf(fp, ";\n");
+	}
+
+	for (child = cfg->children; child; child = child->next) {
+		if (child->name) {
+			fprintf(fp, "%*.*s%s \"%s\" {\n",
+					indent, indent, "",
+					child->type,
+					child->name);
+		} else {
+			fprintf(fp, "%*.*s%s {\n",
+					indent, indent, "",
+					child->type);
+		}
+
+		__curly_print(child, fp, indent + 4);
+		fprintf(fp, "%*.*s}\n",
+				indent, indent, "");
+	}
+}
+
+void
+curly_print(const curly_node_t *cfg, FILE *fp)
+{
+	__curly_print(cfg, fp, 0);
+}
+
+static bool
+__curly_file_read_all(curly_file_t *file, int fd)
+{
+	size_t size = 0, alloc = 0;
+	ssize_t n;
+
+	while (true) {
+		if (size == alloc) {
+			alloc = alloc? 2 * alloc : 65536;
+			file->buffer = realloc(file->buffer, alloc);
+		}
+
+		n = read(fd, file->buffer + size, alloc - size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	file->data = file->buffer;
+	file->size = size;
+	return true;
+}
+
+curly_file_t *
+curly_file_open(const char *filename)
+{
+	curly_file_t *file;
+	struct stat stb;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+
+	file = calloc(1, sizeof(*file));
+	file->name = strdup(filename);
+	file->lineno = 1;
+
+	if (fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode) && stb.st_size > 0) {
+		void *addr;
+
+		addr = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			madvise(addr, stb.st_size, MADV_SEQUENTIAL);
+			file->mapped = addr;
+			file->data = addr;
+			file->size = stb.st_size;
+		}
+	}
+
+	/* Not a regular file, or mmap failed: fall back to read() */
+	if (file->data == NULL && !__curly_file_read_all(file, fd)) {
+		fprintf(stderr, "%s: read error: %m\n", filename);
+		close(fd);
+		curly_file_close(file);
+		return NULL;
+	}
+
+	close(fd);
+	return file;
+}
+
+curly_file_t *
+curly_file_from_buffer(const char *name, const char *data, size_t size)
+{
+	curly_file_t *file;
+
+	file = calloc(1, sizeof(*file));
+	file->name = strdup(name);
+	file->lineno = 1;
+	file->data = data;
+	file->size = size;
+	return file;
+}
+
+void
+curly_file_close(curly_file_t *file)
+{
+	if (file->name)
+		free(file->name);
+	if (file->mapped)
+		munmap(file->mapped, file->size);
+	if (file->buffer)
+		free(file->buffer);
+	free(file);
+}
+
+/*
+ * Track the origin of where a file was defined
+ */
+curly_shared_string_t *
+curly_shared_string_new(const char *value)
+{
+	curly_shared_string_t *shared;
+
+	shared = calloc(1, sizeof(*shared));
+	save_string(&shared->value, value);
+	shared->refcount = 1;
+	return shared;
+}
+
+static curly_shared_string_t *
+curly_shared_string_hold(curly_shared_string_t *shared)
+{
+	if (shared != NULL) {
+		shared->refcount += 1;
+
+		/* Ensure that the refcount was >0 to begin with, and did not overflow when incrementing it */
+		assert(shared->refcount > 1);
+	}
+
+	return shared;
+}
+
+static void
+curly_shared_string_release(curly_shared_string_t *shared)
+{
+	assert(shared->refcount);
+	if (shared->refcount > 1) {
+		shared->refcount -= 1;
+		return;
+	}
+
+	save_string(&shared->value, NULL);
+	free(shared);
+}
+
+void
+curly_origin_destroy(curly_origin_t *origin)
+{
+	if (origin->path) {
+		curly_shared_string_release(origin->path);
+		origin->path = NULL;
+	}
+	origin->line = 0;
+}
+
+void
+curly_origin_init(curly_origin_t *origin, const char *path)
+{
+	origin->path = curly_shared_string_new(path);
+	origin->line = 0;
+}
+
+void
+curly_origin_set(curly_origin_t *dst, curly_shared_string_t *path, unsigned int line)
+{
+	curly_origin_destroy(dst);
+	dst->path = curly_shared_string_hold(path);
+	dst->line = line;
+}
+
+/*
+ * A backslash at the end of a line joins it with the next one.
+ * The backslash and the newline turn into a single blank, and
+ * leading white space on the continuation line is dropped.
+ */
+static inline bool
+__curly_parser_is_continuation(const curly_parser_t *parser, const char *pos)
+{
+	return *pos == '\\' && (pos + 1 == parser->end || pos[1] == '\n');
+}
+
+static const char *
+__curly_parser_skip_continuation(curly_parser_t *parser, const char *pos)
+{
+	/* skip the backslash */
+	if (++pos < parser->end) {
+		/* skip the newline */
+		parser->file->lineno++;
+		++pos;
+	}
+
+	while (pos < parser->end && *pos != '\n' && curly_isspace(*pos))
+		++pos;
+	return pos;
+}
+
+void
+curly_parser_skip_ws(curly_parser_t *parser)
+{
+	const curly_scanner_t *scanner = parser->scanner;
+	const char *pos = parser->pos, *end = parser->end;
+	unsigned int newlines;
+
+	while (pos < end) {
+		pos = scanner->skip_space(pos, end, &newlines);
+		parser->file->lineno += newlines;
+
+		if (pos >= end)
+			break;
+
+		if (__curly_parser_is_continuation(parser, pos)) {
+			pos = __curly_parser_skip_continuation(parser, pos);
+		} else
+		if (*pos == '#') {
+			/* Hit a comment, discard the rest of the line
+			 * (including any continuation lines) */
+			while ((pos = scanner->find_line_special(pos, end)) < end && *pos == '\\') {
+				if (__curly_parser_is_continuation(parser, pos))
+					pos = __curly_parser_skip_continuation(parser, pos);
+				else
+					++pos;
+			}
+		} else {
+			break;
+		}
+	}
+
+	parser->pos = pos;
+}
+
+void
+curly_parser_pushback(curly_parser_t *parser, curly_token_t token)
+{
+	if (parser->trace)
+		fprintf(stderr, "### pushback token %s(%u)\n", curly_token_name(token), token);
+	if (parser->save) {
+		curly_parser_error(parser, "Trying to push back more than one token - no workee");
+	}
+	parser->save = token;
+}
+
+static inline void
+__curly_parser_token_set(curly_parser_t *parser, const char *start, size_t len)
+{
+	parser->token.ptr = start;
+	parser->token.len = len;
+}
+
+static void
+__curly_parser_scratch_reset(curly_parser_t *parser)
+{
+	struct curly_scratch_chunk *chunk;
+
+	for (chunk = parser->scratch; chunk; chunk = chunk->next)
+		chunk->used = 0;
+	parser->scratch_current = parser->scratch;
+}
+
+/*
+ * Return a pointer to at least len+1 bytes of scratch memory. The memory
+ * is not considered used until the caller commits it.
+ */
+static char *
+__curly_parser_scratch_reserve(curly_parser_t *parser, size_t len)
+{
+	struct curly_scratch_chunk *chunk, **pos;
+	size_t size;
+
+	while ((chunk = parser->scratch_current) != NULL) {
+		if (chunk->size - chunk->used > len)
+			return chunk->data + chunk->used;
+		parser->scratch_current = chunk->next;
+	}
+
+	size = 4096;
+	while (size <= 2 * len)
+		size *= 2;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	for (pos = &parser->scratch; *pos; pos = &(*pos)->next)
+		;
+	*pos = chunk;
+
+	parser->scratch_current = chunk;
+	return chunk->data;
+}
+
+static inline char *
+__curly_parser_scratch_grow(curly_parser_t *parser, char *str, size_t len, size_t extra)
+{
+	char *new_str;
+
+	new_str = __curly_parser_scratch_reserve(parser, len + extra);
+	if (new_str != str)
+		memcpy(new_str, str, len);
+	return new_str;
+}
+
+static inline void
+__curly_parser_scratch_commit(curly_parser_t *parser, size_t len)
+{
+	parser->scratch_current->used += len + 1;
+}
+
+/*
+ * Return the next character of a string constant, taking care of
+ * continuation lines.
+ */
+static inline int
+__curly_parser_string_getc(curly_parser_t *parser, const char **posp)
+{
+	const char *pos = *posp;
+
+	if (pos >= parser->end)
+		return -1;
+
+	if (__curly_parser_is_continuation(parser, pos)) {
+		*posp = __curly_parser_skip_continuation(parser, pos);
+		return ' ';
+	}
+
+	*posp = pos + 1;
+	return (unsigned char) *pos;
+}
+
+/*
+ * Lex a string constant. pos points to the first character after the
+ * opening quote. In the common case, the string does not contain any
+ * escapes, and we return a slice of the input buffer. Otherwise, the
+ * unescaped string is assembled in a scratch buffer.
+ */
+static const char *
+__curly_parser_get_string(curly_parser_t *parser, const char *pos)
+{
+	const curly_scanner_t *scanner = parser->scanner;
+	const char *start = pos;
+	size_t len = 0;
+	char *str;
+	int cc;
+
+	pos = scanner->find_string_special(pos, parser->end);
+	if (pos < parser->end && *pos == '"') {
+		__curly_parser_token_set(parser, start, pos - start);
+		return pos + 1;
+	}
+
+	str = __curly_parser_scratch_reserve(parser, 16);
+	while (true) {
+		/* Copy everything up to the next special character */
+		if (pos > start) {
+			str = __curly_parser_scratch_grow(parser, str, len, pos - start + 1);
+			memcpy(str + len, start, pos - start);
+			len += pos - start;
+		}
+
+		if (pos < parser->end && *pos == '"') {
+			pos++;
+			break;
+		}
+
+		cc = __curly_parser_string_getc(parser, &pos);
+		if (cc == '\\')
+			cc = __curly_parser_string_getc(parser, &pos);
+		if (cc < 0 || cc == '\n') {
+			/* String constants must not span lines */
+			parser->pos = (cc < 0)? pos : pos - 1;
+			curly_parser_error(parser, "missing closing double quote");
+			return NULL;
+		}
+
+		str = __curly_parser_scratch_grow(parser, str, len, 2);
+		str[len++] = cc;
+
+		start = pos;
+		pos = scanner->find_string_special(pos, parser->end);
+	}
+
+	str[len] = '\0';
+	__curly_parser_scratch_commit(parser, len);
+
+	__curly_parser_token_set(parser, str, len);
+	return pos;
+}
+
+curly_token_t
+curly_parser_get_token(curly_parser_t *parser, curly_slice_t *token_string)
+{
+	curly_token_t token;
+	const char *pos, *start;
+
+	if (parser->error)
+		return Error;
+
+	if (parser->save != EndOfFile) {
+		token = parser->save;
+		*token_string = parser->token;
+		parser->save = EndOfFile;
+
+		return token;
 	}
 
 	curly_parser_skip_ws(parser);
 
-	if ((pos = __curly_parser_current(parser)) == NULL) {
-		*token_string = NULL;
+	pos = parser->pos;
+	if (pos >= parser->end) {
+		token_string->ptr = NULL;
+		token_string->len = 0;
 		return EndOfFile;
 	}
 
-	dst = parser->toknbuf;
-	if (isalnum(*pos)) {
-		while (isalnum(*pos) || (*pos && strchr("_.:/-", *pos)))
-			*dst++ = *pos++;
+	parser->token_start = pos;
+	if (curly_isalnum(*pos)) {
+		start = pos;
+		pos = parser->scanner->skip_ident(pos, parser->end);
+		__curly_parser_token_set(parser, start, pos - start);
 		token = Identifier;
 	} else
-	if (*pos == '%' && isalnum(pos[1])) {
-		pos += 1;
-		while (isalnum(*pos) || (*pos && strchr("_.:/-", *pos)))
-			*dst++ = *pos++;
+	if (*pos == '%' && pos + 1 < parser->end && curly_isalnum(pos[1])) {
+		start = ++pos;
+		pos = parser->scanner->skip_ident(pos, parser->end);
+		__curly_parser_token_set(parser, start, pos - start);
 		token = Modifier;
 	} else
 	if (*pos == '"') {
-		char cc;
-
-		++pos;
-		while ((cc = *pos++) != '"') {
-			if (cc == '\0') {
-				curly_parser_error(parser, "missing closing double quote");
-				return Error;
-			}
-			if (cc == '\\' && (cc = *pos++) == '\0') {
-				curly_parser_error(parser, "missing closing double quote");
-				return Error;
-			}
-			*dst++ = cc;
-		}
-
+		if (!(pos = __curly_parser_get_string(parser, pos + 1)))
+			return Error;
 		token = StringConstant;
 	} else
 	if (*pos == '{') {
-		*dst++ = *pos++;
+		__curly_parser_token_set(parser, pos++, 1);
 		token = LeftBrace;
 	} else
 	if (*pos == '}') {
-		*dst++ = *pos++;
+		__curly_parser_token_set(parser, pos++, 1);
 		token = RightBrace;
 	} else
 	if (*pos == ';') {
-		*dst++ = *pos++;
+		__curly_parser_token_set(parser, pos++, 1);
 		token = Semicolon;
 	} else
 	if (*pos == ',') {
-		*dst++ = *pos++;
+		__curly_parser_token_set(parser, pos++, 1);
 		token = Comma;
 	} else {
 		return Error;
 	}
-	*dst++ = '\0';
 
 	if (parser->trace)
-		fprintf(stderr, "### %s(%u) \"%s\"\n", curly_token_name(token), token, parser->toknbuf);
+		fprintf(stderr, "### line %u: %s(%u) \"%.*s\"\n", parser->file->lineno,
+				curly_token_name(token), token,
+				(int) parser->token.len, parser->token.ptr);
 
-	*token_string = parser->toknbuf;
+	*token_string = parser->token;
 	parser->pos = pos;
 
 	return token;
@@ -666,25 +3391,37 @@ void
 curly_parser_error(curly_parser_t *p, const char *msg)
 {
 	curly_file_t *file = p->file;
+	const char *pos = p->pos;
 
 	fprintf(stderr, "%s: line %u: %s\n", file->name, file->lineno, msg);
-	if (p->pos && p->linebuf <= p->pos && p->pos < p->linebuf + sizeof(p->linebuf)) {
-		int hoff = p->pos - p->linebuf;
-		char *cp;
+	if (pos && file->data <= pos && pos <= p->end) {
+		const char *line = pos, *eol = pos;
+		int hoff, len;
+		char *copy, *cp;
+
+		while (line > file->data && line[-1] != '\n')
+			--line;
+		while (eol < p->end && *eol != '\n')
+			++eol;
 
 		/* Convert all spaces to ' ' so that the ^-- HERE pointer doesn't get
 		 * confused by TABs and the like */
-		for (cp = p->linebuf; cp < p->pos; ++cp) {
+		len = eol - line;
+		copy = strndup(line, len);
+		for (cp = copy; *cp; ++cp) {
 			if (isspace(*cp))
 				*cp = ' ';
 		}
 
 		/* Position the ^-- HERE pointer to the start of the token we just consumed */
-		if (hoff >= strlen(p->toknbuf))
-			hoff -= strlen(p->toknbuf);
+		if (p->token_start && line <= p->token_start && p->token_start < pos)
+			hoff = p->token_start - line;
+		else
+			hoff = pos - line;
 
-		fprintf(stderr, "%s\n", p->linebuf);
+		fprintf(stderr, "%s\n", copy);
 		fprintf(stderr, "%*.*s^--- HERE\n", hoff, hoff, "");
+		free(copy);
 	}
 	p->error = true;
 }
@@ -0,0 +1,203 @@
+/*
+ * libcurly paths - compiled lookups of nodes and attributes
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * A path is a list of components separated by slashes, such as
+ *   node[client]/interface[eth0]/ipaddr
+ *
+ * Each component of the form type[name] selects a child node; an empty
+ * name, as in type[], matches any name. The last component may also be
+ * a plain name, which selects an attribute of the node reached so far.
+ *
+ * All strings are compiled to atoms, so that resolving the path compares
+ * pointers only. The result is cached in the path, along with the root
+ * and generation of the tree it was resolved in. Every change to the
+ * tree bumps its generation, which invalidates the cache.
+ */
+struct curly_path_step {
+	curly_atom_t *	type;
+	curly_atom_t *	name;
+};
+
+struct curly_path {
+	unsigned int	nsteps;
+	struct curly_path_step *steps;
+	curly_atom_t *	attr;
+
+	/* Cached result */
+	const curly_node_t *cache_root;
+	uint64_t	cache_generation;
+	curly_node_t *	cache_node;
+	curly_attr_t *	cache_attr;
+};
+
+static curly_atom_t *
+__curly_path_atom(const char *s, size_t len)
+{
+	char *value;
+
+	if (len == 0)
+		return NULL;
+
+	value = curly_atom_intern(&(curly_slice_t) { s, len });
+	return curly_atom_of(value);
+}
+
+static bool
+__curly_path_bad_char(const char *s, size_t len)
+{
+	return memchr(s, '[', len) || memchr(s, ']', len);
+}
+
+curly_path_t *
+curly_path_compile(const char *string)
+{
+	curly_path_t *path;
+	const char *s = string;
+
+	path = calloc(1, sizeof(*path));
+
+	if (*s == '/')
+		s++;
+
+	while (*s) {
+		struct curly_path_step *step;
+		const char *end, *open;
+		size_t len;
+
+		if ((end = strchr(s, '/')) == NULL)
+			end = s + strlen(s);
+		len = end - s;
+
+		if ((open = memchr(s, '[', len)) == NULL) {
+			/* A plain name must be the last component */
+			if (*end || len == 0 || __curly_path_bad_char(s, len))
+				goto bad_path;
+			path->attr = __curly_path_atom(s, len);
+			break;
+		}
+
+		if (open == s || end[-1] != ']'
+		 || __curly_path_bad_char(s, open - s)
+		 || __curly_path_bad_char(open + 1, end - open - 2))
+			goto bad_path;
+
+		path->steps = realloc(path->steps, (path->nsteps + 1) * sizeof(path->steps[0]));
+		step = &path->steps[path->nsteps++];
+		step->type = __curly_path_atom(s, open - s);
+		step->name = __curly_path_atom(open + 1, end - open - 2);
+
+		s = *end? end + 1 : end;
+		if (*end && *s == '\0')
+			goto bad_path;
+	}
+
+	return path;
+
+bad_path:
+	fprintf(stderr, "Invalid path \"%s\"\n", string);
+	curly_path_free(path);
+	return NULL;
+}
+
+void
+curly_path_free(curly_path_t *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < path->nsteps; ++i) {
+		curly_atom_release(path->steps[i].type);
+		curly_atom_release(path->steps[i].name);
+	}
+	curly_atom_release(path->attr);
+	free(path->steps);
+	free(path);
+}
+
+static void
+__curly_path_resolve(curly_node_t *root, curly_path_t *path)
+{
+	curly_node_t *node = root;
+	curly_attr_t *attr = NULL;
+	unsigned int i;
+
+	for (i = 0; node && i < path->nsteps; ++i)
+		node = curly_node_get_child_atom(node, path->steps[i].type, path->steps[i].name);
+
+	if (node && path->attr)
+		attr = curly_node_find_attr_atom(node, path->attr);
+
+	path->cache_node = node;
+	path->cache_attr = attr;
+
+	/* Only a tree's root knows its generation */
+	if (root->parent == NULL) {
+		path->cache_root = root;
+		path->cache_generation = root->generation;
+	} else {
+		path->cache_root = NULL;
+	}
+}
+
+static inline void
+__curly_path_lookup(curly_node_t *root, curly_path_t *path)
+{
+	if (path->cache_root != root || path->cache_generation != root->generation)
+		__curly_path_resolve(root, path);
+}
+
+/*
+ * Return the node a path refers to; for a path ending in an attribute
+ * name, the node holding the attribute.
+ */
+curly_node_t *
+curly_node_lookup(curly_node_t *root, curly_path_t *path)
+{
+	__curly_path_lookup(root, path);
+	return path->cache_node;
+}
+
+const char *
+curly_node_lookup_attr(curly_node_t *root, curly_path_t *path)
+{
+	curly_attr_t *attr;
+
+	__curly_path_lookup(root, path);
+	if ((attr = path->cache_attr) && attr->nvalues)
+		return attr->values[0];
+	return NULL;
+}
+
+const char * const *
+curly_node_lookup_attr_list(curly_node_t *root, curly_path_t *path)
+{
+	curly_attr_t *attr;
+
+	__curly_path_lookup(root, path);
+	if ((attr = path->cache_attr) && attr->nvalues)
+		return (const char * const *) attr->values;
+	return NULL;
+}
@@ -0,0 +1,393 @@
+/*
+ * libcurly scanner - bulk character class scanning for the lexer
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define CURLY_HAVE_X86_SIMD
+#endif
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * Character classes, using the semantics of the C locale.
+ */
+#define SPACE	CURLY_CC_SPACE
+#define ALNUM	(CURLY_CC_ALNUM | CURLY_CC_IDENT)
+#define IDENT	CURLY_CC_IDENT
+
+const unsigned char	curly_ctype[256] = {
+	['\t'] = SPACE, ['\n'] = SPACE, ['\v'] = SPACE,
+	['\f'] = SPACE, ['\r'] = SPACE, [' '] = SPACE,
+
+	['0' ... '9'] = ALNUM,
+	['A' ... 'Z'] = ALNUM,
+	['a' ... 'z'] = ALNUM,
+
+	['_'] = IDENT, ['.'] = IDENT, [':'] = IDENT, ['/'] = IDENT, ['-'] = IDENT,
+};
+
+#undef SPACE
+#undef ALNUM
+#undef IDENT
+
+/*
+ * Reference implementation; this is what the lexer used to do
+ * byte by byte. Kept around to verify the others against.
+ */
+static const char *
+__curly_reference_skip_space(const char *pos, const char *end, unsigned int *newlines)
+{
+	unsigned int count = 0;
+
+	while (pos < end && isspace(*pos)) {
+		if (*pos == '\n')
+			count++;
+		++pos;
+	}
+	*newlines = count;
+	return pos;
+}
+
+static const char *
+__curly_reference_skip_ident(const char *pos, const char *end)
+{
+	while (pos < end && (isalnum(*pos) || (*pos && strchr("_.:/-", *pos))))
+		++pos;
+	return pos;
+}
+
+static const char *
+__curly_reference_find_string_special(const char *pos, const char *end)
+{
+	while (pos < end && *pos != '"' && *pos != '\\' && *pos != '\n')
+		++pos;
+	return pos;
+}
+
+static const char *
+__curly_reference_find_line_special(const char *pos, const char *end)
+{
+	while (pos < end && *pos != '\\' && *pos != '\n')
+		++pos;
+	return pos;
+}
+
+/*
+ * Table driven scalar implementation
+ */
+static const char *
+__curly_scalar_skip_space(const char *pos, const char *end, unsigned int *newlines)
+{
+	unsigned int count = 0;
+
+	while (pos < end && curly_isspace(*pos)) {
+		count += (*pos == '\n');
+		++pos;
+	}
+	*newlines = count;
+	return pos;
+}
+
+static const char *
+__curly_scalar_skip_ident(const char *pos, const char *end)
+{
+	while (pos < end && curly_isident(*pos))
+		++pos;
+	return pos;
+}
+
+#define __curly_scalar_find_string_special	__curly_reference_find_string_special
+#define __curly_scalar_find_line_special	__curly_reference_find_line_special
+
+#ifdef CURLY_HAVE_X86_SIMD
+/*
+ * SSE2 implementation. We only ever load full 16 byte blocks that lie
+ * inside the buffer, and let the scalar code deal with the tail.
+ *
+ * Note that the byte comparisons are signed, so characters >= 0x80
+ * never fall into any of the ASCII ranges we test for.
+ *
+ * SSE2 is part of x86_64, but not of i386; there, these functions are
+ * compiled for SSE2 individually, and only used if the CPU supports it.
+ */
+#define CURLY_SSE2	__attribute__((target("sse2")))
+
+#define RANGE128(v, lo, hi) \
+	_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+		      _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+#define EQ128(v, c) \
+	_mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+
+static inline CURLY_SSE2 __m128i
+__curly_sse2_space_mask(__m128i v)
+{
+	return _mm_or_si128(RANGE128(v, '\t', '\r'), EQ128(v, ' '));
+}
+
+static inline CURLY_SSE2 __m128i
+__curly_sse2_ident_mask(__m128i v)
+{
+	/* "-./0123456789:" happens to be one contiguous range */
+	return _mm_or_si128(
+			_mm_or_si128(RANGE128(v, '-', ':'), EQ128(v, '_')),
+			_mm_or_si128(RANGE128(v, 'A', 'Z'), RANGE128(v, 'a', 'z')));
+}
+
+static CURLY_SSE2 const char *
+__curly_sse2_skip_space(const char *pos, const char *end, unsigned int *newlines)
+{
+	unsigned int count = 0, tail;
+
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) pos);
+		unsigned int space, nl, stop;
+
+		space = _mm_movemask_epi8(__curly_sse2_space_mask(v));
+		nl = _mm_movemask_epi8(EQ128(v, '\n'));
+
+		if (space != 0xFFFF) {
+			stop = __builtin_ctz(~space);
+			count += __builtin_popcount(nl & ((1U << stop) - 1));
+			*newlines = count;
+			return pos + stop;
+		}
+
+		count += __builtin_popcount(nl);
+		pos += 16;
+	}
+
+	pos = __curly_scalar_skip_space(pos, end, &tail);
+	*newlines = count + tail;
+	return pos;
+}
+
+static CURLY_SSE2 const char *
+__curly_sse2_skip_ident(const char *pos, const char *end)
+{
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) pos);
+		unsigned int ident;
+
+		ident = _mm_movemask_epi8(__curly_sse2_ident_mask(v));
+		if (ident != 0xFFFF)
+			return pos + __builtin_ctz(~ident);
+		pos += 16;
+	}
+
+	return __curly_scalar_skip_ident(pos, end);
+}
+
+static CURLY_SSE2 const char *
+__curly_sse2_find_string_special(const char *pos, const char *end)
+{
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) pos);
+		unsigned int special;
+
+		special = _mm_movemask_epi8(_mm_or_si128(
+					_mm_or_si128(EQ128(v, '"'), EQ128(v, '\\')),
+					EQ128(v, '\n')));
+		if (special)
+			return pos + __builtin_ctz(special);
+		pos += 16;
+	}
+
+	return __curly_scalar_find_string_special(pos, end);
+}
+
+static CURLY_SSE2 const char *
+__curly_sse2_find_line_special(const char *pos, const char *end)
+{
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) pos);
+		unsigned int special;
+
+		special = _mm_movemask_epi8(_mm_or_si128(EQ128(v, '\\'), EQ128(v, '\n')));
+		if (special)
+			return pos + __builtin_ctz(special);
+		pos += 16;
+	}
+
+	return __curly_scalar_find_line_special(pos, end);
+}
+
+/*
+ * AVX2 implementation, same as above but 32 bytes at a time.
+ * These functions are compiled for AVX2 individually, and only
+ * used if the CPU supports it.
+ */
+#define CURLY_AVX2	__attribute__((target("avx2")))
+
+#define RANGE256(v, lo, hi) \
+	_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), \
+			 _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+#define EQ256(v, c) \
+	_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+
+static CURLY_AVX2 const char *
+__curly_avx2_skip_space(const char *pos, const char *end, unsigned int *newlines)
+{
+	unsigned int count = 0, tail;
+
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) pos);
+		unsigned int space, nl, stop;
+
+		space = _mm256_movemask_epi8(_mm256_or_si256(RANGE256(v, '\t', '\r'), EQ256(v, ' ')));
+		nl = _mm256_movemask_epi8(EQ256(v, '\n'));
+
+		if (space != 0xFFFFFFFF) {
+			stop = __builtin_ctz(~space);
+			count += __builtin_popcount(nl & ((1ULL << stop) - 1));
+			*newlines = count;
+			return pos + stop;
+		}
+
+		count += __builtin_popcount(nl);
+		pos += 32;
+	}
+
+	pos = __curly_sse2_skip_space(pos, end, &tail);
+	*newlines = count + tail;
+	return pos;
+}
+
+static CURLY_AVX2 const char *
+__curly_avx2_skip_ident(const char *pos, const char *end)
+{
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) pos);
+		unsigned int ident;
+
+		ident = _mm256_movemask_epi8(_mm256_or_si256(
+					_mm256_or_si256(RANGE256(v, '-', ':'), EQ256(v, '_')),
+					_mm256_or_si256(RANGE256(v, 'A', 'Z'), RANGE256(v, 'a', 'z'))));
+		if (ident != 0xFFFFFFFF)
+			return pos + __builtin_ctz(~ident);
+		pos += 32;
+	}
+
+	return __curly_sse2_skip_ident(pos, end);
+}
+
+static CURLY_AVX2 const char *
+__curly_avx2_find_string_special(const char *pos, const char *end)
+{
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) pos);
+		unsigned int special;
+
+		special = _mm256_movemask_epi8(_mm256_or_si256(
+					_mm256_or_si256(EQ256(v, '"'), EQ256(v, '\\')),
+					EQ256(v, '\n')));
+		if (special)
+			return pos + __builtin_ctz(special);
+		pos += 32;
+	}
+
+	return __curly_sse2_find_string_special(pos, end);
+}
+
+static CURLY_AVX2 const char *
+__curly_avx2_find_line_special(const char *pos, const char *end)
+{
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) pos);
+		unsigned int special;
+
+		special = _mm256_movemask_epi8(_mm256_or_si256(EQ256(v, '\\'), EQ256(v, '\n')));
+		if (special)
+			return pos + __builtin_ctz(special);
+		pos += 32;
+	}
+
+	return __curly_sse2_find_line_special(pos, end);
+}
+#endif /* CURLY_HAVE_X86_SIMD */
+
+#define CURLY_SCANNER(variant) { \
+	.name			= #variant, \
+	.skip_space		= __curly_##variant##_skip_space, \
+	.skip_ident		= __curly_##variant##_skip_ident, \
+	.find_string_special	= __curly_##variant##_find_string_special, \
+	.find_line_special	= __curly_##variant##_find_line_special, \
+}
+
+static const curly_scanner_t	curly_scanners[] = {
+	CURLY_SCANNER(reference),
+	CURLY_SCANNER(scalar),
+#ifdef CURLY_HAVE_X86_SIMD
+	CURLY_SCANNER(sse2),
+	CURLY_SCANNER(avx2),
+#endif
+};
+
+static bool
+__curly_scanner_supported(const curly_scanner_t *scanner)
+{
+#ifdef CURLY_HAVE_X86_SIMD
+	if (!strcmp(scanner->name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	if (!strcmp(scanner->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return true;
+}
+
+/*
+ * Pick the best scanner the CPU supports. For testing purposes,
+ * a specific implementation can be requested by setting
+ * CURLIES_SCANNER in the environment.
+ */
+static const curly_scanner_t *
+__curly_scanner_select(void)
+{
+	const curly_scanner_t *best = NULL, *scanner;
+	const char *wanted;
+	unsigned int i;
+
+	wanted = getenv("CURLIES_SCANNER");
+	for (i = 0; i < sizeof(curly_scanners) / sizeof(curly_scanners[0]); ++i) {
+		scanner = &curly_scanners[i];
+
+		if (!__curly_scanner_supported(scanner))
+			continue;
+		if (wanted && !strcmp(wanted, scanner->name))
+			return scanner;
+		best = scanner;
+	}
+
+	return best;
+}
+
+const curly_scanner_t *
+curly_scanner_get(void)
+{
+	static const curly_scanner_t *selected;
+
+	if (selected == NULL)
+		selected = __curly_scanner_select();
+	return selected;
+}
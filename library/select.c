@@ -0,0 +1,366 @@
+/*
+ * libcurly selectors - find all nodes or attribute values matching a pattern
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * Selectors use the same syntax as paths (see path.c), and add
+ *  - wildcards: a type, name or attribute name of "*" matches anything,
+ *    and one containing * or ? is matched as a shell pattern
+ *  - predicates: any number of [attr] or [attr=value] following a
+ *    type[name] component, which require the node to have that
+ *    attribute, or to have value among its values
+ *
+ * For example,
+ *   node[*]/interface[*][network=private]/ipaddr
+ *
+ * A selector is evaluated in a single depth first traversal of the tree.
+ * Literal strings are compiled to atoms, so that matching them compares
+ * pointers; a step without wildcards uses the child index.
+ */
+struct curly_select_pattern {
+	curly_atom_t *	atom;		/* literal string */
+	char *		glob;		/* shell pattern */
+};
+
+struct curly_select_pred {
+	curly_atom_t *	name;
+	curly_atom_t *	value;		/* NULL: attribute must exist */
+};
+
+struct curly_select_step {
+	struct curly_select_pattern type;
+	struct curly_select_pattern name;
+	unsigned int	npreds;
+	struct curly_select_pred *preds;
+};
+
+struct curly_selector {
+	unsigned int	nsteps;
+	struct curly_select_step *steps;
+	bool		select_attr;
+	struct curly_select_pattern attr;
+};
+
+struct curly_select_state {
+	const curly_selector_t *sel;
+	void **		results;
+	unsigned int	max;
+	unsigned int	count;
+};
+
+/*
+ * Parse a string up to the next unbracketed delimiter
+ */
+static const char *
+__curly_select_token(const char *s, const char *delim, curly_slice_t *token)
+{
+	token->ptr = s;
+	while (*s && !strchr(delim, *s))
+		s++;
+	token->len = s - token->ptr;
+	return s;
+}
+
+static bool
+__curly_select_has_glob(const curly_slice_t *s)
+{
+	return memchr(s->ptr, '*', s->len) || memchr(s->ptr, '?', s->len);
+}
+
+static void
+__curly_select_pattern_init(struct curly_select_pattern *pat, const curly_slice_t *s)
+{
+	if (s->len == 0 || (s->len == 1 && s->ptr[0] == '*'))
+		return;
+
+	if (__curly_select_has_glob(s))
+		pat->glob = strndup(s->ptr, s->len);
+	else
+		pat->atom = curly_atom_of(curly_atom_intern(s));
+}
+
+static void
+__curly_select_pattern_destroy(struct curly_select_pattern *pat)
+{
+	curly_atom_release(pat->atom);
+	free(pat->glob);
+}
+
+static inline bool
+__curly_select_pattern_match(const struct curly_select_pattern *pat, const char *value)
+{
+	if (pat->atom)
+		return value == pat->atom->value;
+	if (pat->glob)
+		return value && fnmatch(pat->glob, value, 0) == 0;
+	return true;
+}
+
+static const char *
+__curly_select_parse_pred(struct curly_select_step *step, const char *s)
+{
+	struct curly_select_pred *pred;
+	curly_slice_t name, value;
+
+	s = __curly_select_token(s, "=[]", &name);
+	if (name.len == 0 || (*s != '=' && *s != ']'))
+		return NULL;
+
+	step->preds = realloc(step->preds, (step->npreds + 1) * sizeof(step->preds[0]));
+	pred = &step->preds[step->npreds++];
+	pred->name = curly_atom_of(curly_atom_intern(&name));
+	pred->value = NULL;
+
+	if (*s == '=') {
+		s = __curly_select_token(s + 1, "[]", &value);
+		if (*s != ']' || value.len == 0)
+			return NULL;
+		pred->value = curly_atom_of(curly_atom_intern(&value));
+	}
+
+	return s + 1;
+}
+
+curly_selector_t *
+curly_selector_compile(const char *string)
+{
+	curly_selector_t *sel;
+	const char *s = string;
+
+	sel = calloc(1, sizeof(*sel));
+
+	if (*s == '/')
+		s++;
+
+	while (*s) {
+		struct curly_select_step *step;
+		curly_slice_t token;
+
+		s = __curly_select_token(s, "[]/", &token);
+		if (token.len == 0 || *s == ']')
+			goto bad_selector;
+
+		/* A plain name must be the last component */
+		if (*s != '[') {
+			if (*s)
+				goto bad_selector;
+			sel->select_attr = true;
+			__curly_select_pattern_init(&sel->attr, &token);
+			break;
+		}
+
+		sel->steps = realloc(sel->steps, (sel->nsteps + 1) * sizeof(sel->steps[0]));
+		step = &sel->steps[sel->nsteps++];
+		memset(step, 0, sizeof(*step));
+		__curly_select_pattern_init(&step->type, &token);
+
+		s = __curly_select_token(s + 1, "[]", &token);
+		if (*s++ != ']')
+			goto bad_selector;
+		__curly_select_pattern_init(&step->name, &token);
+
+		while (*s == '[') {
+			if (!(s = __curly_select_parse_pred(step, s + 1)))
+				goto bad_selector;
+		}
+
+		if (*s == '/' && *++s == '\0')
+			goto bad_selector;
+		if (*s && s[-1] != '/')
+			goto bad_selector;
+	}
+
+	return sel;
+
+bad_selector:
+	fprintf(stderr, "Invalid selector \"%s\"\n", string);
+	curly_selector_free(sel);
+	return NULL;
+}
+
+void
+curly_selector_free(curly_selector_t *sel)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < sel->nsteps; ++i) {
+		struct curly_select_step *step = &sel->steps[i];
+
+		__curly_select_pattern_destroy(&step->type);
+		__curly_select_pattern_destroy(&step->name);
+		for (j = 0; j < step->npreds; ++j) {
+			curly_atom_release(step->preds[j].name);
+			curly_atom_release(step->preds[j].value);
+		}
+		free(step->preds);
+	}
+	__curly_select_pattern_destroy(&sel->attr);
+	free(sel->steps);
+	free(sel);
+}
+
+bool
+curly_selector_selects_attr(const curly_selector_t *sel)
+{
+	return sel->select_attr;
+}
+
+/*
+ * Evaluation
+ */
+static inline void
+__curly_select_emit(struct curly_select_state *state, void *result)
+{
+	if (state->count < state->max)
+		state->results[state->count] = result;
+	state->count++;
+}
+
+static bool
+__curly_select_preds_match(const struct curly_select_step *step, curly_node_t *node)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < step->npreds; ++i) {
+		const struct curly_select_pred *pred = &step->preds[i];
+		curly_attr_t *attr;
+
+		if (!(attr = curly_node_find_attr_atom(node, pred->name)))
+			return false;
+		if (pred->value == NULL)
+			continue;
+
+		for (n = 0; n < attr->nvalues; ++n) {
+			if (attr->values[n] == pred->value->value)
+				break;
+		}
+		if (n >= attr->nvalues)
+			return false;
+	}
+	return true;
+}
+
+static void
+__curly_select_emit_attr(struct curly_select_state *state, curly_node_t *node)
+{
+	const struct curly_select_pattern *pat = &state->sel->attr;
+	curly_attr_t *attr;
+	unsigned int n;
+
+	if (pat->atom) {
+		if ((attr = curly_node_find_attr_atom(node, pat->atom)) != NULL) {
+			for (n = 0; n < attr->nvalues; ++n)
+				__curly_select_emit(state, attr->values[n]);
+		}
+		return;
+	}
+
+	for (attr = curly_node_contents(node)->attrs; attr; attr = attr->next) {
+		if (!__curly_select_pattern_match(pat, attr->name))
+			continue;
+		for (n = 0; n < attr->nvalues; ++n)
+			__curly_select_emit(state, attr->values[n]);
+	}
+}
+
+static void
+__curly_select(struct curly_select_state *state, curly_node_t *node, unsigned int depth)
+{
+	const curly_selector_t *sel = state->sel;
+	const struct curly_select_step *step;
+	curly_node_t *child;
+
+	if (depth == sel->nsteps) {
+		if (sel->select_attr)
+			__curly_select_emit_attr(state, node);
+		else
+			__curly_select_emit(state, node);
+		return;
+	}
+
+	/* Nodes we return must be children of ours, or stand-ins for
+	 * them; values are atoms, and can be read from the contents we
+	 * share. */
+	if (sel->select_attr)
+		node = (curly_node_t *) curly_node_contents(node);
+	else
+		curly_node_cow_children(node);
+
+	step = &sel->steps[depth];
+	if (step->type.atom && step->name.atom) {
+		child = curly_node_get_child_atom(node, step->type.atom, step->name.atom);
+		if (child && __curly_select_preds_match(step, child))
+			__curly_select(state, child, depth + 1);
+		return;
+	}
+
+	for (child = node->children; child; child = child->next) {
+		if (__curly_select_pattern_match(&step->type, child->type)
+		 && __curly_select_pattern_match(&step->name, child->name)
+		 && __curly_select_preds_match(step, child))
+			__curly_select(state, child, depth + 1);
+	}
+}
+
+/*
+ * Store up to max matching nodes in nodes[], in tree order, and return
+ * the number of matches, which may be larger than max.
+ */
+unsigned int
+curly_node_select(curly_node_t *root, const curly_selector_t *sel, curly_node_t **nodes, unsigned int max)
+{
+	struct curly_select_state state = {
+		.sel = sel,
+		.results = (void **) nodes,
+		.max = max,
+	};
+
+	if (sel->select_attr)
+		return 0;
+
+	__curly_select(&state, root, 0);
+	return state.count;
+}
+
+/*
+ * Same as above, for selectors that end in an attribute name; stores
+ * all values of all matching attributes.
+ */
+unsigned int
+curly_node_select_values(curly_node_t *root, const curly_selector_t *sel, const char **values, unsigned int max)
+{
+	struct curly_select_state state = {
+		.sel = sel,
+		.results = (void **) values,
+		.max = max,
+	};
+
+	if (!sel->select_attr)
+		return 0;
+
+	__curly_select(&state, root, 0);
+	return state.count;
+}
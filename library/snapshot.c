@@ -0,0 +1,133 @@
+/*
+ * libcurly snapshots - publish frozen trees to concurrent readers
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * The current tree is a pointer that writers replace atomically.
+ * Readers hold a reference to the tree they acquired, so that it stays
+ * around until they release it.
+ *
+ * The tricky part is the window between a reader loading the pointer
+ * and taking its reference, during which a writer may replace the tree
+ * and drop its own reference. To close it, readers announce themselves
+ * in one of two counters for the duration of that window, selected by
+ * the parity of the current epoch. Before dropping the reference to
+ * the old tree, a writer waits for a grace period: it advances the
+ * epoch, so that new readers use the other counter, and waits for the
+ * old counter to drain; then it does the same once more. Readers that
+ * arrive after the pointer was replaced can only see the new tree.
+ *
+ * Writers are serialized by a mutex; readers never block.
+ */
+struct curly_snapshot {
+	curly_node_t *	current;
+	unsigned int	epoch;
+	unsigned int	readers[2];	/* readers inside acquire, by epoch parity */
+	pthread_mutex_t	lock;
+};
+
+curly_snapshot_t *
+curly_snapshot_new(void)
+{
+	curly_snapshot_t *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	pthread_mutex_init(&snap->lock, NULL);
+	return snap;
+}
+
+/*
+ * Readers still holding a tree keep it alive after the snapshot holder
+ * is gone; but there must not be any readers inside acquire.
+ */
+void
+curly_snapshot_free(curly_snapshot_t *snap)
+{
+	if (snap->current)
+		curly_frozen_put(snap->current);
+	pthread_mutex_destroy(&snap->lock);
+	free(snap);
+}
+
+static void
+__curly_snapshot_synchronize(curly_snapshot_t *snap)
+{
+	unsigned int i, epoch;
+
+	for (i = 0; i < 2; ++i) {
+		epoch = __atomic_fetch_add(&snap->epoch, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&snap->readers[epoch & 1], __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+	}
+}
+
+void
+curly_snapshot_publish(curly_snapshot_t *snap, curly_node_t *tree)
+{
+	curly_node_t *old;
+
+	if (tree->frozen == NULL || tree->parent != NULL) {
+		curly_node_t *frozen = curly_node_freeze(tree);
+
+		curly_node_free(tree);
+		tree = frozen;
+	}
+
+	pthread_mutex_lock(&snap->lock);
+	old = __atomic_exchange_n(&snap->current, tree, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		__curly_snapshot_synchronize(snap);
+		curly_frozen_put(old);
+	}
+	pthread_mutex_unlock(&snap->lock);
+}
+
+/*
+ * Returns NULL if nothing has been published yet
+ */
+curly_node_t *
+curly_snapshot_acquire(curly_snapshot_t *snap)
+{
+	unsigned int parity;
+	curly_node_t *tree;
+
+	parity = __atomic_load_n(&snap->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&snap->readers[parity], 1, __ATOMIC_SEQ_CST);
+
+	tree = __atomic_load_n(&snap->current, __ATOMIC_SEQ_CST);
+	if (tree != NULL)
+		curly_frozen_get(tree);
+
+	__atomic_sub_fetch(&snap->readers[parity], 1, __ATOMIC_RELEASE);
+	return tree;
+}
+
+void
+curly_snapshot_release(curly_node_t *tree)
+{
+	if (tree != NULL)
+		curly_frozen_put(tree);
+}
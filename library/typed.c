@@ -0,0 +1,357 @@
+/*
+ * libcurly typed attributes - parse values once, and cache the result
+ *
+ * Copyright (C) 2014-2021 SUSE
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "curlies.h"
+#include "internal.h"
+
+/*
+ * The parsed form of an attribute's first value is kept in attr->typed,
+ * which is allocated on first use and freed whenever the attribute is
+ * assigned. An attribute caches one type at a time; a value that fails
+ * to parse is cached as well, so that the error is reported only once.
+ *
+ * Frozen trees may be shared by several threads, so their attributes
+ * are parsed on every access instead.
+ */
+enum {
+	CURLY_TYPED_INT = 1,
+	CURLY_TYPED_UINT64,
+	CURLY_TYPED_BOOL,
+	CURLY_TYPED_DURATION,
+	CURLY_TYPED_IPV4_PREFIX,
+	CURLY_TYPED_IPV6,
+};
+
+struct curly_attr_typed {
+	int		kind;
+	bool		valid;
+	union {
+		int	i;
+		uint64_t u;
+		bool	b;
+		curly_ipv4_prefix_t ipv4;
+		uint8_t	ipv6[16];
+	};
+};
+
+/*
+ * Integers are decimal, or hexadecimal with a 0x prefix. Unlike with
+ * strtoul(..., 0), a leading zero does not make them octal: "010" is
+ * ten, and "08" is valid.
+ */
+static bool
+__curly_parse_unsigned(const char *s, unsigned long long *value)
+{
+	int base = 10;
+	char *end;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		base = 16;
+		s += 2;
+	}
+
+	/* Don't let strtoull() accept blanks, a sign or another 0x */
+	if (base == 10 && (*s < '0' || *s > '9'))
+		return false;
+	if (base == 16 && (!isxdigit((unsigned char) *s) || s[1] == 'x' || s[1] == 'X'))
+		return false;
+
+	errno = 0;
+	*value = strtoull(s, &end, base);
+	return *end == '\0' && errno == 0;
+}
+
+static bool
+__curly_parse_int(const char *s, struct curly_attr_typed *t)
+{
+	unsigned long long value;
+	bool negative = false;
+
+	if (*s == '-' || *s == '+')
+		negative = (*s++ == '-');
+
+	if (!__curly_parse_unsigned(s, &value)
+	 || value > (negative? -(unsigned long long) INT_MIN : INT_MAX))
+		return false;
+	t->i = negative? (int) -(long long) value : (int) value;
+	return true;
+}
+
+static bool
+__curly_parse_uint64(const char *s, struct curly_attr_typed *t)
+{
+	unsigned long long value;
+
+	if (*s == '+')
+		s++;
+	if (!__curly_parse_unsigned(s, &value))
+		return false;
+	t->u = value;
+	return true;
+}
+
+static bool
+__curly_parse_bool(const char *s, struct curly_attr_typed *t)
+{
+	static const char *true_words[] = { "true", "yes", "on", "1", NULL };
+	static const char *false_words[] = { "false", "no", "off", "0", NULL };
+	unsigned int i;
+
+	for (i = 0; true_words[i]; ++i) {
+		if (!strcasecmp(s, true_words[i])) {
+			t->b = true;
+			return true;
+		}
+		if (!strcasecmp(s, false_words[i])) {
+			t->b = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Durations are returned in milliseconds */
+static bool
+__curly_parse_duration(const char *s, struct curly_attr_typed *t)
+{
+	static const struct {
+		const char *	name;
+		uint64_t	msec;
+	} units[] = {
+		{ "ms",	1 },
+		{ "s",	1000 },
+		{ "m",	60 * 1000 },
+		{ "h",	60 * 60 * 1000 },
+		{ "d",	24 * 60 * 60 * 1000 },
+		{ NULL }
+	};
+	uint64_t total = 0;
+
+	if (*s == '\0')
+		return false;
+
+	while (*s) {
+		unsigned long long value;
+		uint64_t msec = 1000;
+		unsigned int i;
+		char *end;
+
+		if (*s < '0' || *s > '9')
+			return false;
+
+		errno = 0;
+		value = strtoull(s, &end, 10);
+		if (errno)
+			return false;
+		s = end;
+
+		if (*s) {
+			for (i = 0; units[i].name; ++i) {
+				size_t len = strlen(units[i].name);
+
+				/* "m" must not match the "m" of "ms" */
+				if (!strncmp(s, units[i].name, len) && (s[len] < 'a' || s[len] > 'z'))
+					break;
+			}
+			if (units[i].name == NULL)
+				return false;
+			msec = units[i].msec;
+			s += strlen(units[i].name);
+		}
+
+		if (__builtin_mul_overflow(value, msec, &value)
+		 || __builtin_add_overflow(total, value, &total))
+			return false;
+	}
+
+	t->u = total;
+	return true;
+}
+
+static bool
+__curly_parse_ipv4_prefix(const char *s, struct curly_attr_typed *t)
+{
+	unsigned int n = 0, len;
+	unsigned long value;
+	char *end;
+
+	memset(&t->ipv4, 0, sizeof(t->ipv4));
+	while (true) {
+		if (*s < '0' || *s > '9' || n >= 4)
+			return false;
+		value = strtoul(s, &end, 10);
+		if (value > 255)
+			return false;
+		t->ipv4.addr[n++] = value;
+
+		s = end;
+		if (*s != '.')
+			break;
+		s++;
+	}
+
+	len = 8 * n;
+	if (*s == '/') {
+		s++;
+		if (*s < '0' || *s > '9')
+			return false;
+		value = strtoul(s, &end, 10);
+		if (value > 32)
+			return false;
+		len = value;
+		s = end;
+	}
+
+	if (*s)
+		return false;
+	t->ipv4.len = len;
+	return true;
+}
+
+static bool
+__curly_parse_ipv6(const char *s, struct curly_attr_typed *t)
+{
+	return inet_pton(AF_INET6, s, t->ipv6) == 1;
+}
+
+static const struct curly_typed_parser {
+	const char *	name;
+	bool		(*parse)(const char *, struct curly_attr_typed *);
+} __curly_typed_parsers[] = {
+	[CURLY_TYPED_INT]		= { "integer",		__curly_parse_int },
+	[CURLY_TYPED_UINT64]		= { "unsigned integer",	__curly_parse_uint64 },
+	[CURLY_TYPED_BOOL]		= { "boolean",		__curly_parse_bool },
+	[CURLY_TYPED_DURATION]		= { "duration",		__curly_parse_duration },
+	[CURLY_TYPED_IPV4_PREFIX]	= { "IPv4 prefix",	__curly_parse_ipv4_prefix },
+	[CURLY_TYPED_IPV6]		= { "IPv6 address",	__curly_parse_ipv6 },
+};
+
+static bool
+__curly_typed_get(curly_node_t *cfg, const char *name, int kind, struct curly_attr_typed *result)
+{
+	const struct curly_typed_parser *parser = &__curly_typed_parsers[kind];
+	curly_attr_t *attr;
+
+	if (!(attr = curly_node_find_attr(cfg, name)) || attr->nvalues == 0)
+		return false;
+
+	if (attr->typed && attr->typed->kind == kind) {
+		*result = *attr->typed;
+		return result->valid;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->kind = kind;
+	result->valid = parser->parse(attr->values[0], result);
+
+	if (!result->valid) {
+		const char *file = curly_node_get_source_file(cfg);
+
+		if (file)
+			fprintf(stderr, "%s:%u: ", file, curly_node_get_source_line(cfg));
+		fprintf(stderr, "%s %s: invalid %s \"%s\" for attribute %s\n",
+				cfg->type, cfg->name?: "", parser->name, attr->values[0], name);
+	}
+
+	if (curly_node_contents(cfg)->frozen == NULL) {
+		if (attr->typed == NULL) {
+			attr->typed = malloc(sizeof(*attr->typed));
+			if (attr->in_arena)
+				curly_arena_touch(curly_node_contents(cfg)->arena);
+		}
+		*attr->typed = *result;
+	}
+
+	return result->valid;
+}
+
+bool
+curly_node_get_int(curly_node_t *cfg, const char *name, int *value)
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_INT, &t))
+		return false;
+	*value = t.i;
+	return true;
+}
+
+bool
+curly_node_get_uint64(curly_node_t *cfg, const char *name, uint64_t *value)
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_UINT64, &t))
+		return false;
+	*value = t.u;
+	return true;
+}
+
+bool
+curly_node_get_bool(curly_node_t *cfg, const char *name, bool *value)
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_BOOL, &t))
+		return false;
+	*value = t.b;
+	return true;
+}
+
+bool
+curly_node_get_duration(curly_node_t *cfg, const char *name, uint64_t *msec)
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_DURATION, &t))
+		return false;
+	*msec = t.u;
+	return true;
+}
+
+bool
+curly_node_get_ipv4_prefix(curly_node_t *cfg, const char *name, curly_ipv4_prefix_t *prefix)
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_IPV4_PREFIX, &t))
+		return false;
+	*prefix = t.ipv4;
+	return true;
+}
+
+bool
+curly_node_get_ipv6(curly_node_t *cfg, const char *name, uint8_t addr[16])
+{
+	struct curly_attr_typed t;
+
+	if (!__curly_typed_get(cfg, name, CURLY_TYPED_IPV6, &t))
+		return false;
+	memcpy(addr, t.ipv6, 16);
+	return true;
+}
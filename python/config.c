@@ -265,17 +265,38 @@ __toplevel_string_attr(curlies_Config *self, PyObject *args, PyObject *kwds, con
 static PyObject *
 __get_children(curly_node_t *config, const char *type)
 {
-	const char **values;
+	curly_node_t *child;
+	curly_iter_t iter;
 	PyObject *result;
 
-	values = curly_node_get_children(config, type);
-	if (values == NULL) {
-		PyErr_SetString(PyExc_RuntimeError, "failed to get child names for configuration object");
+	if (!(result = PyList_New(0)))
 		return NULL;
-	}
 
-	result = __to_string_list(values);
-	free(values);
+	curly_iter_init(&iter, config, type);
+	while ((child = curly_iter_next_node(&iter)) != NULL) {
+		const char *name = curly_node_name(child);
+		PyObject *item;
+		int rv;
+
+		if (name == NULL)
+			continue;
+
+		/* Fails for names that aren't valid UTF-8 */
+		if (!(item = PyUnicode_FromString(name))) {
+			Py_DECREF(result);
+			result = NULL;
+			break;
+		}
+
+		rv = PyList_Append(result, item);
+		Py_DECREF(item);
+		if (rv < 0) {
+			Py_DECREF(result);
+			result = NULL;
+			break;
+		}
+	}
+	curly_iter_destroy(&iter);
 
 	return result;
 }
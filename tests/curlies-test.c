@@ -1,26 +1,1040 @@
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "curlies.h"
 
+static curly_node_t *
+read_from_buffer(const char *filename)
+{
+	curly_node_t *cfg;
+	char *buffer = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	if (!(fp = fopen(filename, "r"))) {
+		perror(filename);
+		return NULL;
+	}
+
+	while (!feof(fp)) {
+		buffer = realloc(buffer, size + 4096);
+		size += fread(buffer + size, 1, 4096, fp);
+	}
+	fclose(fp);
+
+	cfg = curly_node_parse_buffer(buffer, size, filename);
+	free(buffer);
+	return cfg;
+}
+
+/*
+ * Rebuild the tree from parser events, using the public node API
+ */
+#define MAX_DEPTH	64
+
+struct event_builder {
+	unsigned int	depth;
+	curly_node_t *	stack[MAX_DEPTH];
+};
+
+static bool
+event_begin_node(void *user_data, const char *type, const char *name, const char *file, unsigned int line, unsigned int flags)
+{
+	struct event_builder *b = user_data;
+	curly_node_t *parent = b->stack[b->depth], *child = NULL;
+
+	if (b->depth + 1 >= MAX_DEPTH)
+		return false;
+
+	if (flags & CURLY_EVENT_F_UPDATE)
+		child = curly_node_get_child(parent, type, name);
+	if (child == NULL)
+		child = curly_node_add_child(parent, type, name);
+	if (child == NULL)
+		return false;
+
+	b->stack[++(b->depth)] = child;
+	return true;
+}
+
+static bool
+event_end_node(void *user_data)
+{
+	struct event_builder *b = user_data;
+
+	b->depth -= 1;
+	return true;
+}
+
+static bool
+event_attribute(void *user_data, const char *name, const char * const *values, unsigned int count)
+{
+	struct event_builder *b = user_data;
+	curly_node_t *node = b->stack[b->depth];
+	unsigned int i;
+
+	if (count == 1) {
+		curly_node_set_attr(node, name, values[0]);
+	} else {
+		for (i = 0; i < count; ++i)
+			curly_node_add_attr_list(node, name, values[i]);
+	}
+	return true;
+}
+
+static curly_node_t *
+read_from_events(const char *filename)
+{
+	static const curly_event_handler_t handler = {
+		.begin_node	= event_begin_node,
+		.end_node	= event_end_node,
+		.attribute	= event_attribute,
+	};
+	struct event_builder builder = { .depth = 0 };
+
+	builder.stack[0] = curly_node_new();
+	if (!curly_events_read(filename, &handler, &builder)) {
+		curly_node_free(builder.stack[0]);
+		return NULL;
+	}
+
+	return builder.stack[0];
+}
+
+/*
+ * Replace a file that is part of the config with a different version,
+ * and reload the config
+ */
+static void
+reload_changed(curly_node_t *node, void *user_data)
+{
+	const char *name = curly_node_name(node);
+
+	if (name)
+		printf("# changed %s \"%s\"\n", curly_node_type(node), name);
+	else
+		printf("# changed %s\n", curly_node_type(node));
+}
+
+/*
+ * Files are replaced rather than overwritten, so that a reload notices
+ * even if size and mtime stay the same
+ */
+static bool
+copy_file(const char *from, const char *to)
+{
+	FILE *src, *dst;
+	char buffer[4096], tmp[PATH_MAX];
+	size_t n;
+
+	if (!(src = fopen(from, "r"))) {
+		perror(from);
+		return false;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.new", to);
+	if (!(dst = fopen(tmp, "w"))) {
+		perror(tmp);
+		fclose(src);
+		return false;
+	}
+
+	while ((n = fread(buffer, 1, sizeof(buffer), src)) > 0)
+		fwrite(buffer, 1, n, dst);
+
+	fclose(src);
+	fclose(dst);
+	if (rename(tmp, to) < 0) {
+		perror(to);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * how is a comma separated list of from:to pairs; replace all of these
+ * files, then reload
+ */
+static void
+sources_test(curly_node_t *cfg)
+{
+	const char **files;
+	unsigned int i;
+
+	files = curly_node_get_source_files(cfg);
+	for (i = 0; files[i]; ++i)
+		printf("# source %s\n", files[i]);
+	free(files);
+}
+
+static bool
+reload(curly_node_t *cfg, char *how)
+{
+	char *from, *to, *next;
+
+	for (from = how; from; from = next) {
+		if ((next = strchr(from, ',')) != NULL)
+			*next++ = '\0';
+		if (!(to = strchr(from, ':'))) {
+			fprintf(stderr, "Bad argument to -r: expected from:to\n");
+			return false;
+		}
+		*to++ = '\0';
+
+		if (!copy_file(from, to))
+			return false;
+	}
+
+	return curly_node_reload(cfg, reload_changed, NULL) >= 0;
+}
+
+/*
+ * Reload random configs after random changes to their include files,
+ * and compare the result to reading them from scratch. The same file
+ * is included in several places, which makes for the more interesting
+ * cases.
+ */
+#define RELOAD_RANDOM_FILES	3
+#define RELOAD_RANDOM_STEPS	8
+
+static void
+reload_random_body(FILE *fp, unsigned int *seed, unsigned int depth, int self)
+{
+	unsigned int i, n = rand_r(seed) % 4, f, included = 0;
+	char owner;
+
+	/* Files only include one of the two after them. Includes that
+	 * come first in a node are the hardest to place again, so make
+	 * them common. */
+	if (rand_r(seed) % 2 && (f = self + 1 + rand_r(seed) % 2) < RELOAD_RANDOM_FILES) {
+		fprintf(fp, "include \"f%u.conf\";\n", f);
+		included |= 1 << f;
+	}
+
+	/* Most names are private to a file, some are shared by all */
+	for (i = 0; i < n; ++i) {
+		owner = (rand_r(seed) % 8)? "abcdefgh"[self + 1] : 'z';
+
+		switch (rand_r(seed) % 20) {
+		case 0: case 1: case 2: case 3:
+			fprintf(fp, "%c%u \"v%u\";\n", owner, rand_r(seed) % 3, rand_r(seed) % 3);
+			break;
+		case 4:
+			/* Deleting an attribute makes most reloads start over */
+			fprintf(fp, "%c%u \"\";\n", owner, rand_r(seed) % 3);
+			break;
+		case 5: case 6:
+			fprintf(fp, "l%c \"x\", \"y%u\";\n", owner, rand_r(seed) % 3);
+			break;
+		case 7: case 8: case 9: case 10: case 11: case 12:
+			if (depth < 3) {
+				if (rand_r(seed) % 2)
+					fprintf(fp, "%%update net %c%u {\n", owner, rand_r(seed) % 3);
+				else
+					fprintf(fp, "net %c%u {\n", owner, rand_r(seed) % 100);
+				reload_random_body(fp, seed, depth + 1, self);
+				fprintf(fp, "}\n");
+				break;
+			}
+			/* fallthrough */
+		default:
+			/* Including a file twice in one place makes it
+			 * share everything with itself */
+			f = self + 1 + rand_r(seed) % 2;
+			if (f < RELOAD_RANDOM_FILES && !(included & (1 << f))) {
+				fprintf(fp, "include \"f%u.conf\";\n", f);
+				included |= 1 << f;
+			}
+			break;
+		}
+	}
+}
+
+static bool
+reload_random_write(const char *dir, unsigned int *seed, int self)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	FILE *fp;
+
+	if (self < 0)
+		snprintf(path, sizeof(path), "%s/main.conf", dir);
+	else
+		snprintf(path, sizeof(path), "%s/f%d.conf", dir, self);
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		return false;
+	}
+	/* The top-level file includes the first one in several places */
+	if (self < 0) {
+		fprintf(fp, "include \"f0.conf\";\n");
+		reload_random_body(fp, seed, 1, self);
+		fprintf(fp, "node server {\ninclude \"f0.conf\";\n");
+		reload_random_body(fp, seed, 1, self);
+		fprintf(fp, "}\n");
+	} else
+		reload_random_body(fp, seed, 0, self);
+	fclose(fp);
+	return rename(tmp, path) == 0;
+}
+
+static char *
+reload_random_print(curly_node_t *cfg)
+{
+	char *data = NULL;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&data, &len);
+	curly_node_write_fp(cfg, fp);
+	fclose(fp);
+	return data;
+}
+
+static bool
+reload_random_test(const char *dir, unsigned int count)
+{
+	char path[PATH_MAX];
+	unsigned int seed, step, i;
+	curly_node_t *cfg, *fresh;
+	bool ok = true;
+	int rv;
+
+	snprintf(path, sizeof(path), "%s/main.conf", dir);
+	for (seed = 1; ok && seed <= count; ++seed) {
+		unsigned int state = seed;
+
+		for (i = 0; i < RELOAD_RANDOM_FILES; ++i)
+			reload_random_write(dir, &state, i);
+		reload_random_write(dir, &state, -1);
+		if (!(cfg = curly_node_read(path)))
+			continue;
+
+		for (step = 0; ok && step < RELOAD_RANDOM_STEPS; ++step) {
+			char *a, *b;
+
+			/* Mostly change include files, sometimes the
+			 * top-level file, too */
+			for (i = 1 + rand_r(&state) % 2; i--; ) {
+				if (rand_r(&state) % 8)
+					reload_random_write(dir, &state, rand_r(&state) % RELOAD_RANDOM_FILES);
+				else
+					reload_random_write(dir, &state, -1);
+			}
+
+			rv = curly_node_reload(cfg, NULL, NULL);
+			fresh = curly_node_read(path);
+			if ((rv < 0) != (fresh == NULL)) {
+				printf("seed %u, step %u: reload returned %d, but reading the config %s\n",
+						seed, step, rv, fresh? "works" : "fails");
+				ok = false;
+			} else if (fresh) {
+				a = reload_random_print(cfg);
+				b = reload_random_print(fresh);
+				if (strcmp(a, b)) {
+					printf("seed %u, step %u: reloaded config differs\n%s--- should be\n%s", seed, step, a, b);
+					ok = false;
+				}
+				free(a);
+				free(b);
+			}
+			if (fresh)
+				curly_node_free(fresh);
+		}
+		curly_node_free(cfg);
+	}
+	return ok;
+}
+
+/*
+ * Modify the node at the end of the first children of cfg. Copies on
+ * write of cfg must not see the change.
+ */
+static void
+modify_deep(curly_node_t *cfg)
+{
+	curly_node_t *child;
+	curly_iter_t iter;
+
+	while (true) {
+		curly_iter_init(&iter, cfg, NULL);
+		child = curly_iter_next_node(&iter);
+		curly_iter_destroy(&iter);
+		if (child == NULL)
+			break;
+		cfg = child;
+	}
+
+	curly_node_set_attr(cfg, "cow-leak", "yes");
+	curly_node_add_child(cfg, "cow", "leak");
+}
+
+/*
+ * Apply a few changes to a journaled config, and rebuild it from
+ * the base file and the log. Optionally compact the journal and
+ * rebuild it again.
+ */
+static curly_node_t *
+journal_test(const char *filename, const char *logfile, bool compact)
+{
+	curly_journal_t *journal;
+	curly_node_t *cfg, *node, *child;
+
+	if (!(cfg = curly_journal_replay(filename, logfile)))
+		return NULL;
+	if (!(journal = curly_journal_open(cfg, filename, logfile)))
+		goto failed;
+
+	if ((node = curly_node_get_child(cfg, "node", "server")) != NULL) {
+		curly_node_set_attr(node, "priority", "1");
+		curly_node_add_attr_list(node, "alias", "srv");
+		curly_node_add_attr_list(node, "alias", "server1");
+		curly_node_set_attr(node, "name", NULL);
+	}
+
+	if ((node = curly_node_add_child(cfg, "node", "backup")) != NULL) {
+		curly_node_set_attr(node, "ipaddr", "192.168.1.3");
+		if ((child = curly_node_add_child(node, "interface", "eth0")) != NULL)
+			curly_node_set_attr(child, "mtu", "9000");
+	}
+
+	if ((node = curly_node_get_child(cfg, "node", "client")) != NULL)
+		curly_node_drop_child(cfg, node);
+
+	curly_journal_close(journal);
+	curly_node_free(cfg);
+
+	if (!(cfg = curly_journal_replay(filename, logfile)))
+		return NULL;
+	if (!compact)
+		return cfg;
+
+	if (!(journal = curly_journal_open(cfg, filename, logfile)))
+		goto failed;
+	if (curly_journal_compact(journal) < 0) {
+		curly_journal_close(journal);
+		goto failed;
+	}
+	curly_journal_close(journal);
+	curly_node_free(cfg);
+
+	return curly_journal_replay(filename, logfile);
+
+failed:
+	curly_node_free(cfg);
+	return NULL;
+}
+
+/*
+ * Check that every child and attribute of a frozen tree, or of a copy
+ * on write, can be found by lookup
+ */
+static bool
+verify_frozen(curly_node_t *node)
+{
+	curly_iter_t *iter;
+	curly_node_t *child;
+	curly_attr_t *attr;
+	bool ok = true;
+
+	iter = curly_node_iterate(node);
+	while (ok && (attr = curly_iter_next_attr(iter)) != NULL) {
+		const char *name = curly_attr_get_name(attr);
+
+		if (curly_node_get_attr_list(node, name) != curly_attr_get_values(attr)) {
+			fprintf(stderr, "frozen lookup of attribute %s failed\n", name);
+			ok = false;
+		}
+	}
+
+	while (ok && (child = curly_iter_next_node(iter)) != NULL) {
+		const char *type = curly_node_type(child);
+		const char *name = curly_node_name(child);
+		curly_node_t *found;
+
+		if (type && name) {
+			found = curly_node_get_child(node, type, name);
+			if (found == NULL || curly_node_type(found) != type || curly_node_name(found) != name) {
+				fprintf(stderr, "frozen lookup of %s %s failed\n", type, name);
+				ok = false;
+			}
+		}
+		ok = ok && verify_frozen(child);
+	}
+	curly_iter_free(iter);
+
+	return ok;
+}
+
+/*
+ * Look up a compiled path. If it refers to an attribute, change it and
+ * look it up again, which must not return the cached value.
+ */
+static void
+query_test(curly_node_t *cfg, const char *string)
+{
+	char changed[256];
+	const char *value, *attr;
+	curly_path_t *path;
+	curly_node_t *node;
+
+	if (!(path = curly_path_compile(string))) {
+		printf("%s: invalid\n", string);
+		return;
+	}
+
+	node = curly_node_lookup(cfg, path);
+	value = curly_node_lookup_attr(cfg, path);
+	if (node == NULL || curly_node_lookup(cfg, path) != node) {
+		printf("%s: not found\n", string);
+	} else if (value == NULL && string[strlen(string) - 1] != ']') {
+		printf("%s: no value\n", string);
+	} else if (value == NULL) {
+		printf("%s: %s %s\n", string, curly_node_type(node), curly_node_name(node)?: "");
+	} else {
+		printf("%s = %s\n", string, value);
+
+		attr = strrchr(string, '/')? strrchr(string, '/') + 1 : string;
+		snprintf(changed, sizeof(changed), "%s-changed", value);
+		curly_node_set_attr(node, attr, changed);
+		printf("  after change = %s\n", curly_node_lookup_attr(cfg, path));
+	}
+
+	curly_path_free(path);
+}
+
+/*
+ * Evaluate a selector, first with a small buffer, then with one large
+ * enough for all matches
+ */
+static void
+select_test(curly_node_t *cfg, const char *string)
+{
+	curly_selector_t *sel;
+	void *small[2], **results = small;
+	unsigned int i, count, max = 2;
+
+	if (!(sel = curly_selector_compile(string))) {
+		printf("%s: invalid\n", string);
+		return;
+	}
+
+	while (true) {
+		if (curly_selector_selects_attr(sel))
+			count = curly_node_select_values(cfg, sel, (const char **) results, max);
+		else
+			count = curly_node_select(cfg, sel, (curly_node_t **) results, max);
+		if (count <= max)
+			break;
+
+		results = calloc(count, sizeof(results[0]));
+		max = count;
+	}
+
+	printf("%s: %u matches\n", string, count);
+	for (i = 0; i < count; ++i) {
+		if (curly_selector_selects_attr(sel)) {
+			printf("  %s\n", (const char *) results[i]);
+		} else {
+			curly_node_t *node = results[i];
+
+			printf("  %s %s\n", curly_node_type(node), curly_node_name(node)?: "");
+		}
+	}
+
+	if (results != small)
+		free(results);
+	curly_selector_free(sel);
+}
+
+/*
+ * Get a typed attribute, given as kind:path. For integers, also change
+ * the attribute and make sure the cached value is dropped.
+ */
+static void
+typed_test(curly_node_t *cfg, const char *spec)
+{
+	const char *string, *attr;
+	curly_path_t *path;
+	curly_node_t *node;
+	char kind[16];
+	bool ok = false;
+
+	if (!(string = strchr(spec, ':')) || string - spec >= (int) sizeof(kind)
+	 || !(path = curly_path_compile(string + 1))) {
+		printf("%s: invalid\n", spec);
+		return;
+	}
+	snprintf(kind, sizeof(kind), "%.*s", (int) (string - spec), spec);
+	attr = strrchr(string, '/') + 1;
+	node = curly_node_lookup(cfg, path);
+
+	fflush(stdout);
+	if (node == NULL) {
+		/* nothing */
+	} else if (!strcmp(kind, "int")) {
+		int value;
+
+		if ((ok = curly_node_get_int(node, attr, &value))) {
+			printf("%s = %d\n", spec, value);
+			curly_node_set_attr(node, attr, "-1");
+			if (curly_node_get_int(node, attr, &value))
+				printf("  after change = %d\n", value);
+		}
+	} else if (!strcmp(kind, "uint64")) {
+		uint64_t value;
+
+		if ((ok = curly_node_get_uint64(node, attr, &value)))
+			printf("%s = %llu\n", spec, (unsigned long long) value);
+	} else if (!strcmp(kind, "bool")) {
+		bool value;
+
+		if ((ok = curly_node_get_bool(node, attr, &value)))
+			printf("%s = %s\n", spec, value? "true" : "false");
+	} else if (!strcmp(kind, "duration")) {
+		uint64_t value;
+
+		if ((ok = curly_node_get_duration(node, attr, &value)))
+			printf("%s = %llu ms\n", spec, (unsigned long long) value);
+	} else if (!strcmp(kind, "ipv4")) {
+		curly_ipv4_prefix_t value;
+
+		if ((ok = curly_node_get_ipv4_prefix(node, attr, &value)))
+			printf("%s = %u.%u.%u.%u/%u\n", spec, value.addr[0], value.addr[1],
+					value.addr[2], value.addr[3], value.len);
+	} else if (!strcmp(kind, "ipv6")) {
+		uint8_t value[16];
+		unsigned int i;
+
+		if ((ok = curly_node_get_ipv6(node, attr, value))) {
+			printf("%s =", spec);
+			for (i = 0; i < 16; ++i)
+				printf(" %02x", value[i]);
+			printf("\n");
+		}
+	}
+	fflush(stderr);
+
+	if (!ok)
+		printf("%s: no value\n", spec);
+	curly_path_free(path);
+}
+
+/*
+ * List the children of a given type, given as type:path; an empty type
+ * lists all children. Check that the iterator, the visitor and
+ * curly_node_get_children() agree.
+ */
+static int
+count_child(curly_node_t *child, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+	return 0;
+}
+
+static void
+children_test(curly_node_t *cfg, const char *spec)
+{
+	const char *string, **names;
+	curly_node_t *node = cfg, *child;
+	curly_path_t *path = NULL;
+	curly_iter_t iter;
+	unsigned int n = 0, visited = 0;
+	char type[64];
+
+	if (!(string = strchr(spec, ':')) || string - spec >= (int) sizeof(type)
+	 || (string[1] && !(path = curly_path_compile(string + 1)))) {
+		printf("%s: invalid\n", spec);
+		return;
+	}
+	snprintf(type, sizeof(type), "%.*s", (int) (string - spec), spec);
+
+	if (path && !(node = curly_node_lookup(cfg, path))) {
+		printf("%s: not found\n", spec);
+		curly_path_free(path);
+		return;
+	}
+
+	printf("%s:\n", spec);
+	names = curly_node_get_children(node, type[0]? type : NULL);
+
+	curly_iter_init(&iter, node, type[0]? type : NULL);
+	while ((child = curly_iter_next_node(&iter)) != NULL) {
+		printf("  %s %s\n", curly_node_type(child), curly_node_name(child)?: "");
+		if (names[n] != curly_node_name(child))
+			printf("  curly_node_get_children() returned %s\n", names[n]?: "NULL");
+		if (names[n])
+			n++;
+	}
+	curly_iter_destroy(&iter);
+
+	if (names[n])
+		printf("  curly_node_get_children() returned extra %s\n", names[n]);
+
+	curly_node_foreach_child(node, type[0]? type : NULL, count_child, &visited);
+	if (visited != n)
+		printf("  visited %u children instead of %u\n", visited, n);
+
+	free(names);
+	if (path)
+		curly_path_free(path);
+}
+
+/*
+ * Compare a tree with the one in another file. Walk both, descending
+ * only into children whose hashes differ, and report what changed.
+ */
+static void
+diff_nodes(curly_node_t *a, curly_node_t *b, const char *path)
+{
+	const char **names;
+	curly_node_t *child, *other;
+	curly_iter_t iter;
+	char child_path[512];
+	unsigned int n;
+
+	if (curly_node_hash(a) == curly_node_hash(b))
+		return;
+
+	names = curly_node_get_attr_names(a);
+	for (n = 0; names[n]; ++n) {
+		const char * const *va = curly_node_get_attr_list(a, names[n]);
+		const char * const *vb = curly_node_get_attr_list(b, names[n]);
+
+		while (vb && *va && *vb && !strcmp(*va, *vb))
+			va++, vb++;
+		if (vb == NULL || *va || *vb)
+			printf("  changed %s/%s\n", path, names[n]);
+	}
+	free(names);
+
+	names = curly_node_get_attr_names(b);
+	for (n = 0; names[n]; ++n) {
+		if (curly_node_get_attr(a, names[n]) == NULL)
+			printf("  added %s/%s\n", path, names[n]);
+	}
+	free(names);
+
+	curly_iter_init(&iter, a, NULL);
+	while ((child = curly_iter_next_node(&iter)) != NULL) {
+		snprintf(child_path, sizeof(child_path), "%s/%s[%s]", path,
+				curly_node_type(child), curly_node_name(child)?: "");
+		other = curly_node_get_child(b, curly_node_type(child), curly_node_name(child));
+		if (other == NULL)
+			printf("  removed %s\n", child_path);
+		else
+			diff_nodes(child, other, child_path);
+	}
+	curly_iter_destroy(&iter);
+
+	curly_iter_init(&iter, b, NULL);
+	while ((child = curly_iter_next_node(&iter)) != NULL) {
+		if (curly_node_get_child(a, curly_node_type(child), curly_node_name(child)) == NULL)
+			printf("  added %s/%s[%s]\n", path, curly_node_type(child), curly_node_name(child)?: "");
+	}
+	curly_iter_destroy(&iter);
+}
+
+static void
+diff_test(curly_node_t *cfg, const char *filename)
+{
+	curly_node_t *other;
+
+	if (!(other = curly_node_read(filename))) {
+		printf("%s: unable to read\n", filename);
+		return;
+	}
+
+	printf("%s: %s\n", filename, curly_node_equal(cfg, other)? "equal" : "differs");
+	if ((curly_node_hash(cfg) == curly_node_hash(other)) != curly_node_equal(cfg, other))
+		printf("  hash does not agree with comparison\n");
+	diff_nodes(cfg, other, "");
+
+	curly_node_free(other);
+}
+
+/*
+ * Publish the tree repeatedly while several threads read it
+ */
+#define PUBLISH_READERS		4
+#define PUBLISH_ROUNDS		50
+
+struct publish_test {
+	curly_snapshot_t *	snap;
+	bool			done;
+	bool			failed;
+};
+
+static void *
+publish_reader(void *arg)
+{
+	struct publish_test *test = arg;
+	curly_node_t *tree;
+
+	while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE)) {
+		tree = curly_snapshot_acquire(test->snap);
+		if (tree == NULL || !verify_frozen(tree))
+			__atomic_store_n(&test->failed, true, __ATOMIC_RELAXED);
+		curly_snapshot_release(tree);
+	}
+	return NULL;
+}
+
+static curly_node_t *
+publish_test(const char *filename, curly_node_t *cfg)
+{
+	struct publish_test test = { .snap = curly_snapshot_new() };
+	pthread_t readers[PUBLISH_READERS];
+	unsigned int i;
+
+	curly_snapshot_publish(test.snap, cfg);
+	for (i = 0; i < PUBLISH_READERS; ++i)
+		pthread_create(&readers[i], NULL, publish_reader, &test);
+
+	for (i = 0; i < PUBLISH_ROUNDS; ++i) {
+		if (!(cfg = curly_node_read(filename)))
+			break;
+		curly_snapshot_publish(test.snap, cfg);
+	}
+
+	__atomic_store_n(&test.done, true, __ATOMIC_RELEASE);
+	for (i = 0; i < PUBLISH_READERS; ++i)
+		pthread_join(readers[i], NULL);
+
+	cfg = curly_snapshot_acquire(test.snap);
+	curly_snapshot_free(test.snap);
+
+	if (test.failed) {
+		curly_snapshot_release(cfg);
+		return NULL;
+	}
+	return cfg;
+}
+
+/*
+ * Look up everything in a copy on write from several threads at once
+ */
+static void *
+share_reader(void *arg)
+{
+	return verify_frozen(arg)? arg : NULL;
+}
+
+static bool
+share_test(curly_node_t *copy)
+{
+	pthread_t readers[PUBLISH_READERS];
+	unsigned int i;
+	bool ok = true;
+	void *rv;
+
+	for (i = 0; i < PUBLISH_READERS; ++i)
+		pthread_create(&readers[i], NULL, share_reader, copy);
+	for (i = 0; i < PUBLISH_READERS; ++i) {
+		pthread_join(readers[i], &rv);
+		if (rv == NULL)
+			ok = false;
+	}
+	return ok;
+}
+
 int
 main(int argc, char **argv)
 {
 	const char *filename;
+	bool opt_buffer = false;
+	bool opt_events = false;
+	bool opt_parallel = false;
+	bool opt_compact = false;
+	bool opt_cache = false;
+	bool opt_sources = false;
+	bool opt_arena = false;
+	bool opt_share = false;
+	bool opt_freeze = false;
+	bool opt_publish = false;
+	const char *opt_query[16];
+	unsigned int nqueries = 0;
+	const char *opt_select[16];
+	unsigned int nselects = 0;
+	const char *opt_typed[32];
+	unsigned int ntyped = 0;
+	const char *opt_children[16];
+	unsigned int nchildren = 0;
+	const char *opt_diff[16];
+	unsigned int ndiffs = 0;
+	char *opt_reload[8];
+	unsigned int nreloads = 0;
+	unsigned int opt_random = 0, i;
+	char *opt_journal = NULL;
 	curly_node_t *cfg;
+	int c;
 
-	if (argc <= 1) {
+	while ((c = getopt(argc, argv, "Abcd:CefFj:l:pPq:r:R:s:St:")) != -1) {
+		switch (c) {
+		case 'A':
+			opt_arena = true;
+			break;
+		case 'b':
+			opt_buffer = true;
+			break;
+		case 'c':
+			opt_compact = true;
+			break;
+		case 'C':
+			opt_cache = true;
+			break;
+		case 'f':
+			opt_sources = true;
+			break;
+		case 'd':
+			if (ndiffs < 16)
+				opt_diff[ndiffs++] = optarg;
+			break;
+		case 'e':
+			opt_events = true;
+			break;
+		case 'F':
+			opt_freeze = true;
+			break;
+		case 'j':
+			opt_journal = optarg;
+			break;
+		case 'l':
+			if (nchildren < 16)
+				opt_children[nchildren++] = optarg;
+			break;
+		case 'p':
+			opt_parallel = true;
+			break;
+		case 'P':
+			opt_publish = true;
+			break;
+		case 'q':
+			if (nqueries < 16)
+				opt_query[nqueries++] = optarg;
+			break;
+		case 'r':
+			if (nreloads < 8)
+				opt_reload[nreloads++] = optarg;
+			break;
+		case 'R':
+			opt_random = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (nselects < 16)
+				opt_select[nselects++] = optarg;
+			break;
+		case 't':
+			if (ntyped < 32)
+				opt_typed[ntyped++] = optarg;
+			break;
+		case 'S':
+			opt_share = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: curlies-test [-b|-e|-p|-C|-A] [-f] [-r from:to[,from:to...] ...] [-R count] [-j logfile [-c]] [-S|-F|-P] [-q path ...] [-s selector ...] [-t kind:path ...] [-l type:path ...] [-d file ...] filename\n");
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
 		fprintf(stderr, "Missing file name argument\n");
 		return 1;
 	}
 
-	filename = argv[1];
-	cfg = curly_node_read(filename);
+	filename = argv[optind];
+	if (opt_random)
+		return reload_random_test(filename, opt_random)? 0 : 1;
+
+	if (opt_journal)
+		cfg = journal_test(filename, opt_journal, opt_compact);
+	else if (opt_buffer)
+		cfg = read_from_buffer(filename);
+	else if (opt_events)
+		cfg = read_from_events(filename);
+	else if (opt_parallel)
+		cfg = curly_node_read_flags(filename, CURLY_READ_F_PARALLEL);
+	else if (opt_cache)
+		cfg = curly_node_read_flags(filename, CURLY_READ_F_CACHE);
+	else if (opt_arena)
+		cfg = curly_node_read_flags(filename, CURLY_READ_F_ARENA);
+	else
+		cfg = curly_node_read(filename);
 	if (cfg == NULL) {
 		fprintf(stderr, "Unable to parse file \"%s\"\n", filename);
 		return 1;
 	}
 
-	curly_node_write_fp(cfg, stdout);
+	for (i = 0; i < nreloads; ++i) {
+		if (!reload(cfg, opt_reload[i])) {
+			fprintf(stderr, "Unable to reload file \"%s\"\n", filename);
+			return 1;
+		}
+	}
+
+	/* Make a copy on write, modify the original deep down, and free
+	 * it before printing the copy */
+	if (opt_share) {
+		curly_node_t *copy = curly_node_new();
+		uint64_t hash;
+
+		curly_node_copy_cow(copy, cfg);
+		hash = curly_node_hash(copy);
+		if (!share_test(copy)) {
+			fprintf(stderr, "Concurrent readers of a copy of \"%s\" failed\n", filename);
+			return 1;
+		}
+		modify_deep(cfg);
+		if (curly_node_hash(copy) != hash) {
+			fprintf(stderr, "Copy on write of \"%s\" changed along with the original\n", filename);
+			return 1;
+		}
+
+		curly_node_free(cfg);
+		cfg = copy;
+	}
+
+	/* Freeze the tree, and free the original before printing the snapshot */
+	if (opt_freeze) {
+		curly_node_t *frozen = curly_node_freeze(cfg);
+
+		curly_node_free(cfg);
+		cfg = frozen;
+
+		if (!curly_node_is_frozen(cfg) || !verify_frozen(cfg)) {
+			fprintf(stderr, "Bad frozen copy of \"%s\"\n", filename);
+			return 1;
+		}
+	}
+
+	if (opt_publish && !(cfg = publish_test(filename, cfg))) {
+		fprintf(stderr, "Concurrent readers of \"%s\" failed\n", filename);
+		return 1;
+	}
+
+	if (opt_sources || nqueries || nselects || ntyped || nchildren || ndiffs) {
+		unsigned int i;
+
+		if (opt_sources)
+			sources_test(cfg);
+		for (i = 0; i < nqueries; ++i)
+			query_test(cfg, opt_query[i]);
+		for (i = 0; i < nselects; ++i)
+			select_test(cfg, opt_select[i]);
+		for (i = 0; i < ntyped; ++i)
+			typed_test(cfg, opt_typed[i]);
+		for (i = 0; i < nchildren; ++i)
+			children_test(cfg, opt_children[i]);
+		for (i = 0; i < ndiffs; ++i)
+			diff_test(cfg, opt_diff[i]);
+	} else {
+		curly_node_write_fp(cfg, stdout);
+	}
 
 	curly_node_free(cfg);
 
@@ -0,0 +1,27 @@
+#!/usr/bin/python3
+
+# Run from top level source directory with
+# LD_PRELOAD=library/libcurlies.so PYTHONPATH=python
+
+import os
+import curly
+
+filename = "output/python/children.conf"
+
+os.makedirs(os.path.dirname(filename), exist_ok = True)
+with open(filename, "wb") as f:
+	f.write(b'node good {\n}\nnetwork "\xff" {\n}\n')
+
+cfg = curly.Config(filename)
+node = cfg.tree()
+
+assert(node.get_children("node") == ["good"])
+
+# A name that isn't valid UTF-8 raises an exception
+try:
+	node.get_children("network")
+	assert(False)
+except UnicodeDecodeError:
+	pass
+
+print("OK")